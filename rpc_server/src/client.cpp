@@ -6,7 +6,17 @@
 #include <string>       
 #include <unistd.h>     // sleep
 #include <sys/wait.h>   // wait
+#include <chrono>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <algorithm>    // std::count, std::sort
+#include <memory>       // std::unique_ptr
+#include <arpa/inet.h>  // htonl
 #include "rpc.h"
+#include "rpcAsync.h"
+#include "rpcPool.h"
 #include "rpc.pb.h"     // Google Protocol Buffers generated header
 #include "stopWatch.h"  // CStopWatch
 
@@ -14,7 +24,9 @@
 class RpcClient : public CRpcClient
 {
 public:
-    RpcClient() = default; 
+    RpcClient(TRANSPORT transport = TRANSPORT::SUNRPC)
+        : CRpcClient(transport), transportName(transport == TRANSPORT::NATIVE ? "native" :
+                                            transport == TRANSPORT::SHM ? "shm" : "sunrpc") {}
     virtual ~RpcClient() = default;
     void EnableLogInfo(bool enable) { logInfoEnabled = enable; }
     void EnableLogError(bool enable) { logErrorEnabled = enable; }
@@ -88,6 +100,92 @@ public:
         return true;
     }
 
+    bool TestPipeline(int numRpcs, int depth, const char* network)
+    {
+        protorpc::EchoRequest req;
+        protorpc::EchoResponse resp;
+        req.set_msg("Client pid=" + std::to_string(getpid()) + ", pipeline test");
+
+        // Keep up to depth requests in flight, send the next one as soon as a reply arrives
+        int sent = 0;
+        int received = 0;
+        uint32_t reqId = 0;
+
+        auto start = std::chrono::steady_clock::now();
+        while(received < numRpcs)
+        {
+            while(sent < numRpcs && sent - received < depth)
+            {
+                if(Send(protorpc::RPC_ECHO, &req, reqId) != RPC_SUCCESS)
+                {
+                    printf("%s: Send() failed\n", __func__);
+                    return false;
+                }
+                sent++;
+            }
+
+            if(Receive(reqId, &resp) != RPC_SUCCESS || resp.msg() != req.msg())
+            {
+                printf("%s: Receive() failed\n", __func__);
+                return false;
+            }
+            received++;
+        }
+        std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+
+        printf("%-5s %-8s depth %4d: %8d calls: %8.2f usec/call, %10.0f calls/sec\n",
+               network, transportName, depth, numRpcs,
+               elapsed.count() * 1e6 / numRpcs, numRpcs / elapsed.count());
+        return true;
+    }
+
+    bool TestDataIov()
+    {
+        // The request is sent as three segments without joining them first
+        const char* parts[] = { "Hello ", "from RPC ", "client (iov)!" };
+        struct iovec iov[3];
+        for(int i = 0; i < 3; ++i)
+        {
+            iov[i].iov_base = (void*)parts[i];
+            iov[i].iov_len = strlen(parts[i]);
+        }
+
+        void* resp = NULL;
+        size_t respSize = 0;
+
+        clnt_stat res = Call(protorpc::RPC_DATA, iov, 3, resp, respSize);
+        if(res != RPC_SUCCESS)
+        {
+            printf("%s: Call() failed\n", __func__);
+            return false;
+        }
+
+        std::string val((const char*)resp, respSize);
+        printf("%s: Call() resp='%s'\n", __func__, val.c_str());
+        if(resp)
+            free(resp); // Clean up...
+
+        // Protobuf request split in two segments
+        protorpc::EchoRequest req;
+        protorpc::EchoResponse echoResp;
+        req.set_msg("Hello from RPC client (iov)!");
+
+        std::string data = req.SerializeAsString();
+        iov[0].iov_base = (void*)data.data();
+        iov[0].iov_len = data.size() / 2;
+        iov[1].iov_base = (void*)(data.data() + iov[0].iov_len);
+        iov[1].iov_len = data.size() - iov[0].iov_len;
+
+        if(Call(protorpc::RPC_ECHO, iov, 2, &echoResp) != RPC_SUCCESS || echoResp.msg() != req.msg())
+        {
+            printf("%s: Call() failed\n", __func__);
+            return false;
+        }
+
+        printf("%s: Call() resp='%s'\n", __func__, echoResp.msg().c_str());
+        return true;
+    }
+
     bool TestPing()
     {
         // Send an empty Ping message
@@ -113,6 +211,39 @@ public:
         return true;
     }
 
+    bool TestLatency(int numRpcs, const char* network)
+    {
+        protorpc::EchoRequest req;
+        protorpc::EchoResponse resp;
+        req.set_msg("Client pid=" + std::to_string(getpid()) + ", latency test");
+
+        // Warm up the connection first
+        for(int i = 0; i < 100; ++i)
+        {
+            if(Call(protorpc::RPC_ECHO, &req, &resp) != RPC_SUCCESS)
+            {
+                printf("%s: Call() failed\n", __func__);
+                return false;
+            }
+        }
+
+        auto start = std::chrono::steady_clock::now();
+        for(int i = 0; i < numRpcs; ++i)
+        {
+            if(Call(protorpc::RPC_ECHO, &req, &resp) != RPC_SUCCESS)
+            {
+                printf("%s: Call() failed\n", __func__);
+                return false;
+            }
+        }
+        std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+
+        printf("%-5s %-8s %8d calls: %8.2f usec/call, %10.0f calls/sec\n",
+               network, transportName, numRpcs,
+               elapsed.count() * 1e6 / numRpcs, numRpcs / elapsed.count());
+        return true;
+    }
+
     bool TestShutdown()
     {
         // Send an empty Ping message
@@ -154,6 +285,251 @@ private:
     
     bool logInfoEnabled = true;
     bool logErrorEnabled = true;
+    const char* transportName = nullptr;
+};
+
+class RpcAsyncClient : public CRpcAsyncClient
+{
+public:
+    RpcAsyncClient(int numConnections) : CRpcAsyncClient(numConnections) {}
+    virtual ~RpcAsyncClient() = default;
+
+    // Every thread waits for the future of its call before making the next one
+    bool TestFutures(int numThreads, int numRpcs)
+    {
+        std::atomic<int> failed(0);
+        std::vector<std::thread> threads;
+
+        auto start = std::chrono::steady_clock::now();
+        for(int t = 0; t < numThreads; ++t)
+        {
+            threads.emplace_back([this, t, numRpcs, &failed]()
+            {
+                protorpc::EchoRequest req;
+                protorpc::EchoResponse resp;
+                req.set_msg("Client thread " + std::to_string(t) + ", futures test");
+
+                for(int i = 0; i < numRpcs; ++i)
+                {
+                    if(Call(protorpc::RPC_ECHO, &req, &resp).get() != RPC_SUCCESS || resp.msg() != req.msg())
+                        failed++;
+                }
+            });
+        }
+
+        for(std::thread& thread : threads)
+            thread.join();
+        std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+
+        int total = numThreads * numRpcs;
+        printf("futures   %3d threads  %8d calls: %10.0f calls/sec, %d failed\n",
+               numThreads, total, total / elapsed.count(), failed.load());
+        return (failed == 0);
+    }
+
+    // One thread keeps up to depth calls in flight, the callbacks count the replies
+    bool TestCallbacks(int depth, int numRpcs)
+    {
+        protorpc::EchoRequest req;
+        req.set_msg("Client pid=" + std::to_string(getpid()) + ", callbacks test");
+
+        CWindow window = RunWindow(numRpcs, depth, [&](int /*i*/, const done_t& done)
+        {
+            return CallAsync(protorpc::RPC_ECHO, &req, [done](clnt_stat res, const CRpc::param* /*resp*/)
+            {
+                done(res == RPC_SUCCESS, false);
+            });
+        });
+
+        printf("callbacks depth %4d  %8d calls: %10.0f calls/sec, %d failed\n",
+               depth, numRpcs, numRpcs / window.seconds, window.failed);
+        return (window.failed == 0);
+    }
+
+    // Ping calls with a slow call every slowEvery calls, depth calls in
+    // flight on one connection. Prints the Ping latency percentiles.
+    bool TestMixed(int numRpcs, int depth, int slowEvery, uint32_t slowMs, bool ordered)
+    {
+        SetOrderedReplies(ordered);
+
+        uint32_t sleepReq = htonl(slowMs);
+
+        CWindow window = RunWindow(numRpcs, depth, [&](int i, const done_t& done)
+        {
+            bool slow = (i % slowEvery == 0);
+            auto callback = [done, slow](clnt_stat res, const CRpc::param* /*resp*/)
+            {
+                done(res == RPC_SUCCESS, !slow);
+            };
+
+            return (slow ? CallAsync(protorpc::RPC_SLEEP, &sleepReq, sizeof(sleepReq), callback)
+                         : CallAsync(protorpc::RPC_PING, nullptr, 0, callback));
+        });
+
+        printf("mixed %-9s depth %3d, 1 in %d calls takes %u ms: %8d calls: %8.0f calls/sec, "
+               "ping p50 %8.0f us, p99 %8.0f us, max %8.0f us, %d failed\n",
+               (ordered ? "ordered" : "any order"), depth, slowEvery, slowMs, numRpcs, numRpcs / window.seconds,
+               window.Percentile(0.50), window.Percentile(0.99), window.Percentile(1.0), window.failed);
+        return (window.failed == 0);
+    }
+
+    // depth Fanout calls in flight, each one waits on the server for fanout
+    // downstream calls that take ms each. Prints the most threads the server
+    // had while it served them.
+    bool TestFanout(int numRpcs, int depth, int fanout, uint32_t ms)
+    {
+        std::atomic<int> serverThreads(0);
+
+        uint32_t req[2] = { htonl((uint32_t)fanout), htonl(ms) };
+
+        CWindow window = RunWindow(numRpcs, depth, [&](int /*i*/, const done_t& done)
+        {
+            return CallAsync(protorpc::RPC_FANOUT, req, sizeof(req), [done, &serverThreads](clnt_stat res, const CRpc::param* resp)
+            {
+                uint32_t reply[2] = { 0, 0 };
+                bool ok = (res == RPC_SUCCESS && resp->data_len == sizeof(reply));
+                if(ok)
+                    memcpy(reply, resp->data_val, sizeof(reply));
+
+                int threads = (int)ntohl(reply[1]);
+                int seen = serverThreads;
+                while(threads > seen && !serverThreads.compare_exchange_weak(seen, threads))
+                    ;
+
+                done(ok && reply[0] == 0, true);
+            });
+        });
+
+        printf("fanout depth %4d x %d downstream calls of %u ms: %6d calls: %7.0f calls/sec, "
+               "p50 %6.0f us, p99 %6.0f us, %d server threads, %d failed\n",
+               depth, fanout, ms, numRpcs, numRpcs / window.seconds,
+               window.Percentile(0.50), window.Percentile(0.99), serverThreads.load(), window.failed);
+        return (window.failed == 0);
+    }
+
+private:
+    // What RunWindow measured
+    struct CWindow
+    {
+        int failed = 0;
+        double seconds = 0;
+        std::vector<double> latencies; // usec, sorted
+
+        double Percentile(double p) const
+        {
+            return (latencies.empty() ? 0.0 : latencies[(size_t)(p * (latencies.size() - 1))]);
+        }
+    };
+
+    // Called once by the callback of a call: whether it succeeded, and
+    // whether its latency counts
+    typedef std::function<void(bool ok, bool timed)> done_t;
+
+    // Keep up to depth calls in flight until numRpcs are done. send(i, done)
+    // starts call i with CallAsync and returns its status, the callback of
+    // the call calls done.
+    template<typename SEND>
+    CWindow RunWindow(int numRpcs, int depth, SEND send)
+    {
+        CWindow window;
+        window.latencies.reserve(numRpcs);
+
+        std::mutex mutex;
+        std::condition_variable cond;
+        int inFlight = 0;
+        int completed = 0;
+
+        auto complete = [&](bool ok, bool timed, std::chrono::steady_clock::time_point sent)
+        {
+            std::chrono::duration<double, std::micro> latency = std::chrono::steady_clock::now() - sent;
+            std::lock_guard<std::mutex> lock(mutex);
+            if(!ok)
+                window.failed++;
+            else if(timed)
+                window.latencies.push_back(latency.count());
+            completed++;
+            inFlight--;
+            cond.notify_one();
+        };
+
+        auto start = std::chrono::steady_clock::now();
+        for(int i = 0; i < numRpcs; ++i)
+        {
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                cond.wait(lock, [&]() { return inFlight < depth; });
+                inFlight++;
+            }
+
+            auto sent = std::chrono::steady_clock::now();
+            done_t done = [&complete, sent](bool ok, bool timed) { complete(ok, timed, sent); };
+            if(send(i, done) != RPC_SUCCESS)
+                complete(false, false, sent);
+        }
+
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            cond.wait(lock, [&]() { return completed == numRpcs; });
+        }
+        std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+
+        window.seconds = elapsed.count();
+        std::sort(window.latencies.begin(), window.latencies.end());
+        return window;
+    }
+
+    virtual void LogInfo(const char* msg)  { printf("[INFO]: %s\n", msg); }
+    virtual void LogError(const char* err) { printf("[ERROR]: %s\n", err); }
+};
+
+class RpcClientPool : public CRpcClientPool
+{
+public:
+    RpcClientPool(TRANSPORT transport, int maxClients) : CRpcClientPool(transport, maxClients) {}
+    virtual ~RpcClientPool() = default;
+
+    // Every thread leases a client for each call, so the threads share the connections
+    bool TestLeases(int numThreads, int numRpcs)
+    {
+        std::atomic<int> failed(0);
+        std::vector<std::thread> threads;
+
+        auto start = std::chrono::steady_clock::now();
+        for(int t = 0; t < numThreads; ++t)
+        {
+            threads.emplace_back([this, t, numRpcs, &failed]()
+            {
+                protorpc::EchoRequest req;
+                protorpc::EchoResponse resp;
+                req.set_msg("Client thread " + std::to_string(t) + ", pool test");
+
+                for(int i = 0; i < numRpcs; ++i)
+                {
+                    CLease client = Lease();
+                    if(!client || client->Call(protorpc::RPC_ECHO, &req, &resp) != RPC_SUCCESS || resp.msg() != req.msg())
+                        failed++;
+                }
+            });
+        }
+
+        for(std::thread& thread : threads)
+            thread.join();
+        std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+
+        int total = numThreads * numRpcs;
+        Stats stats = GetStats();
+        printf("pool      %3d threads  %8d calls: %10.0f calls/sec, %d failed\n",
+               numThreads, total, total / elapsed.count(), failed.load());
+        printf("          clients=%d idle=%d leases=%llu waits=%llu connects=%llu reconnects=%llu evictions=%llu\n",
+               stats.total, stats.idle, (unsigned long long)stats.leases, (unsigned long long)stats.waits,
+               (unsigned long long)stats.connects, (unsigned long long)stats.reconnects,
+               (unsigned long long)stats.evictions);
+        return (failed == 0);
+    }
+
+private:
+    virtual void LogInfo(const char* msg)  { printf("[INFO]: %s\n", msg); }
+    virtual void LogError(const char* err) { printf("[ERROR]: %s\n", err); }
 };
 
 int main(int argc, char *argv[])
@@ -168,6 +544,28 @@ int main(int argc, char *argv[])
     //const char* host = "dellse8rh1.advent.com";
     //const char* host = "opthex2zb.advent.com";
     unsigned short port = 53900;
+    const char* socketPath = "/tmp/protorpc.sock";
+
+    // Optional transport (SunRPC by default) and network (TCP by default)
+    CRpc::TRANSPORT transport = CRpc::TRANSPORT::SUNRPC;
+    bool useUnixSocket = false;
+    for(int i = 2; i < argc; i++)
+    {
+        if(!strcmp(argv[i], "native"))
+            transport = CRpc::TRANSPORT::NATIVE;
+        else if(!strcmp(argv[i], "shm"))
+            transport = CRpc::TRANSPORT::SHM;
+        else if(!strcmp(argv[i], "unix"))
+            useUnixSocket = true;
+        else if(atoi(argv[i]) > 0)
+            port = (unsigned short)atoi(argv[i]);
+    }
+
+    // Connect over TCP or over the Unix domain socket
+    auto connect = [&](RpcClient& client, bool unixSocket) -> bool
+    {
+        return (unixSocket ? client.Connect(socketPath) : client.Connect(host, port));
+    };
 
     if(argc > 1 && !strcmp(argv[1], "echo"))
     {   
@@ -187,9 +585,9 @@ int main(int argc, char *argv[])
             if(fork() == 0)
             {
                 // Child process. Run the test
-                RpcClient client;
+                RpcClient client(transport);
                 client.EnableLogInfo(false);
-                if(!client.Connect(host, port))
+                if(!connect(client, useUnixSocket))
                     return 1;
                 client.TestEcho(numRpcs);
                 return 0;
@@ -206,39 +604,329 @@ int main(int argc, char *argv[])
         
         printf("Done\n");
     }
+    else if(argc > 1 && !strcmp(argv[1], "latency"))
+    {
+        // Compare round-trip latency of SunRPC and native framing over
+        // a single TCP and Unix domain socket connection, and of shared memory
+        const int numRpcs = 100000; // Number of RPCs to send per transport
+
+        for(bool unixSocket : { false, true })
+        {
+            for(CRpc::TRANSPORT t : { CRpc::TRANSPORT::SUNRPC, CRpc::TRANSPORT::NATIVE })
+            {
+                RpcClient client(t);
+                client.EnableLogInfo(false);
+                if(!connect(client, unixSocket))
+                    return 1;
+                client.TestLatency(numRpcs, (unixSocket ? "unix" : "tcp"));
+            }
+        }
+
+        // Shared memory rings, first sleeping right away, then spinning before going to sleep
+        for(int spinCount : { 0, 100000 })
+        {
+            RpcClient client(CRpc::TRANSPORT::SHM);
+            client.EnableLogInfo(false);
+            client.SetSpinCount(spinCount);
+            if(!connect(client, true))
+                return 1;
+            client.TestLatency(numRpcs, (spinCount > 0 ? "spin" : "futex"));
+        }
+    }
+    else if(argc > 1 && !strcmp(argv[1], "pipeline"))
+    {
+        // Echo throughput on one connection with a growing number of requests in flight
+        const int numRpcs = 100000; // Number of RPCs to send per pipeline depth
+
+        if(transport == CRpc::TRANSPORT::SUNRPC)
+            transport = CRpc::TRANSPORT::NATIVE; // SunRPC can't pipeline
+
+        RpcClient client(transport);
+        client.EnableLogInfo(false);
+        if(!connect(client, useUnixSocket))
+            return 1;
+
+        for(int depth : { 1, 2, 4, 8, 16, 32, 64, 128 })
+        {
+            if(!client.TestPipeline(numRpcs, depth, (useUnixSocket ? "unix" : "tcp")))
+                return 1;
+        }
+    }
+    else if(argc > 1 && !strcmp(argv[1], "async"))
+    {
+        // Drive the server from threads of a single process instead of forking clients
+        const int numConnections = 4;
+        RpcAsyncClient client(numConnections);
+        if(!(useUnixSocket ? client.Connect(socketPath) : client.Connect(host, port)))
+            return 1;
+
+        for(int numThreads : { 1, 16, 64 })
+            client.TestFutures(numThreads, 200000 / numThreads);
+        for(int depth : { 16, 256, 1024 })
+            client.TestCallbacks(depth, 500000);
+    }
+    else if(argc > 1 && !strcmp(argv[1], "mixed"))
+    {
+        // Cheap calls sharing one connection with occasional slow ones. With
+        // handler threads (servermt staged) a Ping only waits for a slow call
+        // ahead of it when the replies have to come in order.
+        RpcAsyncClient client(1);
+        if(!(useUnixSocket ? client.Connect(socketPath) : client.Connect(host, port)))
+            return 1;
+
+        for(bool ordered : { true, false })
+            client.TestMixed(100000, 32, 100, 20, ordered);
+    }
+    else if(argc > 1 && !strcmp(argv[1], "priority"))
+    {
+        // Half of the calls are slow, and enough of them are in flight to
+        // keep every server thread busy. With one queue (servermt staged) a
+        // Ping waits for the slow calls ahead of it, with priority classes
+        // (servermt classes) only for a thread to be free.
+        RpcAsyncClient client(1);
+        if(!(useUnixSocket ? client.Connect(socketPath) : client.Connect(host, port)))
+            return 1;
+
+        client.TestMixed(4000, 256, 2, 10, false);
+    }
+    else if(argc > 1 && !strcmp(argv[1], "fanout"))
+    {
+        // Calls that each wait for 8 downstream calls, served by coserver
+        // (port 53910) in front of servermt. The server threads stay the
+        // same however many calls are in flight.
+        RpcAsyncClient client(1);
+        if(!(useUnixSocket ? client.Connect(socketPath) : client.Connect(host, port)))
+            return 1;
+
+        for(int depth : { 1, 16, 256, 1024 })
+            client.TestFanout(std::max(20 * depth, 1000), depth, 8, 10);
+    }
+    else if(argc > 1 && !strcmp(argv[1], "pool"))
+    {
+        // Many threads sharing a few connections leased from a pool
+        const int maxClients = 8;
+        RpcClientPool pool(transport, maxClients);
+        if(!(useUnixSocket ? pool.Start(socketPath) : pool.Start(host, port)))
+            return 1;
+
+        for(int numThreads : { 1, 8, 64 })
+            pool.TestLeases(numThreads, 200000 / numThreads);
+    }
+    else if(argc > 1 && !strcmp(argv[1], "connections"))
+    {
+        // Many connections open at the same time: every round sends one Echo
+        // call on each of them, then collects the replies. A server with a
+        // thread per connection only answers as many as it has threads.
+        const int numConnections = 1000;
+        const int numRounds = 20;
+        const std::chrono::seconds roundTimeout(2);
+
+        std::vector<std::unique_ptr<RpcClient>> clients;
+        for(int i = 0; i < numConnections; i++)
+        {
+            clients.emplace_back(new RpcClient(CRpc::TRANSPORT::NATIVE)); // Pipelining needs native frames
+            clients.back()->EnableLogInfo(false);
+            if(!connect(*clients.back(), useUnixSocket))
+                return 1;
+        }
+
+        protorpc::EchoRequest req;
+        protorpc::EchoResponse resp;
+        req.set_msg("Client pid=" + std::to_string(getpid()) + ", connections test");
+
+        std::vector<bool> served(numConnections, true);
+        std::vector<uint32_t> reqIds(numConnections);
+        int calls = 0;
+
+        auto start = std::chrono::steady_clock::now();
+        for(int round = 0; round < numRounds; round++)
+        {
+            for(int i = 0; i < numConnections; i++)
+            {
+                if(served[i] && clients[i]->Send(protorpc::RPC_ECHO, &req, reqIds[i]) != RPC_SUCCESS)
+                    served[i] = false;
+            }
+
+            auto deadline = std::chrono::steady_clock::now() + roundTimeout;
+            for(int i = 0; i < numConnections; i++)
+            {
+                if(!served[i])
+                    continue;
+
+                auto left = std::chrono::duration_cast<std::chrono::microseconds>(deadline - std::chrono::steady_clock::now()).count();
+                struct timeval timeout = { (time_t)(left > 0 ? left / 1000000 : 0), (suseconds_t)(left > 0 ? left % 1000000 : 0) };
+
+                clients[i]->EnableLogError(false); // Time outs are expected
+                uint32_t reqId = 0;
+                if(clients[i]->Receive(reqId, &resp, timeout) != RPC_SUCCESS || reqId != reqIds[i])
+                    served[i] = false; // Out of sync now, leave it
+                else
+                    calls++;
+            }
+        }
+        std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+
+        int numServed = (int)std::count(served.begin(), served.end(), true);
+        printf("%d connections, %d served: %d calls, %.0f calls/sec\n",
+               numConnections, numServed, calls, calls / elapsed.count());
+    }
+    else if(argc > 1 && !strcmp(argv[1], "accept"))
+    {
+        // Connection setup throughput: every thread connects, makes one call
+        // and disconnects in a loop. Compare "servermt epoll" and "servermt reuseport".
+        const int numConnects = 5000; // Connections per thread count
+
+        if(transport == CRpc::TRANSPORT::SUNRPC)
+            transport = CRpc::TRANSPORT::NATIVE; // SunRPC connections get a thread each
+
+        for(int numThreads : { 1, 2, 4, 8, 16 })
+        {
+            std::atomic<int> failed(0);
+            std::vector<std::thread> threads;
+
+            auto start = std::chrono::steady_clock::now();
+            for(int t = 0; t < numThreads; t++)
+            {
+                threads.emplace_back([&]()
+                {
+                    for(int i = 0; i < numConnects / numThreads; i++)
+                    {
+                        RpcClient client(transport);
+                        client.EnableLogInfo(false);
+                        void* resp = nullptr;
+                        size_t respSize = 0;
+                        if(!connect(client, useUnixSocket) ||
+                           client.Call(protorpc::RPC_PING, nullptr, 0, resp, respSize) != RPC_SUCCESS)
+                            failed++;
+                    }
+                });
+            }
+
+            for(std::thread& thread : threads)
+                thread.join();
+            std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+
+            int total = (numConnects / numThreads) * numThreads;
+            printf("accept    %3d threads  %8d connections: %10.0f connections/sec, %d failed\n",
+                   numThreads, total, total / elapsed.count(), failed.load());
+        }
+    }
     else if(argc > 1 && !strcmp(argv[1], "data"))
     {
-        RpcClient client;
-        if(!client.Connect(host, port))
+        RpcClient client(transport);
+        if(!connect(client, useUnixSocket))
             return 1;
         const int numRpcs = 1; // Number of RPCs to send
         client.TestData(numRpcs);
     }  
+    else if(argc > 1 && !strcmp(argv[1], "iov"))
+    {
+        RpcClient client(transport);
+        if(!connect(client, useUnixSocket))
+            return 1;
+        client.TestDataIov();
+    }
     else if(argc > 1 && !strcmp(argv[1], "ping"))
     {
         // Create RPC client
-        RpcClient client;
-        if(!client.Connect(host, port))
+        RpcClient client(transport);
+        if(!connect(client, useUnixSocket))
             return 1;
         client.TestPing();
     }
+    else if(argc > 1 && !strcmp(argv[1], "drain"))
+    {
+        // Stop the server (servermt drains) while threads keep making slow
+        // calls. Every call should either succeed or not be run, none lost.
+        const int numThreads = 8;
+        const uint32_t sleepReq = htonl(50); // ms
+
+        std::atomic<int> succeeded(0);
+        std::atomic<int> goneAway(0);   // Told to go elsewhere, or the call was not run
+        std::atomic<int> lost(0);       // Failed without knowing whether the call was run
+        std::vector<std::thread> threads;
+
+        for(int t = 0; t < numThreads; t++)
+        {
+            threads.emplace_back([&]()
+            {
+                RpcClient client(transport);
+                client.EnableLogInfo(false);
+                if(!connect(client, useUnixSocket))
+                {
+                    lost++;
+                    return;
+                }
+
+                while(true)
+                {
+                    void* resp = nullptr;
+                    size_t respSize = 0;
+                    clnt_stat res = client.Call(protorpc::RPC_SLEEP, &sleepReq, sizeof(sleepReq), resp, respSize);
+                    if(res == RPC_SUCCESS)
+                    {
+                        succeeded++;
+                        if(client.IsValid())
+                            continue;
+                        goneAway++; // Closed after the call, as the server asked
+                    }
+                    else if(res == RPC_CANTSEND)
+                    {
+                        goneAway++;
+                    }
+                    else
+                    {
+                        lost++;
+                    }
+                    break;
+                }
+            });
+        }
+
+        std::this_thread::sleep_for(std::chrono::seconds(1));
+
+        RpcClient client(transport);
+        auto start = std::chrono::steady_clock::now();
+        if(!connect(client, useUnixSocket) || !client.TestShutdown())
+            return 1;
+
+        for(std::thread& thread : threads)
+            thread.join();
+        std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - start;
+
+        printf("drain     %3d threads: %d calls succeeded, %d clients went away cleanly, %d calls lost, %.1f ms after shutdown\n",
+               numThreads, succeeded.load(), goneAway.load(), lost.load(), elapsed.count());
+    }
     else if(argc > 1 && !strcmp(argv[1], "shutdown"))
     {
         // Create RPC client
-        RpcClient client;
-        if(!client.Connect(host, port))
+        RpcClient client(transport);
+        if(!connect(client, useUnixSocket))
             return 1;
         client.TestShutdown();
     } 
     else
     {
         // Usupported command option. Print usage.
-        printf("Usage: client <option>\n");
+        printf("Usage: client <option> [sunrpc|native|shm] [tcp|unix] [port]\n");
         printf("Where supported options are:\n");
         printf("   client ping     --> call an empty Ping RPC\n");
         printf("   client data     --> call raw data RPC\n");
+        printf("   client iov      --> call raw data and Echo RPCs with scatter-gather requests\n");
+        printf("   client pipeline --> Echo RPC throughput on one connection by pipeline depth (native or shm)\n");
+        printf("   client async    --> Echo RPC throughput of the thread-safe async client (futures and callbacks)\n");
+        printf("   client mixed    --> Ping RPC latency of the async client with slow calls on the same connection\n");
+        printf("   client priority --> Ping RPC latency next to a flood of slow calls (servermt staged vs servermt classes)\n");
+        printf("   client fanout 53910 --> calls fanned out to servermt by coserver (make CORO=1), and the coserver threads\n");
+        printf("   client pool     --> Echo RPC throughput of threads leasing clients from a connection pool\n");
+        printf("   client connections --> Echo RPC on 1000 connections open at the same time (servermt epoll serves them all)\n");
+        printf("   client accept   --> connections/sec of clients that connect, call Ping RPC and disconnect\n");
         printf("   client shutdown --> call Shutdown RPC to stop the server\n");
+        printf("   client drain    --> stop the server while 8 threads make slow calls, and count the calls lost\n");
         printf("   client echo     --> simulate multiple clients calling Echo RPC\n");
+        printf("   client latency  --> compare Echo RPC round-trip latency of SunRPC, native framing and shared memory\n");
+        printf("The optional transport selects SunRPC (default), native framing or shared memory rings (same host only)\n");
+        printf("The optional network selects TCP (default) or the Unix domain socket %s\n", socketPath);
         return 1;
     }
     
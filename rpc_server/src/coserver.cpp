@@ -0,0 +1,249 @@
+//
+//  coserver.cpp
+//
+//  RPC server with coroutine handlers (make CORO=1). RPC_FANOUT calls
+//  fan out to a downstream server (servermt) and wait for all the replies
+//  without holding a thread, so the number of threads doesn't grow with
+//  the number of calls in flight.
+//
+#include "rpcCoro.h"
+#include "rpc.pb.h" // Google Protocol Buffers generated header
+#include <unistd.h>
+#include <signal.h>    // sigaction
+#include <arpa/inet.h> // ntohl
+#include <stdio.h>
+#include <string.h>
+
+class RpcAsyncClient : public CRpcAsyncClient
+{
+public:
+    RpcAsyncClient(int numConnections) : CRpcAsyncClient(numConnections) {}
+    virtual ~RpcAsyncClient() = default;
+
+private:
+    virtual void LogInfo(const char* msg)  { printf("[INFO] %d: %s\n", getpid(), msg); }
+    virtual void LogError(const char* err) { printf("[ERROR] %d: %s\n", getpid(), err); }
+};
+
+class RpcCoServer : public CRpcCoServer
+{
+public:
+    RpcCoServer() = default;
+    ~RpcCoServer() = default;
+
+    CRpcExecutor mExecutor;         // Timers and work that must not hold an I/O thread
+    RpcAsyncClient mDownstream{2};  // Two connections to the downstream server
+
+private:
+    virtual CRpcTask<bool> OnCallCo(const CRpc::param* in, CRpc::param* out)
+    {
+        out->data_len = 0;
+        out->data_val = (u_char*)nullptr;
+
+        switch(in->type)
+        {
+            // Empty rpc, no data received/sent
+            case protorpc::RPC_PING:
+                break;
+
+            // Slow rpc, no data sent back. A timer, not a thread, waits.
+            case protorpc::RPC_SLEEP:
+            {
+                uint32_t ms = 0;
+                if(in->data_len != sizeof(ms))
+                    co_return false;
+
+                memcpy(&ms, in->data_val, sizeof(ms));
+                co_await mExecutor.Sleep(std::chrono::milliseconds(ntohl(ms)));
+            }
+            break;
+
+            // Protobuf rpc, parsed and built on an executor thread
+            case protorpc::RPC_ECHO:
+            {
+                co_await mExecutor.Schedule();
+
+                protorpc::EchoRequest req;
+                if(!CRpc::PtrToMsg(&req, in->data_val, (int)in->data_len))
+                {
+                    printf("%s: PtrToMsg failed\n", __func__);
+                    co_return false;
+                }
+
+                protorpc::EchoResponse resp;
+                resp.set_msg(req.msg());
+
+                void* ptr = NULL;
+                out->data_len = CRpc::MsgToPtr(&resp, &ptr);
+                if(out->data_len == 0)
+                {
+                    printf("%s: MsgToPtr failed\n", __func__);
+                    co_return false;
+                }
+                out->data_val = (u_char*)ptr;
+            }
+            break;
+
+            // RPC_SLEEP calls to the downstream server, all at the same time
+            case protorpc::RPC_FANOUT:
+            {
+                uint32_t args[2] = { 0, 0 };
+                if(in->data_len != sizeof(args))
+                    co_return false;
+
+                memcpy(args, in->data_val, sizeof(args));
+                int count = (int)ntohl(args[0]);
+                uint32_t sleepReq = args[1]; // Network byte order already
+
+                std::atomic<int> failed(0);
+                CRpcLatch latch(count);
+                for(int i = 0; i < count; i++)
+                {
+                    auto callback = [&](clnt_stat res, const CRpc::param* /*resp*/)
+                    {
+                        if(res != RPC_SUCCESS)
+                            failed++;
+                        latch.CountDown();
+                    };
+
+                    if(mDownstream.CallAsync(protorpc::RPC_SLEEP, &sleepReq, sizeof(sleepReq), callback) != RPC_SUCCESS)
+                    {
+                        failed++;
+                        latch.CountDown();
+                    }
+                }
+
+                // Go on on the executor, not on a client I/O thread
+                co_await latch.Wait(&mExecutor);
+
+                uint32_t* resp = (uint32_t*)malloc(2 * sizeof(uint32_t));
+                resp[0] = htonl((uint32_t)failed);
+                resp[1] = htonl((uint32_t)ThreadCount());
+                out->data_val = (u_char*)resp;
+                out->data_len = 2 * sizeof(uint32_t);
+            }
+            break;
+
+            // Empty rpc, no data received/sent
+            case protorpc::RPC_SHUTDOWN:
+                // Note: We will be using OnCleanup to shutdown the server
+                break;
+
+            default:
+                printf("%s: Unknown message type=%d\n", __func__, in->type);
+                co_return false;
+        }
+
+        co_return true;
+    }
+
+    virtual void OnCleanup(CRpc::param* out)
+    {
+        // We can use OnCleanup to shutdown the server
+        if(out->type == protorpc::RPC_SHUTDOWN)
+        {
+            Stop();
+        }
+
+        // Clean up the response...
+        if(out == nullptr || out->data_val == nullptr)
+            return;
+
+        switch(out->type)
+        {
+            case protorpc::RPC_FANOUT:
+                free(out->data_val);
+                break;
+
+            // Is this for Protobuf message call?
+            case protorpc::RPC_ECHO:
+                CRpc::MsgPtrDelete(out->data_val);
+                break;
+
+            default:
+                printf("%s: Unknown message type=%d\n", __func__, out->type);
+                break;
+        }
+
+        out->data_val = nullptr;
+        out->data_len = 0;
+    }
+
+    // Threads of the process, from /proc (0 where there is none)
+    static int ThreadCount()
+    {
+        int threads = 0;
+        FILE* fp = fopen("/proc/self/status", "r");
+        if(fp == nullptr)
+            return 0;
+
+        char line[256];
+        while(fgets(line, sizeof(line), fp) != nullptr)
+        {
+            if(sscanf(line, "Threads: %d", &threads) == 1)
+                break;
+        }
+
+        fclose(fp);
+        return threads;
+    }
+
+    virtual void LogInfo(const char* msg)  { printf("[INFO] %d: %s\n", getpid(), msg); }
+    virtual void LogError(const char* err) { printf("[ERROR] %d: %s\n", getpid(), err); }
+};
+
+static RpcCoServer* sServer = nullptr;
+
+static void OnTerminate(int /*sig*/)
+{
+    if(sServer != nullptr)
+        sServer->Stop();
+}
+
+int main(int argc, char* argv[])
+{
+    // Set stdout and stoerr to "line buffered": On output, data is written when
+    // a newline character is inserted into the stream or when the buffer is full
+    // (or flushed), whatever happens first.
+    setvbuf(stdout, NULL, _IOLBF, BUFSIZ);
+    setvbuf(stderr, NULL, _IOLBF, BUFSIZ);
+
+    unsigned short port = 53910;
+    unsigned short downstreamPort = 53900; // servermt
+    int ioThreads = 2;
+    int executorThreads = 2;
+
+    if(argc > 1 && atoi(argv[1]) > 0)
+        downstreamPort = (unsigned short)atoi(argv[1]);
+
+    RpcCoServer server;
+    if(!server.mDownstream.Connect("localhost", downstreamPort))
+    {
+        printf("Failed to connect to the downstream server on port %d (start \"servermt deferred\" first)\n", downstreamPort);
+        return 1;
+    }
+
+    server.mExecutor.Start(executorThreads);
+    server.SetEventLoop(ioThreads);
+
+    sServer = &server;
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = OnTerminate;
+    sigaction(SIGTERM, &sa, nullptr);
+    sigaction(SIGINT, &sa, nullptr);
+
+    printf("%d: RPC server started on port %d with %d I/O threads and %d executor threads, downstream port %d...\n",
+           getpid(), port, ioThreads, executorThreads, downstreamPort);
+
+    server.Run(port, 0); // No timeout, only connections, calls and Stop wake it up
+    sServer = nullptr;
+
+    CRpcServer::Stats stats = server.GetStats();
+    printf("%d: RPC server stopped: %llu calls\n", getpid(), (unsigned long long)stats.calls);
+
+    // Run has waited for the replies, nothing is suspended anymore
+    server.mExecutor.Stop();
+    server.mDownstream.Close();
+    return 0;
+}
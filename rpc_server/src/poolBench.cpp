@@ -0,0 +1,176 @@
+//
+// CThreadPool benchmark: tiny requests through the shared list, work
+// stealing, the bounded ring and the list with batches
+//
+
+#include <stdio.h>      // printf()
+#include <stdint.h>
+#include <algorithm>  // std::max
+#include <chrono>
+#include "threadPool.h"
+
+enum class QUEUE : char
+{
+    LIST,
+    STEAL,
+    RING,
+    BATCH   // The list, requests posted and taken in batches
+};
+
+class CBenchPool : public CThreadPool
+{
+public:
+    CBenchPool() = default;
+    virtual ~CBenchPool() { Destroy(); }
+
+    // Run count requests, every one of them posts two more until depth
+    // is 0. Returns the number of requests run (or rejected) per second.
+    double Run(int count, int depth)
+    {
+        long total = count * ((2L << depth) - 1);
+        mDone = 0;
+        mTotal = total;
+
+        void* requests[64];
+        for(int i = 0; i < 64; i++)
+            requests[i] = (void*)(intptr_t)(depth + 1);
+
+        auto start = std::chrono::steady_clock::now();
+        for(int i = 0; i < count; )
+        {
+            int batch = (mBatch ? std::min(64, count - i) : 1);
+            int posted = PostRequests(requests, batch);
+            for(; posted < batch; posted++)
+            {
+                mRejected++;
+                Done(); // Flat only, a rejected root would take its children with it
+            }
+            i += batch;
+        }
+        mFinished.Wait();
+        std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+
+        return (double)total / elapsed.count();
+    }
+
+    bool Create(int threadCount, QUEUE queue, int queueLimit = 0, FULL policy = FULL::BLOCK)
+    {
+        SetWorkStealing(queue == QUEUE::STEAL);
+        SetQueueLimit((queue == QUEUE::RING ? queueLimit : 0), policy);
+        SetBatchSize(queue == QUEUE::BATCH ? 16 : 1);
+        mBatch = (queue == QUEUE::BATCH);
+#ifdef __APPLE__
+        mFinished.Create("pool_bench_finished");
+        return CThreadPool::Create(threadCount, "pool_bench");
+#else
+        mFinished.Create();
+        return CThreadPool::Create(threadCount);
+#endif // __APPLE__
+    }
+
+    std::atomic<long> mRejected{0};
+    std::atomic<long> mInline{0};
+
+private:
+    std::atomic<long> mDone{0};
+    long mTotal = 0;
+    bool mBatch = false;
+    CSemaphore mFinished;
+
+    void Done()
+    {
+        if(++mDone == mTotal)
+            mFinished.Post();
+    }
+
+    virtual void OnThreadProc(int threadIndx, void* request)
+    {
+        if(threadIndx < 0)
+            mInline++;
+
+        int depth = (int)(intptr_t)request - 1;
+        if(depth > 0 && mBatch)
+        {
+            void* children[2] = { (void*)(intptr_t)depth, (void*)(intptr_t)depth };
+            PostRequests(children, 2);
+        }
+        else if(depth > 0)
+        {
+            PostRequest((void*)(intptr_t)depth);
+            PostRequest((void*)(intptr_t)depth);
+        }
+
+        // A tiny bit of work
+        volatile unsigned sum = 0;
+        for(unsigned i = 0; i < 64; i++)
+            sum = sum + i;
+
+        Done();
+    }
+};
+
+int main(int argc, char* argv[])
+{
+    // Set stdout and stoerr to "line buffered": On output, data is written when
+    // a newline character is inserted into the stream or when the buffer is full
+    // (or flushed), whatever happens first.
+    setvbuf(stdout, NULL, _IOLBF, BUFSIZ);
+    setvbuf(stderr, NULL, _IOLBF, BUFSIZ);
+
+    // "flat": the main thread posts every request, "spawn": the requests
+    // post more requests from the pool threads
+    const int count = 200000;
+    const int depth = 5;            // 63 requests per root
+    const int roots = 4000;         // 252000 requests
+    const int ringSize = 1 << 18;   // Never full
+
+    printf("%-8s %8s %14s %14s %14s %14s\n", "threads", "workload", "list Mreq/s", "steal Mreq/s", "ring Mreq/s", "batch Mreq/s");
+
+    for(int threads = 1; threads <= 64; threads *= 2)
+    {
+        double rate[2][4];
+        for(int queue = 0; queue < 4; queue++)
+        {
+            CBenchPool pool;
+            if(!pool.Create(threads, (QUEUE)queue, ringSize))
+            {
+                printf("Failed to create a pool of %d threads\n", threads);
+                return 1;
+            }
+
+            // Best of three
+            rate[0][queue] = rate[1][queue] = 0;
+            for(int i = 0; i < 3; i++)
+            {
+                rate[0][queue] = std::max(rate[0][queue], pool.Run(count, 0));
+                rate[1][queue] = std::max(rate[1][queue], pool.Run(roots, depth));
+            }
+            pool.Destroy(true /*waitToFinish*/);
+        }
+
+        printf("%-8d %8s %14.2f %14.2f %14.2f %14.2f\n", threads, "flat", rate[0][0] / 1e6, rate[0][1] / 1e6, rate[0][2] / 1e6, rate[0][3] / 1e6);
+        printf("%-8d %8s %14.2f %14.2f %14.2f %14.2f\n", threads, "spawn", rate[1][0] / 1e6, rate[1][1] / 1e6, rate[1][2] / 1e6, rate[1][3] / 1e6);
+    }
+
+    // A ring too small for the flat workload, with each policy
+    const int smallRing = 256;
+    const char* policyNames[] = { "block", "reject", "inline" };
+
+    printf("\n%-8s %8s %14s %14s %14s\n", "threads", "full", "ring Mreq/s", "rejected", "inline");
+    for(int policy = 0; policy < 3; policy++)
+    {
+        CBenchPool pool;
+        if(!pool.Create(4, QUEUE::RING, smallRing, (CThreadPool::FULL)policy))
+        {
+            printf("Failed to create a pool of %d threads\n", 4);
+            return 1;
+        }
+
+        double rate = pool.Run(count, 0);
+        pool.Destroy(true /*waitToFinish*/);
+
+        printf("%-8d %8s %14.2f %14ld %14ld\n", 4, policyNames[policy], rate / 1e6, (long)pool.mRejected, (long)pool.mInline);
+    }
+
+    return 0;
+}
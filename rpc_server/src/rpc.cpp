@@ -17,14 +17,35 @@
 
 #include <stdio.h>
 #include <memory.h>
-#include <netdb.h>      // gethostbyname
+#include <netdb.h>      // getaddrinfo
 #include <unistd.h>     // sleep
 #include <assert.h>
 #include <netinet/tcp.h>
 #include <arpa/inet.h>
+#include <sys/un.h>     // sockaddr_un
+#include <poll.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/wait.h>
+#if defined(__linux__)
+  #include <sys/eventfd.h>
+#endif
 #include <sstream>
+#include <algorithm>
+#include <chrono>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <new>          // std::nothrow
+#include <type_traits>
+#include <unordered_map>
 #include <google/protobuf/message.h>
 #include "rpc.h"
+#include "rpcInternal.h"
+#include "rpcTransport.h"
+#include "rpcShm.h"
+#include "rpcStream.h"
+#include "rpcEventLoop.h"
 
 #ifndef __DISPATCH_FN_T // Defined on Linux, not defined in OSX
 #define __DISPATCH_FN_T
@@ -35,26 +56,6 @@
   #endif
 #endif
 
-#define RPC_PROTOBUF_PROG_NUMBER        ((u_int)0x2fffffff)
-#define RPC_PROTOBUF_VERSION            ((u_int)1)
-#define RPC_PROTOBUF_FUNC_PROC          ((u_int)1) // function to call
-
-// Logging helpers
-#define INFOMSG(className, msg)                          \
-do{                                                      \
-    std::stringstream ss;                                \
-    ss << className << "::" << __func__ << ": " << msg;  \
-    LogInfo(ss.str().c_str());                           \
-}while(0)    
-
-#define ERRMSG(className, msg)                           \
-do{                                                      \
-    std::stringstream ss;                                \
-    ss << className << "::" << __func__ << ": " << msg;  \
-    LogError(ss.str().c_str());                          \
-}while(0)    
-
-
 //
 // Class CRpc
 //
@@ -105,6 +106,239 @@ bool CRpc::PtrToMsg(google::protobuf::Message* msg, const void* ptr, int size)
     return true;
 }
 
+bool CRpc::PtrToMsg(google::protobuf::Message* msg, const param* pr)
+{
+    assert(msg != nullptr);
+    if(pr->data_iov == nullptr)
+        return PtrToMsg(msg, pr->data_val, (int)pr->data_len);
+
+    CRpcInputStream stream(pr);
+    if(!msg->ParseFromZeroCopyStream(&stream))
+    {
+        msg->Clear();
+        ERRMSG("CRpc", "Failed to read protobuf message from " << pr->data_iovcnt << " segments");
+        assert(false);
+        return false;
+    }
+
+    return true;
+}
+
+bool_t CRpc::XdrEncodeIov(XDR* xdrs, param* pr, CODEC codec)
+{
+    u_int len = IovLength(pr->data_iov, pr->data_iovcnt);
+    if(!xdr_u_int(xdrs, &len))
+        return (FALSE);
+
+    if(codec == CODEC::BULK)
+    {
+        // Same as xdr_bytes: the bytes, then zero padding to 4 bytes
+        for(int i = 0; i < pr->data_iovcnt; i++)
+        {
+            if(pr->data_iov[i].iov_len > 0 &&
+               !XDR_PUTBYTES(xdrs, (char*)pr->data_iov[i].iov_base, (u_int)pr->data_iov[i].iov_len))
+                return (FALSE);
+        }
+
+        static char pad[BYTES_PER_XDR_UNIT] = { 0 };
+        u_int padLen = (BYTES_PER_XDR_UNIT - len % BYTES_PER_XDR_UNIT) % BYTES_PER_XDR_UNIT;
+        if(padLen > 0 && !XDR_PUTBYTES(xdrs, pad, padLen))
+            return (FALSE);
+    }
+    else
+    {
+        // Same as xdr_array of xdr_u_char: one XDR unit per byte
+        for(int i = 0; i < pr->data_iovcnt; i++)
+        {
+            const u_char* ptr = (const u_char*)pr->data_iov[i].iov_base;
+            for(size_t j = 0; j < pr->data_iov[i].iov_len; j++)
+            {
+                u_char c = ptr[j]; // xdr_u_char writes back, so don't pass the segment
+                if(!xdr_u_char(xdrs, &c))
+                    return (FALSE);
+            }
+        }
+    }
+
+    return (TRUE);
+}
+
+//
+// Resolver cache
+//
+// getaddrinfo results shared by all the clients in the process. A name is
+// looked up once however many threads connect to it at the same time, the
+// others wait for that lookup instead of going to the resolver as well.
+//
+struct CRpcResolved
+{
+    int err = 0; // getaddrinfo error
+    std::vector<std::pair<struct sockaddr_storage, socklen_t>> addrs; // Port not set
+};
+
+struct CRpcResolverEntry
+{
+    std::shared_future<CRpcResolved> result;
+    std::chrono::steady_clock::time_point expires;
+};
+
+#define RPC_RESOLVER_DEFAULT_TTL    60  // Seconds
+#define RPC_RESOLVER_NEGATIVE_TTL   5   // Seconds to keep a failed lookup
+
+static std::mutex sResolverMutex;
+static std::unordered_map<std::string, CRpcResolverEntry> sResolverCache;
+static int sResolverTtl = RPC_RESOLVER_DEFAULT_TTL;
+
+static CRpcResolved Resolve(const char* hostName)
+{
+    CRpcResolved resolved;
+
+    struct addrinfo hints;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+
+    struct addrinfo* result = nullptr;
+    resolved.err = getaddrinfo(hostName, nullptr, &hints, &result);
+    if(resolved.err != 0)
+        return resolved;
+
+    for(struct addrinfo* ai = result; ai != nullptr; ai = ai->ai_next)
+    {
+        if((ai->ai_family != AF_INET && ai->ai_family != AF_INET6) ||
+           ai->ai_addrlen > sizeof(struct sockaddr_storage))
+            continue;
+
+        struct sockaddr_storage addr;
+        memset(&addr, 0, sizeof(addr));
+        memcpy(&addr, ai->ai_addr, ai->ai_addrlen);
+        resolved.addrs.emplace_back(addr, (socklen_t)ai->ai_addrlen);
+    }
+
+    freeaddrinfo(result);
+
+    if(resolved.addrs.empty())
+        resolved.err = EAI_NONAME;
+    return resolved;
+}
+
+static CRpcResolved ResolveCached(const char* hostName)
+{
+    std::promise<CRpcResolved> promise;
+    std::shared_future<CRpcResolved> result;
+    bool lookup = false;
+
+    {
+        std::unique_lock<std::mutex> lock(sResolverMutex);
+
+        if(sResolverTtl <= 0)
+        {
+            lock.unlock();
+            return Resolve(hostName);
+        }
+
+        auto now = std::chrono::steady_clock::now();
+        auto it = sResolverCache.find(hostName);
+        if(it != sResolverCache.end() && it->second.expires > now)
+        {
+            result = it->second.result; // Resolved already or being resolved
+        }
+        else
+        {
+            result = promise.get_future().share();
+            sResolverCache[hostName] = { result, now + std::chrono::seconds(sResolverTtl) };
+            lookup = true;
+        }
+    }
+
+    if(lookup)
+    {
+        CRpcResolved resolved = Resolve(hostName);
+        if(resolved.err != 0)
+        {
+            // Don't keep the failure for long, the name may be back soon
+            std::unique_lock<std::mutex> lock(sResolverMutex);
+            auto it = sResolverCache.find(hostName);
+            if(it != sResolverCache.end())
+            {
+                auto expires = std::chrono::steady_clock::now() + std::chrono::seconds(RPC_RESOLVER_NEGATIVE_TTL);
+                if(expires < it->second.expires)
+                    it->second.expires = expires;
+            }
+        }
+        promise.set_value(resolved);
+    }
+
+    return result.get();
+}
+
+void CRpc::SetResolverCacheTtl(int ttlSeconds)
+{
+    std::unique_lock<std::mutex> lock(sResolverMutex);
+    sResolverTtl = ttlSeconds;
+    sResolverCache.clear();
+}
+
+bool CRpc::MakeAddress(const char* hostName, unsigned short port, std::vector<address_t>& addrs)
+{
+    if(hostName == nullptr || *hostName == '\0')
+    {
+        ERRMSG("CRpc", "Invalid (an empty) hostName specified");
+        return false;
+    }
+    
+    if(port == 0)
+    {
+        ERRMSG("CRpc", "Invalid (zero) port number specified");
+        return false;
+    }
+
+    CRpcResolved resolved = ResolveCached(hostName);
+    if(resolved.err != 0)
+    {
+        ERRMSG("CRpc", "getaddrinfo(" << hostName << ") failed: " << gai_strerror(resolved.err));
+        return false;
+    }
+
+    addrs.clear();
+    for(const auto& resolvedAddr : resolved.addrs)
+    {
+        address_t address;
+        address.addr = resolvedAddr.first;
+        address.addrLen = resolvedAddr.second;
+
+        if(address.addr.ss_family == AF_INET)
+            ((struct sockaddr_in*)&address.addr)->sin_port = htons(port);
+        else
+            ((struct sockaddr_in6*)&address.addr)->sin6_port = htons(port);
+
+        addrs.push_back(address);
+    }
+    return true;
+}
+
+bool CRpc::MakeAddress(const char* socketPath, struct sockaddr_storage& addr, socklen_t& addrLen)
+{
+    if(socketPath == nullptr || *socketPath == '\0')
+    {
+        ERRMSG("CRpc", "Invalid (an empty) socketPath specified");
+        return false;
+    }
+
+    struct sockaddr_un* un = (struct sockaddr_un*)&addr;
+    memset(&addr, 0, sizeof(addr));
+    un->sun_family = AF_UNIX;
+
+    if(strlen(socketPath) >= sizeof(un->sun_path))
+    {
+        ERRMSG("CRpc", "Socket path is too long: " << socketPath);
+        return false;
+    }
+    strcpy(un->sun_path, socketPath);
+    addrLen = sizeof(struct sockaddr_un);
+    return true;
+}
+
 void* CRpc::MsgPtrClone(void* ptr, size_t size)
 {
     unsigned char* new_ptr = new (std::nothrow) unsigned char[size];
@@ -118,79 +352,121 @@ void* CRpc::MsgPtrClone(void* ptr, size_t size)
 //
 // Class CRpcClient
 //
+CRpcClient::CRpcClient(TRANSPORT transport /*= TRANSPORT::SUNRPC*/)
+{
+    if(transport == TRANSPORT::NATIVE)
+        mTransport = new CRpcNativeTransport(this);
+    else if(transport == TRANSPORT::SHM)
+        mTransport = new CRpcShmTransport(this);
+    else
+        mTransport = new CRpcSunTransport(this);
+}
+
+CRpcClient::~CRpcClient()
+{
+    Destroy();
+    delete mTransport;
+    mTransport = nullptr;
+}
+
+bool CRpcClient::IsValid()
+{
+    return mTransport->IsValid();
+}
+
+bool CRpcClient::IsGoingAway()
+{
+    return mTransport->GoingAway();
+}
+
+void CRpcClient::SetCodec(CODEC codec)
+{
+    mTransport->SetCodec(codec);
+}
+
+CRpc::CODEC CRpcClient::GetCodec()
+{
+    return mTransport->GetCodec();
+}
+
+void CRpcClient::SetSpinCount(int spinCount)
+{
+    mTransport->SetSpinCount(spinCount);
+}
+
 bool CRpcClient::Connect(const char* hostName, unsigned short port)
 {
-    if(hostName == nullptr)
+    if(mTransport->IsValid())
     {
-        ERRMSG("CRpcClient", "Invalid (an empty) hostName specified");
+        ERRMSG("CRpcClient", "Failed for " << (hostName ? hostName : "") << ":" << port << " - the client is already connected");
         return false;
     }
-    
-    if(port == 0)
-    {
-        ERRMSG("CRpcClient", "Invalid (zero) port number specified");
+
+    std::vector<address_t> addrs;
+    if(!MakeAddress(hostName, port, addrs))
         return false;
-    }
 
-    if(cl != nullptr)
+    INFOMSG("CRpcClient", "Connecting to " << hostName << ":" << port);
+
+    // Every address gets an equal share of the time that is left, so one
+    // that doesn't answer doesn't use it all up
+    CRpcFrame::deadline_t deadline = CRpcFrame::Deadline(mConnectTimeout);
+    for(size_t i = 0; i < addrs.size(); i++)
     {
-        ERRMSG("CRpcClient", "Failed for " << hostName << ":" << port << " - the CLIENT already exists");
-        return false;
+        auto now = std::chrono::steady_clock::now();
+        if(now >= deadline)
+        {
+            ERRMSG("CRpcClient", "Timed out connecting to " << hostName << ":" << port);
+            return false;
+        }
+
+        CRpcFrame::deadline_t addrDeadline = now + (deadline - now) / (addrs.size() - i);
+        if(mTransport->Connect((struct sockaddr*)&addrs[i].addr, addrs[i].addrLen, addrDeadline))
+        {
+            INFOMSG("CRpcClient", "Succeeded");
+            return true;
+        }
     }
 
-    INFOMSG("CRpcClient", "Connecting to " << hostName << ":" << port);
-    
-    // Connent to the server located at Internet address *addr.
-    struct hostent* h = gethostbyname(hostName);
-    if(h == nullptr)
+    ERRMSG("CRpcClient", "Failed to connect to " << hostName << ":" << port);
+    return false;
+}
+
+bool CRpcClient::Connect(const char* socketPath)
+{
+    if(mTransport->IsValid())
     {
-        ERRMSG("CRpcClient", "gethostbyname(" << hostName << ") failed: " << hstrerror(h_errno));
+        ERRMSG("CRpcClient", "Failed for " << (socketPath ? socketPath : "") << " - the client is already connected");
         return false;
     }
-    
-    struct sockaddr_in addr;
-    memset(&addr, 0, sizeof(addr));
-    addr.sin_family = AF_INET;
-    addr.sin_port = htons(port);
-    memcpy(&addr.sin_addr.s_addr, h->h_addr_list[0], sizeof(in_addr_t));
-
-    int sock = RPC_ANYSOCK; // To open new socket
 
-    // Create RPC client for the remote program on the designated hostname/port.
-    cl = clnttcp_create(&addr,
-                        RPC_PROTOBUF_PROG_NUMBER,   // program number
-                        RPC_PROTOBUF_VERSION,       // version number
-                        &sock,                      // socket to be set
-                        0,                          // send_buf_size
-                        0);                         // recv_buf_size
+    struct sockaddr_storage addr;
+    socklen_t addrLen = 0;
+    if(!MakeAddress(socketPath, addr, addrLen))
+        return false;
 
-    //printf("CRpcClient: clnttcp_create() socket=%d\n", sock);
+    INFOMSG("CRpcClient", "Connecting to " << socketPath);
 
-    if(cl == nullptr)
+    if(!mTransport->Connect((struct sockaddr*)&addr, addrLen, CRpcFrame::Deadline(mConnectTimeout)))
     {
-        ERRMSG("CRpcClient", "clnttcp_create(" << hostName << ":" << port << ") failed" << clnt_spcreateerror((char*)""));
+        ERRMSG("CRpcClient", "Failed to connect to " << socketPath);
         return false;
     }
-    
+
     INFOMSG("CRpcClient", "Succeeded");
     return true;
 }
 
 void CRpcClient::Destroy()
 {
-    // Destroys the client's RPC handle by deallocating all memory related to the handle.
-    if(cl != nullptr)
-    {
-        //INFOMSG("CRpcClient", "");
-        clnt_destroy(cl);
-        cl = nullptr;
-    }
+    // Close the connection and release the transport resources
+    mTransport->Close();
 }
 
 clnt_stat CRpcClient::Call(int type, const google::protobuf::Message* req, google::protobuf::Message* resp,
                const struct timeval timeout)
 {
-    if(cl == nullptr)
+    if(!mTransport->IsValid())
     {
         ERRMSG("CRpcClient", "Client is not yet connected");
         return RPC_FAILED;
@@ -214,28 +490,75 @@ clnt_stat CRpcClient::Call(int type, const google::protobuf::Message* req, googl
     in.data_val = (u_char*)ptr;
     in.data_len = (u_int)len;
 
+    clnt_stat res = CallMsg(&in, resp, timeout);
+
+    // Clean up - delete request buffer
+    CRpc::MsgPtrDelete(ptr);
+    ptr = nullptr;
+
+    return res;
+}
+
+clnt_stat CRpcClient::Call(int type, const struct iovec* req, int reqCount, google::protobuf::Message* resp,
+               const struct timeval timeout /*= RPC_TIMEOUT_INFINITE*/)
+{
+    if(!mTransport->IsValid())
+    {
+        ERRMSG("CRpcClient", "Client is not yet connected");
+        return RPC_FAILED;
+    }
+
+    if(reqCount < 0 || reqCount > RPC_MAX_IOV || (reqCount > 0 && req == nullptr))
+    {
+        ERRMSG("CRpcClient", "Invalid request segments (reqCount=" << reqCount << ")");
+        return RPC_FAILED;
+    }
+
+    param in;
+    in.type = type;
+    in.data_iov = req;
+    in.data_iovcnt = reqCount;
+    in.data_len = IovLength(req, reqCount);
+
+    return CallMsg(&in, resp, timeout);
+}
+
+clnt_stat CRpcClient::CallMsg(param* in, google::protobuf::Message* resp, const struct timeval& timeout)
+{
     param out;
     //memset((char*)&out, 0, sizeof(out)); // initialized in defaut constructor instead
 
-    clnt_stat res = clnt_call(cl, RPC_PROTOBUF_FUNC_PROC,
-                              (xdrproc_t)CRpc::XdrParam, (caddr_t)&in,
-                              (xdrproc_t)CRpc::XdrParam, (caddr_t)&out, timeout);
+    clnt_stat res = mTransport->Call(in, &out, timeout);
+    res = ReplyToMsg(res, &out, resp);
+
+    // Free the memory that was allocated when RPC result was decoded
+    mTransport->FreeRes(&out);
+
+    // If RPC failed due to failure to send or receive, or the server is
+    // stopping, then destroy the client and reconnect
+    if(res == RPC_CANTSEND || res == RPC_CANTRECV || mTransport->GoingAway())
+        Destroy();
+
+    return res;
+}
 
+clnt_stat CRpcClient::ReplyToMsg(clnt_stat res, param* out, google::protobuf::Message* resp)
+{
     if(res != RPC_SUCCESS)
     {
-        ERRMSG("CRpcClient", "clnt_call() failed" << clnt_sperror(cl, (char*)""));
+        // The transport has already logged the error
     }
     // Is response expected?
     else if(resp != nullptr)
     {
-        if(out.data_len == 0 || out.data_val == nullptr)
+        if(out->data_len == 0 || out->data_val == nullptr)
         {
             // If response is expected, but not recieved then something went wrong
             ERRMSG("CRpcClient", "No response received "
-                << "(data_len=" << out.data_len << ", data_val=" << (out.data_val == nullptr ? "nullptr" : "NOT nullptr") << ")");
+                << "(data_len=" << out->data_len << ", data_val=" << (out->data_val == nullptr ? "nullptr" : "NOT nullptr") << ")");
             res = RPC_FAILED;
         }
-        else if(!CRpc::PtrToMsg(resp, out.data_val, (int)out.data_len))
+        else if(!CRpc::PtrToMsg(resp, out->data_val, (int)out->data_len))
         {
             ERRMSG("CRpcClient", "PtrToMsg failed");
             res = RPC_FAILED;
@@ -244,71 +567,93 @@ clnt_stat CRpcClient::Call(int type, const google::protobuf::Message* req, googl
     // We don't expect any response
     else
     {
-        if(out.data_len != 0 || out.data_val != nullptr)
+        if(out->data_len != 0 || out->data_val != nullptr)
         {
             // If response is NOT expected, but recieved then something went wrong
             ERRMSG("CRpcClient", "Unexpected response received "
-                << "(data_len=" << out.data_len << ", data_val=" << (out.data_val == nullptr ? "nullptr" : "NOT nullptr") << ")");
+                << "(data_len=" << out->data_len << ", data_val=" << (out->data_val == nullptr ? "nullptr" : "NOT nullptr") << ")");
             res = RPC_FAILED;
         }
     }
 
-    // Free the memory that was allocated when RPC result was decoded
-    if(!clnt_freeres(cl, (xdrproc_t)CRpc::XdrParam, (caddr_t)&out))
+    return res;
+}
+
+clnt_stat CRpcClient::Call(int type, const void* req, size_t reqSize, void*& resp, size_t& respSize,
+               const struct timeval timeout /*= RPC_TIMEOUT_INFINITE*/)
+{
+    if(!mTransport->IsValid())
     {
-        ERRMSG("CRpcClient", "clnt_freeres() failed" << clnt_sperror(cl, (char*)""));
+        ERRMSG("CRpcClient", "Client is not yet connected");
+        return RPC_FAILED;
     }
 
-    // Clean up - delete request buffer
-    CRpc::MsgPtrDelete(ptr);
-    ptr = nullptr;
-
-    // If RPC failed due to failure to send or receive, then destroy the client and reconnect
-    if(res == RPC_CANTSEND || res == RPC_CANTRECV)
-        Destroy();
+    param in;
+    in.type = type;
+    in.data_val = (u_char*)req;
+    in.data_len = (u_int)reqSize;
 
-    return res;
+    return CallRaw(&in, resp, respSize, timeout);
 }
 
-clnt_stat CRpcClient::Call(int type, const void* req, size_t reqSize, void*& resp, size_t& respSize,
+clnt_stat CRpcClient::Call(int type, const struct iovec* req, int reqCount, void*& resp, size_t& respSize,
                const struct timeval timeout /*= RPC_TIMEOUT_INFINITE*/)
 {
-    if(cl == nullptr)
+    if(!mTransport->IsValid())
     {
         ERRMSG("CRpcClient", "Client is not yet connected");
         return RPC_FAILED;
     }
 
-    resp = nullptr;  // initially
-    respSize = 0; // initially
+    if(reqCount < 0 || reqCount > RPC_MAX_IOV || (reqCount > 0 && req == nullptr))
+    {
+        ERRMSG("CRpcClient", "Invalid request segments (reqCount=" << reqCount << ")");
+        return RPC_FAILED;
+    }
 
     param in;
     in.type = type;
-    in.data_val = (u_char*)req;
-    in.data_len = (u_int)reqSize;
+    in.data_iov = req;
+    in.data_iovcnt = reqCount;
+    in.data_len = IovLength(req, reqCount);
+
+    return CallRaw(&in, resp, respSize, timeout);
+}
 
+clnt_stat CRpcClient::CallRaw(param* in, void*& resp, size_t& respSize, const struct timeval& timeout)
+{
     param out;
     //memset((char*)&out, 0, sizeof(out)); // initialized in defaut constructor instead
 
-    clnt_stat res = clnt_call(cl, RPC_PROTOBUF_FUNC_PROC,
-                              (xdrproc_t)CRpc::XdrParam, (caddr_t)&in,
-                              (xdrproc_t)CRpc::XdrParam, (caddr_t)&out, timeout);
+    clnt_stat res = mTransport->Call(in, &out, timeout);
+    res = ReplyToPtr(res, &out, resp, respSize);
 
-    if(res != RPC_SUCCESS)
-    {
-        ERRMSG("CRpcClient", "clnt_call() failed" << clnt_sperror(cl, (char*)""));
-    }
+    // Free the memory that was allocated when RPC result was decoded
+    mTransport->FreeRes(&out);
+
+    // If RPC failed due to failure to send or receive, or the server is
+    // stopping, then destroy the client and reconnect
+    if(res == RPC_CANTSEND || res == RPC_CANTRECV || mTransport->GoingAway())
+        Destroy();
+
+    return res;
+}
+
+clnt_stat CRpcClient::ReplyToPtr(clnt_stat res, param* out, void*& resp, size_t& respSize)
+{
+    resp = nullptr;  // initially
+    respSize = 0; // initially
 
     // Do we have any response?
-    if((out.data_len == 0 && out.data_val != nullptr) ||
-       (out.data_len != 0 && out.data_val == nullptr))
+    if((out->data_len == 0 && out->data_val != nullptr) ||
+       (out->data_len != 0 && out->data_val == nullptr))
     {
         // Invalid response data - something went wrong
         ERRMSG("CRpcClient", "Invalid response received "
-            << "(data_len=" << out.data_len << ", data_val=" << (out.data_val == nullptr ? "nullptr" : "NOT nullptr") << ")");
+            << "(data_len=" << out->data_len << ", data_val=" << (out->data_val == nullptr ? "nullptr" : "NOT nullptr") << ")");
         res = RPC_FAILED;
     }
-    else if(out.data_len == 0 && out.data_val == nullptr)
+    else if(out->data_len == 0 && out->data_val == nullptr)
     {
         // Empty response
         resp = nullptr;
@@ -316,49 +661,277 @@ clnt_stat CRpcClient::Call(int type, const void* req, size_t reqSize, void*& res
     }
     else
     {
-        resp = malloc(out.data_len);
+        resp = malloc(out->data_len);
         if(resp)
         {
-            memcpy(resp, out.data_val, out.data_len);
-            respSize = out.data_len;
+            memcpy(resp, out->data_val, out->data_len);
+            respSize = out->data_len;
         }
         else
         {
-            ERRMSG("CRpcClient", "Failed to allocate " << out.data_len << " bytes");
+            ERRMSG("CRpcClient", "Failed to allocate " << out->data_len << " bytes");
             res = RPC_FAILED;
         }
     }
 
-    // Free the memory that was allocated when RPC result was decoded
-    if(!clnt_freeres(cl, (xdrproc_t)CRpc::XdrParam, (caddr_t)&out))
-    {
-        ERRMSG("CRpcClient", "clnt_freeres() failed" << clnt_sperror(cl, (char*)""));
-    }
-
-    // If RPC failed due to failure to send or receive, then destroy the client and reconnect
-    if(res == RPC_CANTSEND || res == RPC_CANTRECV)
-        Destroy();
-
     return res;
 }
 
+clnt_stat CRpcClient::Send(int type, const google::protobuf::Message* req, uint32_t& reqId,
+               const struct timeval timeout /*= RPC_TIMEOUT_INFINITE*/)
+{
+    if(!mTransport->IsValid())
+    {
+        ERRMSG("CRpcClient", "Client is not yet connected");
+        return RPC_FAILED;
+    }
 
-//
-// Class CRpcServer
-//
+    void* ptr = nullptr;
+    int len = 0;
+
+    if(req != nullptr)
+    {
+        len = CRpc::MsgToPtr(req, &ptr);
+        if(len == 0)
+        {
+            ERRMSG("CRpcClient", "MsgToPtr failed");
+            return RPC_FAILED;
+        }
+    }
+
+    clnt_stat res = Send(type, ptr, (size_t)len, reqId, timeout);
+
+    // Clean up - delete request buffer
+    CRpc::MsgPtrDelete(ptr);
+    ptr = nullptr;
+
+    return res;
+}
+
+clnt_stat CRpcClient::Send(int type, const void* req, size_t reqSize, uint32_t& reqId,
+               const struct timeval timeout /*= RPC_TIMEOUT_INFINITE*/)
+{
+    if(!mTransport->IsValid())
+    {
+        ERRMSG("CRpcClient", "Client is not yet connected");
+        return RPC_FAILED;
+    }
+
+    param in;
+    in.type = type;
+    in.data_val = (u_char*)req;
+    in.data_len = (u_int)reqSize;
+
+    clnt_stat res = mTransport->Send(&in, reqId, timeout);
+
+    // If RPC failed due to failure to send, then destroy the client and reconnect
+    if(res == RPC_CANTSEND)
+        Destroy();
+
+    return res;
+}
+
+clnt_stat CRpcClient::Receive(uint32_t& reqId, google::protobuf::Message* resp,
+               const struct timeval timeout /*= RPC_TIMEOUT_INFINITE*/)
+{
+    if(!mTransport->IsValid())
+    {
+        ERRMSG("CRpcClient", "Client is not yet connected");
+        return RPC_FAILED;
+    }
+
+    param out;
+    clnt_stat res = mTransport->Receive(&out, reqId, timeout);
+    res = ReplyToMsg(res, &out, resp);
+
+    // Free the memory that was allocated when RPC result was decoded
+    mTransport->FreeRes(&out);
+
+    // If RPC failed due to failure to receive, then destroy the client and reconnect
+    if(res == RPC_CANTRECV)
+        Destroy();
+
+    return res;
+}
+
+clnt_stat CRpcClient::Receive(uint32_t& reqId, void*& resp, size_t& respSize,
+               const struct timeval timeout /*= RPC_TIMEOUT_INFINITE*/)
+{
+    resp = nullptr;  // initially
+    respSize = 0; // initially
+
+    if(!mTransport->IsValid())
+    {
+        ERRMSG("CRpcClient", "Client is not yet connected");
+        return RPC_FAILED;
+    }
+
+    param out;
+    clnt_stat res = mTransport->Receive(&out, reqId, timeout);
+    res = ReplyToPtr(res, &out, resp, respSize);
+
+    // Free the memory that was allocated when RPC result was decoded
+    mTransport->FreeRes(&out);
+
+    // If RPC failed due to failure to receive, then destroy the client and reconnect
+    if(res == RPC_CANTRECV)
+        Destroy();
+
+    return res;
+}
+
+
+//
+// Class CRpcServer
+//
 #include <rpc/pmap_clnt.h>
 #include <unistd.h>         // close() 
 #include <errno.h>
 
-CRpcServer* CRpcServer::mServer = nullptr;
+// The SunRPC dispatch function is the same for every connection and gets
+// only the transport, so every transport is mapped to the connection state
+// and the server serving it. The transports are created and destroyed under
+// the same lock since svcfd_create and svc_register update process-wide
+// tables that not every RPC library protects. (Recursive since RpcDispatch
+// may be called with it held.)
+//
+// The library destroys a transport (and closes its socket) when it runs
+// into an error reading a call. Every transport gets a copy of the library
+// operations whose xp_destroy only marks it dead instead, so the transport
+// and the socket stay ours until HandleSunRpcConnection destroys them.
+typedef std::remove_const<std::remove_pointer<decltype(SVCXPRT::xp_ops)>::type>::type CSvcOps;
 
-CRpcServer::CRpcServer()
+struct CSunRpcConnection
 {
-    if(mServer != nullptr)
-        return;
-    
-    // TODO: Make CRpcServer singleton
-    mServer = this;
+    CRpcServer* server = nullptr;
+    const CSvcOps* libOps = nullptr;    // The library's own
+    CSvcOps ops;                        // The same, but xp_destroy
+    bool dead = false;                  // The library gave up on it
+};
+
+static std::recursive_mutex sSunRpcMutex;
+static std::unordered_map<SVCXPRT*, CSunRpcConnection*> sSunRpcServers;
+
+static void SunRpcDestroy(SVCXPRT* transp)
+{
+    std::unique_lock<std::recursive_mutex> lock(sSunRpcMutex);
+    auto it = sSunRpcServers.find(transp);
+    if(it != sSunRpcServers.end())
+        it->second->dead = true;
+}
+
+// A thread's SunRPC receive buffer. It grows without being zero-filled,
+// so a length from the wire costs nothing until the data arrives, and
+// it is released after a call that needed more than it keeps.
+#define RPC_RECV_BUFFER_KEEP    (1024 * 1024)
+
+struct CRpcRecvBuffer
+{
+    std::unique_ptr<u_char[]> data;
+    size_t capacity = 0;
+
+    void Release() { data.reset(); capacity = 0; }
+};
+
+// Request param decoded into a reusable buffer
+struct CRpcRecvArgs
+{
+    CRpc::param* pr = nullptr;
+    CRpcRecvBuffer* buf = nullptr;
+    CRpc::CODEC codec = CRpc::CODEC::BULK;
+};
+
+// Decode the same wire format as CRpc::XdrParam/XdrParamBytes,
+// but into args->buf
+static bool_t XdrRecvArgs(XDR* xdrs, CRpcRecvArgs* args, unsigned int)
+{
+    if(xdrs->x_op == XDR_FREE)
+        return (TRUE); // Nothing was allocated
+    if(xdrs->x_op != XDR_DECODE)
+        return (FALSE);
+
+    CRpc::param* pr = args->pr;
+    CRpcRecvBuffer& buf = *args->buf;
+    u_int len = 0;
+
+    if(!xdr_int(xdrs, &pr->type) || !xdr_u_int(xdrs, &len))
+        return (FALSE);
+
+    // The same limit as native frames
+    if(len > CRpcFrame::MaxFrameSize())
+        return (FALSE);
+
+    if(buf.capacity < len)
+    {
+        // Nothing to keep, it is all about to be overwritten
+        buf.Release();
+        buf.data.reset(new (std::nothrow) u_char[len]);
+        if(buf.data == nullptr)
+            return (FALSE);
+        buf.capacity = len;
+    }
+
+    if(args->codec == CRpc::CODEC::BULK)
+    {
+        // The bytes, then padding to 4 bytes
+        char pad[BYTES_PER_XDR_UNIT];
+        u_int padLen = (BYTES_PER_XDR_UNIT - len % BYTES_PER_XDR_UNIT) % BYTES_PER_XDR_UNIT;
+        if(len > 0 && !XDR_GETBYTES(xdrs, (char*)buf.data.get(), len))
+            return (FALSE);
+        if(padLen > 0 && !XDR_GETBYTES(xdrs, pad, padLen))
+            return (FALSE);
+    }
+    else
+    {
+        // One XDR unit per byte
+        for(u_int i = 0; i < len; i++)
+        {
+            if(!xdr_u_char(xdrs, &buf.data[i]))
+                return (FALSE);
+        }
+    }
+
+    pr->data_len = len;
+    pr->data_val = (len > 0 ? buf.data.get() : nullptr);
+    return (TRUE);
+}
+
+CRpcServer::CRpcServer() : mPid(getpid())
+{
+}
+
+CRpcServer::~CRpcServer()
+{
+    if(mStopFd[1] >= 0 && mStopFd[1] != mStopFd[0])
+        close(mStopFd[1]);
+    if(mStopFd[0] >= 0)
+        close(mStopFd[0]);
+}
+
+CRpcServer::Stats CRpcServer::GetStats() const
+{
+    Stats stats;
+    stats.calls = mCalls;
+    stats.recvBufferAllocs = mRecvBufferAllocs;
+    stats.recvBufferBytes = mRecvBufferBytes;
+    stats.queuedCalls = mQueuedCalls;
+    stats.queueWaitUs = mQueueWaitUs;
+    stats.queueFull = mQueueFull;
+    stats.queueDepth = mQueueDepth;
+    stats.queueMaxDepth = mQueueMaxDepth;
+    stats.goAways = mGoAways;
+    stats.droppedCalls = mDroppedCalls;
+    stats.drainUs = mDrainUs;
+    return stats;
+}
+
+void CRpcServer::CountRecvBuffer(size_t oldCapacity, size_t newCapacity)
+{
+    if(newCapacity != oldCapacity)
+    {
+        mRecvBufferAllocs++;
+        mRecvBufferBytes += newCapacity;
+    }
 }
 
 //bool CRpcServer::Run(unsigned short port)
@@ -424,6 +997,10 @@ CRpcServer::CRpcServer()
 //    return true;
 //}
 
+// Worker processes (see CRpcServer::SetWorkerProcesses)
+#define RPC_WORKER_RESPAWN_DELAY_MS 1000    // Least time between two starts of a worker
+#define RPC_WORKER_STOP_TIMEOUT     10      // Seconds the workers have to stop
+
 bool CRpcServer::Run(unsigned short port, time_t timeoutSeconds, int maxPendingConnections /*=100*/)
 {
     if(port == 0)
@@ -432,32 +1009,135 @@ bool CRpcServer::Run(unsigned short port, time_t timeoutSeconds, int maxPendingC
         return false;
     }
 
-    // Create RPC service to listen on the designated port.
-    int sock = CreateSocket(port);
-    if(sock < 0)
+    return Run(port, nullptr, timeoutSeconds, maxPendingConnections);
+}
+
+bool CRpcServer::Run(const char* socketPath, time_t timeoutSeconds, int maxPendingConnections /*=100*/)
+{
+    if(socketPath == nullptr || *socketPath == '\0')
+    {
+        ERRMSG("CRpcServer", "Invalid (an empty) socket path specified");
         return false;
+    }
 
-    // Start to listen
-    if(listen(sock, maxPendingConnections) != 0)
+    return Run(0, socketPath, timeoutSeconds, maxPendingConnections);
+}
+
+bool CRpcServer::Run(unsigned short port, const char* socketPath, time_t timeoutSeconds, int maxPendingConnections /*=100*/)
+{
+    if(port == 0 && (socketPath == nullptr || *socketPath == '\0'))
     {
-        ERRMSG("CRpcServer", "listen() failed, sock=" << sock << ": " << strerror(errno));
+        ERRMSG("CRpcServer", "Neither port number nor socket path specified");
+        return false;
+    }
 
-        if(close(sock) != 0)
+    mTimeoutSeconds = timeoutSeconds;
+    StopFd(); // Before there are other threads
+
+    if(mWorkerProcesses > 0)
+        return RunWorkers(port, socketPath, maxPendingConnections);
+
+    StartEventLoop();
+
+    // Create RPC service to listen on the designated port and/or socket path.
+    int socks[2] = { -1, -1 };
+    int sockCount = 0;
+    bool listening = true;
+
+    if(port != 0 && mEventLoop != nullptr && mReusePort)
+    {
+        // Every I/O thread listens on the port and accepts by itself
+        listening = mEventLoop->Listen(port, maxPendingConnections);
+        if(listening)
+            INFOMSG("CRpcServer", "Waiting for client to connect on port " << port << " (SO_REUSEPORT, " << mIoThreads << " sockets)");
+    }
+    else if(port != 0)
+    {
+        int sock = CreateSocket(port);
+        listening = (sock >= 0 && Listen(sock, maxPendingConnections));
+        if(listening)
         {
-            ERRMSG("CRpcServer", "close() failed, sock=" << sock << ": " << strerror(errno));
+            socks[sockCount++] = sock;
+            INFOMSG("CRpcServer", "Waiting for client to connect on port " << port);
+        }
+    }
+
+    if(listening && socketPath != nullptr && *socketPath != '\0')
+    {
+        int sock = CreateSocket(socketPath);
+        listening = (sock >= 0 && Listen(sock, maxPendingConnections));
+        if(listening)
+        {
+            socks[sockCount++] = sock;
+            INFOMSG("CRpcServer", "Waiting for client to connect on " << socketPath);
         }
+    }
+
+    if(!listening)
+    {
+        for(int i = 0; i < sockCount; i++)
+            close(socks[i]);
 
-        sock = -1;
+        delete mEventLoop;
+        mEventLoop = nullptr;
         return false;
     }
 
-    INFOMSG("CRpcServer", "Waiting for client to connect on port " << port);
+    Serve(socks, sockCount);
 
-    // Loop looking for connections / data to handle
-    mTimeoutSeconds = timeoutSeconds;
+    // Clean up... No new connections from here on.
+    for(int i = 0; i < sockCount; i++)
+        close(socks[i]);
+
+    // Note: A forked child that handled a connection must not remove
+    // the socket file the parent is still listening on
+    if(socketPath != nullptr && *socketPath != '\0' && getpid() == mPid)
+        unlink(socketPath);
+
+    // When draining the shared memory connections only stop waiting for calls
+    InterruptShmConnections(!mDraining);
+    if(mDraining)
+        DrainConnections();
+
+    StopEventLoop();
+
+    INFOMSG("CRpcServer", "Stopped");
+    return true;
+}
+
+void CRpcServer::StartEventLoop()
+{
+    if(mIoThreads <= 0)
+        return;
+
+    mEventLoop = new CRpcEventLoop(this);
+    if(!mEventLoop->Start(mIoThreads, mHandlerThreads, mMaxQueued))
+    {
+        ERRMSG("CRpcServer", "Failed to start the event loop, handling every connection on its own");
+        delete mEventLoop;
+        mEventLoop = nullptr;
+    }
+}
+
+void CRpcServer::StopEventLoop()
+{
+    if(mEventLoop == nullptr)
+        return;
+
+    // The connections handed to threads of their own stop when they see this
+    mContinueRunning = false;
+    delete mEventLoop;
+    mEventLoop = nullptr;
+}
+
+void CRpcServer::Serve(const int* socks, int sockCount)
+{
+    // Loop looking for connections / data to handle. Without a timeout
+    // only a connection or Stop wakes it up.
     struct timespec timeout = {mTimeoutSeconds,0};
     fd_set readfds;
     int res = 0;
+    int stopFd = StopFd();
 
     while(mContinueRunning)
     {
@@ -466,9 +1146,29 @@ bool CRpcServer::Run(unsigned short port, time_t timeoutSeconds, int maxPendingC
             break;
 
         FD_ZERO(&readfds);
-        FD_SET(sock, &readfds);
+        int maxSock = -1;
+        for(int i = 0; i < sockCount; i++)
+        {
+            FD_SET(socks[i], &readfds);
+            if(socks[i] > maxSock)
+                maxSock = socks[i];
+        }
 
-        res = pselect(sock+1, &readfds, nullptr, nullptr, &timeout, nullptr);
+        if(stopFd >= 0)
+        {
+            FD_SET(stopFd, &readfds);
+            if(stopFd > maxSock)
+                maxSock = stopFd;
+        }
+
+        if(mParentStopFd >= 0)
+        {
+            FD_SET(mParentStopFd, &readfds);
+            if(mParentStopFd > maxSock)
+                maxSock = mParentStopFd;
+        }
+
+        res = pselect(maxSock+1, &readfds, nullptr, nullptr, (mTimeoutSeconds > 0 ? &timeout : nullptr), nullptr);
 
         if(res < 0)
         {
@@ -478,7 +1178,7 @@ bool CRpcServer::Run(unsigned short port, time_t timeoutSeconds, int maxPendingC
             }
             else
             {
-                ERRMSG("CRpcServer", "pselect() failed, sock=" << sock << ": " << strerror(errno));
+                ERRMSG("CRpcServer", "pselect() failed: " << strerror(errno));
                 break;
             }
         }
@@ -488,21 +1188,292 @@ bool CRpcServer::Run(unsigned short port, time_t timeoutSeconds, int maxPendingC
         }
         else
         {
-            // Accept incoming client connection.
-            int sockCon = AcceptConnection(sock);
-            if(sockCon > 0)
+            // Stopped, or the supervising process has gone or is stopping
+            if(stopFd >= 0 && FD_ISSET(stopFd, &readfds))
+                break;
+
+            if(mParentStopFd >= 0 && FD_ISSET(mParentStopFd, &readfds))
+            {
+                Stop();
+                break;
+            }
+
+            for(int i = 0; i < sockCount && mContinueRunning; i++)
+            {
+                if(!FD_ISSET(socks[i], &readfds))
+                    continue;
+
+                // Accept incoming client connection.
+                int sockCon = AcceptConnection(socks[i]);
+                if(sockCon > 0 && mEventLoop != nullptr)
+                {
+                    // The event loop takes it over and returns right away
+                    mEventLoop->Add(sockCon);
+                }
+                else if(sockCon > 0)
+                {
+                    // Process new client connection.
+                    // If will not return until the connection closed/lost.
+                    HandleConnection(sockCon);
+                }
+            }
+        }
+    }
+
+    if(mStopping)
+        LogStopping();
+}
+
+bool CRpcServer::RunWorkers(unsigned short port, const char* socketPath, int maxPendingConnections)
+{
+    if(mReusePort)
+        INFOMSG("CRpcServer", "Worker processes share the listening sockets, SO_REUSEPORT is not used");
+
+    // The listening sockets are created once and inherited by every worker.
+    // They are non-blocking since all the workers wake up for a connection
+    // and only one of them gets it.
+    int socks[2] = { -1, -1 };
+    int sockCount = 0;
+    bool listening = true;
+
+    if(port != 0)
+    {
+        int sock = CreateSocket(port);
+        listening = (sock >= 0 && Listen(sock, maxPendingConnections));
+        if(listening)
+            socks[sockCount++] = sock;
+    }
+
+    if(listening && socketPath != nullptr && *socketPath != '\0')
+    {
+        int sock = CreateSocket(socketPath);
+        listening = (sock >= 0 && Listen(sock, maxPendingConnections));
+        if(listening)
+            socks[sockCount++] = sock;
+    }
+
+    for(int i = 0; i < sockCount && listening; i++)
+    {
+        int flags = fcntl(socks[i], F_GETFL, 0);
+        if(flags < 0 || fcntl(socks[i], F_SETFL, flags | O_NONBLOCK) < 0)
+        {
+            ERRMSG("CRpcServer", "fcntl(O_NONBLOCK) failed, sock=" << socks[i] << ": " << strerror(errno));
+            listening = false;
+        }
+    }
+
+    // The workers stop when the write end of this pipe is closed
+    int stopPipe[2] = { -1, -1 };
+    if(listening && pipe(stopPipe) != 0)
+    {
+        ERRMSG("CRpcServer", "pipe() failed: " << strerror(errno));
+        listening = false;
+    }
+
+    if(!listening)
+    {
+        for(int i = 0; i < sockCount; i++)
+            close(socks[i]);
+
+        if(socketPath != nullptr && *socketPath != '\0')
+            unlink(socketPath);
+        return false;
+    }
+
+    fcntl(stopPipe[1], F_SETFD, FD_CLOEXEC);
+
+    if(port != 0)
+        INFOMSG("CRpcServer", "Waiting for client to connect on port " << port << " (" << mWorkerProcesses << " worker processes)");
+    if(socketPath != nullptr && *socketPath != '\0')
+        INFOMSG("CRpcServer", "Waiting for client to connect on " << socketPath << " (" << mWorkerProcesses << " worker processes)");
+
+    // Every worker holds the write end of a pipe of its own, the read end
+    // hangs up when the worker exits. Unlike SIGCHLD this works whatever
+    // the application does with the signal.
+    struct CWorker
+    {
+        pid_t pid = 0;
+        int exitFd = -1;
+        std::chrono::steady_clock::time_point started;
+        std::chrono::steady_clock::time_point respawn;
+    };
+    std::vector<CWorker> workers(mWorkerProcesses);
+    bool isWorker = false;
+
+    // When the application ignores SIGCHLD the workers are reaped by the
+    // system, and waitpid() would wait for all of them
+    struct sigaction sa;
+    bool reap = (sigaction(SIGCHLD, nullptr, &sa) == 0 &&
+                 sa.sa_handler != SIG_IGN && !(sa.sa_flags & SA_NOCLDWAIT));
+
+    while(mContinueRunning)
+    {
+        // Only a worker exiting, a worker to respawn or Stop wake it up
+        auto now = std::chrono::steady_clock::now();
+        int waitMs = -1;
+
+        for(CWorker& worker : workers)
+        {
+            if(worker.pid != 0)
+                continue;
+
+            if(worker.respawn > now)
+            {
+                int ms = (int)std::chrono::duration_cast<std::chrono::milliseconds>(worker.respawn - now).count() + 1;
+                waitMs = (waitMs < 0 ? ms : std::min(waitMs, ms));
+                continue;
+            }
+
+            int exitPipe[2] = { -1, -1 };
+            if(pipe(exitPipe) != 0)
+            {
+                ERRMSG("CRpcServer", "pipe() failed: " << strerror(errno));
+                worker.respawn = now + std::chrono::milliseconds(RPC_WORKER_RESPAWN_DELAY_MS);
+                continue;
+            }
+
+            pid_t pid = fork();
+            if(pid < 0)
+            {
+                ERRMSG("CRpcServer", "fork() failed: " << strerror(errno));
+                close(exitPipe[0]);
+                close(exitPipe[1]);
+                worker.respawn = now + std::chrono::milliseconds(RPC_WORKER_RESPAWN_DELAY_MS);
+            }
+            else if(pid == 0)
+            {
+                // The worker keeps only the listening sockets, the read
+                // end of the stop pipe and the write end of its exit pipe.
+                // Its Stop is its own (StopFd makes a new descriptor).
+                close(stopPipe[1]);
+                close(exitPipe[0]);
+                for(CWorker& other : workers)
+                {
+                    if(other.exitFd >= 0)
+                        close(other.exitFd);
+                }
+                isWorker = true;
+                break;
+            }
+            else
+            {
+                close(exitPipe[1]);
+                fcntl(exitPipe[0], F_SETFD, FD_CLOEXEC);
+                worker.pid = pid;
+                worker.exitFd = exitPipe[0];
+                worker.started = now;
+                INFOMSG("CRpcServer", "Started worker process " << pid);
+            }
+        }
+
+        if(isWorker)
+            break;
+
+        std::vector<struct pollfd> fds;
+        fds.push_back({StopFd(), POLLIN, 0});
+        for(const CWorker& worker : workers)
+        {
+            if(worker.pid != 0)
+                fds.push_back({worker.exitFd, POLLIN, 0});
+        }
+
+        int res = poll(fds.data(), fds.size(), waitMs);
+        if(res < 0 && errno != EINTR)
+        {
+            ERRMSG("CRpcServer", "poll() failed: " << strerror(errno));
+            break;
+        }
+
+        for(size_t i = 1; i < fds.size() && res > 0; i++)
+        {
+            if(fds[i].revents == 0)
+                continue;
+
+            CWorker& worker = *std::find_if(workers.begin(), workers.end(),
+                [&fds, i](const CWorker& w){ return w.exitFd == fds[i].fd; });
+
+            // The worker has exited, reap it
+            int status = 0;
+            if(!reap)
             {
-                // Process new client connection.
-                // If will not return until the connection closed/lost.
-                HandleConnection(sockCon);
+                INFOMSG("CRpcServer", "Worker process " << worker.pid << " exited");
             }
+            else if(waitpid(worker.pid, &status, 0) == worker.pid)
+            {
+                if(WIFSIGNALED(status))
+                    ERRMSG("CRpcServer", "Worker process " << worker.pid << " killed by signal " << WTERMSIG(status));
+                else
+                    INFOMSG("CRpcServer", "Worker process " << worker.pid << " exited with status " << WEXITSTATUS(status));
+            }
+
+            close(worker.exitFd);
+            worker.pid = 0;
+            worker.exitFd = -1;
+
+            // Don't respawn a worker that keeps failing right away too often
+            worker.respawn = worker.started + std::chrono::milliseconds(RPC_WORKER_RESPAWN_DELAY_MS);
         }
     }
 
-    // Clean up...
-    if(sock > 0)
-        close(sock);
-    sock = -1;
+    if(isWorker)
+    {
+        StartEventLoop();
+        mParentStopFd = stopPipe[0];
+        Serve(socks, sockCount);
+
+        for(int i = 0; i < sockCount; i++)
+            close(socks[i]);
+        mParentStopFd = -1;
+        close(stopPipe[0]);
+
+        InterruptShmConnections(!mDraining);
+        if(mDraining)
+            DrainConnections();
+
+        StopEventLoop();
+
+        INFOMSG("CRpcServer", "Worker process stopped");
+        return true;
+    }
+
+    if(mStopping)
+        LogStopping();
+
+    // Tell the workers to stop and wait for them, they finish the calls in
+    // progress (and drain their connections, with a drain timeout)
+    for(int i = 0; i < sockCount; i++)
+        close(socks[i]);
+    close(stopPipe[0]);
+    close(stopPipe[1]);
+
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(mDrainSeconds + RPC_WORKER_STOP_TIMEOUT);
+    for(CWorker& worker : workers)
+    {
+        if(worker.pid == 0)
+            continue;
+
+        struct pollfd pfd = {worker.exitFd, POLLIN, 0};
+        int res = 0;
+        do
+        {
+            int ms = (int)std::chrono::duration_cast<std::chrono::milliseconds>(deadline - std::chrono::steady_clock::now()).count();
+            res = poll(&pfd, 1, std::max(ms, 0));
+        }
+        while(res < 0 && errno == EINTR);
+
+        if(res <= 0)
+        {
+            ERRMSG("CRpcServer", "Worker process " << worker.pid << " did not stop in time, killing it");
+            kill(worker.pid, SIGKILL);
+        }
+
+        if(reap)
+            waitpid(worker.pid, nullptr, 0);
+        close(worker.exitFd);
+    }
+
+    if(socketPath != nullptr && *socketPath != '\0')
+        unlink(socketPath);
 
     INFOMSG("CRpcServer", "Stopped");
     return true;
@@ -510,11 +1481,152 @@ bool CRpcServer::Run(unsigned short port, time_t timeoutSeconds, int maxPendingC
 
 void CRpcServer::Stop()
 {
+    // The first Stop drains the connections if there is a drain timeout,
+    // the next one stops right away
+    bool first = !mStopping.exchange(true);
+    if(first)
+    {
+        mStopTime = std::chrono::steady_clock::now().time_since_epoch().count();
+        mDraining = (mDrainSeconds > 0);
+    }
+    else
+    {
+        mDraining = false;
+    }
+
     mContinueRunning = false;
-    INFOMSG("CRpcServer", "Stopping RPC server...");
+
+    // Wake up whatever waits for connections or calls. The descriptor is
+    // never read, it stays readable. Nothing else here: from a signal
+    // handler only atomics and write() are safe, so Run logs and interrupts
+    // the shared memory connections once it wakes up. (A forked process
+    // that has no descriptor of its own yet sees mContinueRunning.)
+    int savedErrno = errno;
+    uint64_t one = 1;
+    if(mStopFdPid == getpid() && mStopFd[1] >= 0)
+    {
+        ssize_t res = write(mStopFd[1], &one, sizeof(one));
+        (void)res; // Full already (a pipe), or nothing to be done about it
+    }
+    errno = savedErrno;
+}
+
+void CRpcServer::LogStopping()
+{
+    if(mDraining)
+        INFOMSG("CRpcServer", "Stopping RPC server, draining the connections for up to " << mDrainSeconds << " seconds...");
+    else
+        INFOMSG("CRpcServer", "Stopping RPC server...");
+}
+
+bool CRpcServer::Serving()
+{
+    if(mContinueRunning)
+        return true;
+    if(!mDraining)
+        return false;
+
+    // Draining until the deadline
+    auto elapsed = std::chrono::steady_clock::now().time_since_epoch() -
+                   std::chrono::steady_clock::duration(mStopTime.load());
+    return (elapsed < std::chrono::seconds(mDrainSeconds));
+}
+
+void CRpcServer::CountConnection(int delta)
+{
+    std::lock_guard<std::mutex> lock(mConnMutex);
+    mConnections += delta;
+    if(mConnections == 0)
+        mConnCond.notify_all();
+}
+
+void CRpcServer::DrainConnections()
+{
+    // The event loop tells its connections itself
+    if(mEventLoop != nullptr)
+        mEventLoop->Drain();
+
+    // Every connection closes once it is idle. A second Stop or the
+    // deadline are seen within a wait slice.
+    int left = 0;
+    {
+        std::unique_lock<std::mutex> lock(mConnMutex);
+        while(mConnections > 0 && Serving())
+            mConnCond.wait_for(lock, std::chrono::milliseconds(100));
+        left = mConnections;
+    }
+
+    // Whatever still waits to send a reply gives up
+    InterruptShmConnections();
+
+    auto elapsed = std::chrono::steady_clock::now().time_since_epoch() -
+                   std::chrono::steady_clock::duration(mStopTime.load());
+    mDrainUs = std::chrono::duration_cast<std::chrono::microseconds>(elapsed).count();
+
+    if(left > 0)
+        INFOMSG("CRpcServer", "Drain timed out, closing " << left << " connections");
+    else
+        INFOMSG("CRpcServer", "Drained the connections in " << (mDrainUs / 1000) << " ms");
+}
+
+void CRpcServer::DropCalls(CRpcFrameReader& reader)
+{
+    // The calls that have arrived are not run anymore, the client finds
+    // out from RPC_FRAME_FLAG_GOAWAY
+    CRpcFrameHeader hdr;
+    u_char* payload = nullptr;
+    while(reader.HasFrame() && reader.Next(-1, hdr, payload, CRpcFrame::NoDeadline()) > 0)
+        mDroppedCalls++;
+}
+
+int CRpcServer::StopFd()
+{
+    // A forked process gets a descriptor of its own, so stopping the server
+    // in one process doesn't wake up the others. The one it got from its
+    // parent is closed.
+    pid_t pid = getpid();
+    if(mStopFdPid == pid)
+        return mStopFd[0];
+
+    if(mStopFd[1] >= 0 && mStopFd[1] != mStopFd[0])
+        close(mStopFd[1]);
+    if(mStopFd[0] >= 0)
+        close(mStopFd[0]);
+    mStopFd[0] = mStopFd[1] = -1;
+    mStopFdPid = pid;
+
+#if defined(__linux__)
+    mStopFd[0] = mStopFd[1] = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if(mStopFd[0] < 0)
+        ERRMSG("CRpcServer", "eventfd() failed: " << strerror(errno));
+#else
+    if(pipe(mStopFd) != 0)
+    {
+        ERRMSG("CRpcServer", "pipe() failed: " << strerror(errno));
+        mStopFd[0] = mStopFd[1] = -1;
+    }
+    else
+    {
+        for(int fd : mStopFd)
+        {
+            fcntl(fd, F_SETFD, FD_CLOEXEC);
+            fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
+        }
+    }
+#endif
+
+    return mStopFd[0];
+}
+
+void CRpcServer::InterruptShmConnections(bool writers /*= true*/)
+{
+    std::lock_guard<std::mutex> lock(mShmMutex);
+
+    for(CRpcShmChannel* channel : mShmChannels)
+        channel->Interrupt(writers);
 }
 
-int CRpcServer::CreateSocket(unsigned short port)
+int CRpcServer::CreateSocket(unsigned short port, bool reusePort /*= false*/)
 {
     // Open up the TCP socket
     int sock = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
@@ -539,28 +1651,102 @@ int CRpcServer::CreateSocket(unsigned short port)
         return -1;
     }
 
-    if(bind(sock, (struct sockaddr*)&addr, sizeof(addr)) < 0)
-    {
-        ERRMSG("CRpcServer", "bind() failed" << ", strerror: " << strerror(errno)
-                << ", hstrerror: " << hstrerror(h_errno));
-        close(sock);
-        return -1;
+    if(reusePort)
+    {
+#ifdef SO_REUSEPORT
+        // Every socket bound to the port gets its share of the connections
+        flag = 1;
+        if(setsockopt(sock, SOL_SOCKET, SO_REUSEPORT, &flag, sizeof(flag)) < 0)
+        {
+            ERRMSG("CRpcServer", "setsockopt(SO_REUSEPORT) failed: " << strerror(errno));
+            close(sock);
+            return -1;
+        }
+#else
+        ERRMSG("CRpcServer", "SO_REUSEPORT is not available on this platform");
+        close(sock);
+        return -1;
+#endif
+    }
+
+    if(bind(sock, (struct sockaddr*)&addr, sizeof(addr)) < 0)
+    {
+        ERRMSG("CRpcServer", "bind() failed" << ", strerror: " << strerror(errno)
+                << ", hstrerror: " << hstrerror(h_errno));
+        close(sock);
+        return -1;
+    }
+
+    return sock;
+}
+
+int CRpcServer::CreateSocket(const char* socketPath)
+{
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+
+    if(strlen(socketPath) >= sizeof(addr.sun_path))
+    {
+        ERRMSG("CRpcServer", "Socket path is too long: " << socketPath);
+        return -1;
+    }
+    strcpy(addr.sun_path, socketPath);
+
+    // Open up the Unix domain socket
+    int sock = socket(AF_UNIX, SOCK_STREAM, 0);
+    if(sock < 0)
+    {
+        ERRMSG("CRpcServer",  "socket() failed: " << strerror(errno));
+        return -1;
+    }
+
+    // Remove the socket file left behind by a previous run
+    unlink(socketPath);
+
+    if(bind(sock, (struct sockaddr*)&addr, sizeof(addr)) < 0)
+    {
+        ERRMSG("CRpcServer", "bind(" << socketPath << ") failed: " << strerror(errno));
+        close(sock);
+        return -1;
+    }
+
+    return sock;
+}
+
+bool CRpcServer::Listen(int sock, int maxPendingConnections)
+{
+    // Start to listen
+    if(listen(sock, maxPendingConnections) != 0)
+    {
+        ERRMSG("CRpcServer", "listen() failed, sock=" << sock << ": " << strerror(errno));
+
+        if(close(sock) != 0)
+        {
+            ERRMSG("CRpcServer", "close() failed, sock=" << sock << ": " << strerror(errno));
+        }
+
+        return false;
     }
 
-    return sock;
+    return true;
 }
 
 int CRpcServer::AcceptConnection(int sock)
 {
     // Accept new client connection
-    struct sockaddr_in addr;
+    struct sockaddr_storage addr;
     socklen_t alen = sizeof(addr);
 
     int fd = accept(sock, (struct sockaddr*)&addr, &alen);
 
     if(fd == -1)
     {
-        if(errno == EINTR)
+        if(errno == EAGAIN || errno == EWOULDBLOCK)
+        {
+            // Another worker process has taken the connection
+        }
+        else if(errno == EINTR)
         {
             //ERRMSG("CRpcServer", "accept() failed (errno=EINTR), sock=" << sock << ": " << strerror(errno));
             ERRMSG("CRpcServer", "accept() failed (errno=EINTR): " << strerror(errno));
@@ -574,6 +1760,18 @@ int CRpcServer::AcceptConnection(int sock)
         return -1;
     }
 
+#ifndef __linux__
+    // Elsewhere the connection inherits O_NONBLOCK from a worker's listening socket
+    int flags = fcntl(fd, F_GETFL, 0);
+    if(flags >= 0 && (flags & O_NONBLOCK))
+        fcntl(fd, F_SETFL, flags & ~O_NONBLOCK);
+#endif // __linux__
+
+    return SetupConnection(fd, addr.ss_family);
+}
+
+int CRpcServer::SetupConnection(int fd, int family)
+{
     int flag = 1;
     if(setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &flag, sizeof(flag)) < 0)
     {
@@ -583,7 +1781,8 @@ int CRpcServer::AcceptConnection(int sock)
     }
 
     flag = 1;
-    if(setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &flag, sizeof(flag)) < 0)
+    if(family == AF_INET &&
+       setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &flag, sizeof(flag)) < 0)
     {
         ERRMSG("CRpcServer", "setsockopt(TCP_NODELAY) failed, fd=" << fd << ": " << strerror(errno));
         close(fd);
@@ -627,10 +1826,125 @@ int CRpcServer::AcceptConnection(int sock)
 
 void CRpcServer::HandleConnection(int sock)
 {
+    // SunRPC and native clients connect to the same port. Tell them apart
+    // by the first 4 bytes the client sends: RPC_FRAME_MAGIC can't be the
+    // beginning of a SunRPC record mark.
+    uint32_t magic = 0;
+    ssize_t len = 0;
+    bool closed = false; // By someone else, nothing to clean up
+
+    CountConnection(1); // Stop waits for it when draining
+
+    while(len < (ssize_t)sizeof(magic))
+    {
+        int res = WaitForCall(sock);
+        if(res <= 0)
+        {
+            closed = (res == -2);
+            len = -1;
+            break;
+        }
+
+        len = recv(sock, &magic, sizeof(magic), MSG_PEEK | MSG_WAITALL);
+        if(len == 0 || (len < 0 && errno != EINTR))
+        {
+            INFOMSG("CRpcServer", "Disconnected (sock=" << sock << ")");
+            len = -1;
+            break;
+        }
+    }
+
+    if(len < 0)
+    {
+        if(!closed)
+            close(sock);
+    }
+    else if(ntohl(magic) == RPC_FRAME_MAGIC)
+        HandleNativeConnection(sock);
+    else
+        HandleSunRpcConnection(sock);
+
+    CountConnection(-1);
+}
+
+int CRpcServer::WaitForCall(int sock)
+{
+    // Non-blocking call with timeout, or none (-1) with a timeout of 0.
+    // Stop, or the parent of a worker process, wakes it up too.
+    // Note: poll, unlike pselect, isn't limited to descriptors below FD_SETSIZE
+    int timeout = (mTimeoutSeconds > 0 ? (int)mTimeoutSeconds * 1000 : -1);
+    int res = 0;
+
+    while(Serving())
+    {
+        // Draining: only a call that is already there is served, an idle
+        // connection is done
+        bool draining = !mContinueRunning;
+        if(!draining)
+        {
+            OnNotify(NOTIFY_TYPE::WAITING_FOR_CALL);
+            if(!mContinueRunning)
+                continue;
+        }
+
+        struct pollfd pfd[3];
+        int count = 0;
+        pfd[count++] = {sock, POLLIN, 0};
+        if(!draining)
+        {
+            pfd[count++] = {StopFd(), POLLIN, 0};
+            if(mParentStopFd >= 0)
+                pfd[count++] = {mParentStopFd, POLLIN, 0};
+        }
+
+        res = poll(pfd, count, (draining ? 0 : timeout));
+        if(res < 0)
+        {
+            if(errno == EINTR)
+            {
+                INFOMSG("CRpcServer", "poll() interrupted with EINTR signal, continue running");
+            }
+            else
+            {
+                ERRMSG("CRpcServer",  "poll() failed, sock=" << sock << ": " << strerror(errno));
+                return -1;
+            }
+        }
+        else if(res == 0)
+        {
+            if(draining)
+                break;
+//            INFOMSG("CRpcServer", "poll() timed out in " << mTimeoutSeconds << " seconds, continue running");
+        }
+        else if(pfd[0].revents & POLLNVAL)
+        {
+            // The socket is closed already, there is nothing to clean up
+            INFOMSG("CRpcServer", "Disconnected (sock=" << sock << ")");
+            return -2;
+        }
+        else if(pfd[0].revents != 0)
+        {
+            // Readable, or hung up: the read that follows finds out which
+            return 1;
+        }
+        else if(count > 2 && pfd[2].revents != 0)
+        {
+            Stop(); // The supervising process has gone or is stopping
+        }
+    }
+
+    return 0;
+}
+
+void CRpcServer::HandleSunRpcConnection(int sock)
+{
+    std::unique_lock<std::recursive_mutex> lock(sSunRpcMutex);
+
     // Create a TCP/IP-based RPC service transport and associate it with the socket.
     SVCXPRT* transp = svcfd_create(sock, 0, 0); // send_buf_size=0,rbuf_size=0
     if(transp == nullptr)
     {
+        lock.unlock();
         ERRMSG("CRpcServer", "svctcp_create() failed");
         close(sock);
         return;
@@ -640,65 +1954,422 @@ void CRpcServer::HandleConnection(int sock)
 
     // Associates prognum and versnum with the service dispatch procedure (dispatch),
     // but DO NOT register with the portmap service.
-    if(!svc_register(transp, RPC_PROTOBUF_PROG_NUMBER, RPC_PROTOBUF_VERSION, dispatch, 0))
+    // Register both codec versions, so old and new clients can connect.
+    if(!svc_register(transp, RPC_PROTOBUF_PROG_NUMBER, RPC_PROTOBUF_VERSION, dispatch, 0) ||
+       !svc_register(transp, RPC_PROTOBUF_PROG_NUMBER, RPC_PROTOBUF_VERSION_BULK, dispatch, 0))
     {
+        svc_destroy(transp); // Closes the socket
+        lock.unlock();
         ERRMSG("CRpcServer", "svc_register() failed");
-        svc_destroy(transp);
-        close(sock);
         return;
     }
 
-    // Non-blocking call with timeout
-    struct timespec timeout = {mTimeoutSeconds,0};
-    fd_set readfds;
+    CSunRpcConnection conn;
+    conn.server = this;
+    conn.libOps = transp->xp_ops;
+    conn.ops = *transp->xp_ops;
+    conn.ops.xp_destroy = SunRpcDestroy;
+    transp->xp_ops = &conn.ops;
+
+    sSunRpcServers[transp] = &conn;
+    lock.unlock();
+
     int res = 0;
 
-    while(mContinueRunning)
+    while((res = WaitForCall(sock)) > 0)
     {
-        OnNotify(NOTIFY_TYPE::WAITING_FOR_CALL);
-        if(!mContinueRunning)
+        // A hang up is found out here, before the library tries to read a call
+        char c = 0;
+        ssize_t len = recv(sock, &c, sizeof(c), MSG_PEEK | MSG_DONTWAIT);
+        if(len == 0 || (len < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR))
+        {
+            INFOMSG("CRpcServer", "Disconnected (sock=" << sock << ")");
             break;
+        }
 
+#if defined(__linux__)
+        // Only looks up the transport of this socket (under the library's
+        // own lock in libtirpc, in thread-local tables in glibc), so the
+        // connections are served concurrently
+        svc_getreq_common(sock); // No fd_set, so no FD_SETSIZE limit
+#else
+        // Walks the process-wide tables, one connection at a time
+        lock.lock();
+        fd_set readfds;
         FD_ZERO(&readfds);
         FD_SET(sock, &readfds);
+        svc_getreqset(&readfds);
+        lock.unlock();
+#endif
 
-        res = pselect(sock+1, &readfds, nullptr, nullptr, &timeout, nullptr);
-        if(res < 0)
+        // The library gave up on the connection (a malformed record for
+        // instance), the socket is still open
+        lock.lock();
+        bool dead = conn.dead;
+        lock.unlock();
+        if(dead)
         {
-            if(errno == EINTR)
+            INFOMSG("CRpcServer", "Connection dropped by the RPC library (sock=" << sock << ")");
+            break;
+        }
+    }
+
+    // Clean up... the library's svc_destroy closes the socket. Only if
+    // it is closed already (poll said POLLNVAL) is the transport leaked
+    // rather than closing a descriptor that may be someone else's now.
+    lock.lock();
+    sSunRpcServers.erase(transp);
+    transp->xp_ops = conn.libOps;
+    if(res != -2)
+        svc_destroy(transp);
+    lock.unlock();
+    transp = nullptr;
+
+    // TODO - We don't use Portmap, do we still need to unregister?
+    //svc_unregister(RPC_PROTOBUF_PROG_NUMBER, RPC_PROTOBUF_VERSION);
+}
+
+void CRpcServer::HandleNativeConnection(int sock)
+{
+    CRpcFrameReader reader; // Receive buffer, reused for every call
+    CRpcFrameWriter writer; // Replies to pipelined calls are sent together
+    CRpcFrameHeader hdr;
+    u_char* payload = nullptr;
+    bool stopped = false;   // Stop rather than the client ended it
+    bool goAway = false;    // The client was told the server is stopping
+
+    while(true)
+    {
+        if(!Serving())
+        {
+            stopped = true;
+            break;
+        }
+
+        // Process the calls that have already arrived before waiting for more.
+        // The replies collected so far go out before going to wait.
+        if(!reader.HasFrame())
+        {
+            // Draining: tell the client along with the replies
+            if(!mContinueRunning && !goAway)
             {
-                INFOMSG("CRpcServer", "pselect() interrupted with EINTR signal, continue running");
+                goAway = true;
+                mGoAways++;
+                if(!writer.Add(sock, CRpcFrame::GoAway(), nullptr))
+                    break;
             }
-            else
+
+            if(writer.Pending() > 0 && !writer.Flush(sock))
             {
-                //ERRMSG("CRpcServer",  "pselect() failed, sock=" << sock << ": " << strerror(errno));
-                // This is not an error - pselect failed because client is disconnected 
-                INFOMSG("CRpcServer", "Disconnected (sock=" << sock << ")");
+                INFOMSG("CRpcServer", "Failed to send reply (sock=" << sock << "): " << strerror(errno));
+                break;
+            }
+
+            int res = WaitForCall(sock);
+            if(res <= 0)
+            {
+                stopped = (res == 0);
                 break;
             }
         }
-        else if(res == 0)
+
+        size_t capacity = reader.Capacity();
+        int res = reader.Next(sock, hdr, payload, CRpcFrame::NoDeadline());
+        CountRecvBuffer(capacity, reader.Capacity());
+        if(res == -2 || (res > 0 && (hdr.flags & RPC_FRAME_FLAG_REPLY)))
         {
-//            INFOMSG("CRpcServer", "pselect() timed out in " << mTimeoutSeconds << " seconds, continue running");
+            ERRMSG("CRpcServer", "Invalid request frame received (sock=" << sock << ")");
+            break;
         }
+        else if(res <= 0)
+        {
+            INFOMSG("CRpcServer", "Disconnected (sock=" << sock << ")");
+            break;
+        }
+
+        if(hdr.flags & RPC_FRAME_FLAG_SHM)
+        {
+            // The client asks to switch to a shared memory segment it created
+            CRpcShmChannel channel;
+            std::string name((const char*)payload, (payload != nullptr ? hdr.length : 0));
+            bool opened = channel.Open(sock, name);
+            if(!opened)
+                ERRMSG("CRpcServer", channel.GetError());
+
+            CRpcFrameHeader reply;
+            reply.reqId = hdr.reqId;
+            reply.flags = RPC_FRAME_FLAG_REPLY | RPC_FRAME_FLAG_SHM;
+            if(!opened)
+                reply.flags |= RPC_FRAME_FLAG_ERROR; // The client stays on the socket
+
+            if(!writer.Add(sock, reply, nullptr) || !writer.Flush(sock))
+            {
+                INFOMSG("CRpcServer", "Failed to send reply (sock=" << sock << "): " << strerror(errno));
+                break;
+            }
+
+            if(opened)
+            {
+                channel.SetSpinCount(mShmSpinCount);
+                HandleShmConnection(sock, channel);
+                break;
+            }
+
+            continue;
+        }
+
+        param out;
+        CRpcFrameHeader reply;
+        bool sent = false;
+        if(DispatchFrame(hdr, payload, reply, &out))
+            sent = writer.Add(sock, reply, &out);
         else
+            sent = writer.Add(sock, reply, nullptr);
+
+        // Post-reply cleanup to free the memory (if any) allocated by OnCall.
+        // Note: The reply is either sent or copied by now.
+        OnCleanup(&out);
+
+        if(!sent)
         {
-            svc_getreqset(&readfds);
+            INFOMSG("CRpcServer", "Failed to send reply (sock=" << sock << "): " << strerror(errno));
+            break;
         }
     }
 
-    // Clean up...
-    // TODO: svc_destroy() crashes when called after pselect() failed
-    // so let's not call if pselect() failed
-    // TODO: Could it be leaking memory?
-    if(res >= 0)
-        svc_destroy(transp);
-    transp = nullptr;
+    // The client finds out which calls were not run
+    if(stopped)
+    {
+        DropCalls(reader);
+        if(!goAway)
+        {
+            mGoAways++;
+            writer.Add(sock, CRpcFrame::GoAway(), nullptr);
+        }
+    }
+
+    // Send the replies that are still collected, if the server is stopping
+    if(writer.Pending() > 0)
+        writer.Flush(sock);
 
     close(sock); // We are done with the socket
+}
 
-    // TODO - We don't use Portmap, do we still need to unregister?
-    //svc_unregister(RPC_PROTOBUF_PROG_NUMBER, RPC_PROTOBUF_VERSION);
+void CRpcServer::HandleShmConnection(int sock, CRpcShmChannel& channel)
+{
+    std::vector<u_char> buf; // Receive buffer, reused for every call
+    CRpcFrameHeader hdr;
+    struct timeval timeout = {mTimeoutSeconds,0};
+
+    // Stop wakes it up
+    {
+        std::unique_lock<std::mutex> lock(mShmMutex);
+        mShmChannels.push_back(&channel);
+    }
+
+    // Once stopping the client is told to go elsewhere, in time or not at all
+    const struct timeval goAwayTimeout = {1,0};
+    bool goAway = false;
+
+    while(Serving())
+    {
+        // Draining: only a call that is already there is served, an idle
+        // connection is done
+        bool draining = !mContinueRunning;
+        if(draining && !goAway)
+        {
+            goAway = true;
+            mGoAways++;
+            if(!channel.Write(CRpcFrame::GoAway(), nullptr, 0, CRpcFrame::Deadline(goAwayTimeout)))
+                break;
+        }
+
+        if(!draining)
+        {
+            OnNotify(NOTIFY_TYPE::WAITING_FOR_CALL);
+            if(!mContinueRunning)
+                continue;
+        }
+
+        CRpcFrame::deadline_t deadline = CRpcFrame::NoDeadline();
+        if(draining)
+            deadline = std::chrono::steady_clock::now();
+        else if(mTimeoutSeconds > 0)
+            deadline = CRpcFrame::Deadline(timeout);
+
+        size_t capacity = buf.capacity();
+        int res = channel.Read(hdr, buf, deadline);
+        CountRecvBuffer(capacity, buf.capacity());
+        if(res == 0)
+        {
+            if(!mContinueRunning)
+                break; // Stopped, or nothing left to serve
+            continue; // Timed out waiting for a call
+        }
+        else if(res == -2 || (res > 0 && (hdr.flags & RPC_FRAME_FLAG_REPLY)))
+        {
+            ERRMSG("CRpcServer", "Invalid request frame received (sock=" << sock << ")");
+            break;
+        }
+        else if(res < 0)
+        {
+            INFOMSG("CRpcServer", "Disconnected (sock=" << sock << ")");
+            break;
+        }
+
+        param out;
+        CRpcFrameHeader reply;
+        bool sent = false;
+        if(DispatchFrame(hdr, buf.data(), reply, &out))
+            sent = channel.Write(reply, &out, CRpcFrame::NoDeadline());
+        else
+            sent = channel.Write(reply, nullptr, 0, CRpcFrame::NoDeadline());
+
+        // Post-reply cleanup to free the memory (if any) allocated by OnCall
+        OnCleanup(&out);
+
+        if(!sent)
+        {
+            INFOMSG("CRpcServer", "Failed to send reply (sock=" << sock << "): " << strerror(errno));
+            break;
+        }
+    }
+
+    if(!mContinueRunning && !goAway)
+    {
+        mGoAways++;
+        channel.Write(CRpcFrame::GoAway(), nullptr, 0, CRpcFrame::Deadline(goAwayTimeout));
+    }
+
+    {
+        std::unique_lock<std::mutex> lock(mShmMutex);
+        mShmChannels.erase(std::find(mShmChannels.begin(), mShmChannels.end(), &channel));
+    }
+
+    channel.Close();
+}
+
+bool CRpcServer::DispatchFrame(const CRpcFrameHeader& hdr, u_char* data, CRpcFrameHeader& reply, param* out)
+{
+    param in;
+    in.type = (int)hdr.type;
+    in.data_len = hdr.length;
+    in.data_val = (hdr.length > 0 ? data : nullptr);
+
+    out->type = in.type; // Initially, can be reset in OnCall if desired
+    mCalls++;
+
+    bool ok = CallAndWait(&in, out);
+    ReplyHeader(hdr, ok, out, reply);
+    return ok;
+}
+
+void CRpcServer::ReplyHeader(const CRpcFrameHeader& hdr, bool ok, param* out, CRpcFrameHeader& reply)
+{
+    reply.reqId = hdr.reqId;
+    reply.flags = RPC_FRAME_FLAG_REPLY;
+
+    // On failure the reply is an empty frame flagged as an error
+    if(!ok)
+    {
+        reply.type = hdr.type;
+        reply.flags |= RPC_FRAME_FLAG_ERROR;
+        reply.length = 0;
+        return;
+    }
+
+    if(out->data_iov != nullptr)
+        out->data_len = IovLength(out->data_iov, out->data_iovcnt);
+
+    reply.type = (uint32_t)out->type;
+    reply.length = out->data_len;
+}
+
+//
+// Class CRpcWaitReply
+//
+// A call served by a thread of its own: the thread waits for the reply,
+// then sends it and calls OnCleanup itself
+//
+class CRpcWaitReply : public CRpcPendingReply
+{
+public:
+    CRpcWaitReply(CRpc::param* out) { mOut = out; }
+
+    virtual void Complete(bool ok)
+    {
+        // Notified under the lock, the waiter can go (with this object) right after
+        std::lock_guard<std::mutex> lock(mMutex);
+        mOk = ok;
+        mDone = true;
+        mCond.notify_one();
+    }
+
+    bool Wait()
+    {
+        std::unique_lock<std::mutex> lock(mMutex);
+        mCond.wait(lock, [this]{ return mDone; });
+        return mOk;
+    }
+
+private:
+    std::mutex mMutex;
+    std::condition_variable mCond;
+    bool mDone = false;
+    bool mOk = false;
+};
+
+bool CRpcServer::CallAndWait(const param* in, param* out)
+{
+    CRpcWaitReply pending(out);
+    OnCallAsync(in, CRpcReply(&pending));
+    return pending.Wait();
+}
+
+void CRpcServer::OnCallAsync(const param* in, CRpcReply reply)
+{
+    if(OnCall(in, reply.Out()))
+        reply.Send();
+    else
+        reply.Fail();
+}
+
+//
+// Class CRpcReply
+//
+CRpcReply& CRpcReply::operator=(CRpcReply&& other)
+{
+    if(this != &other)
+    {
+        Fail();
+        mPending = other.mPending;
+        other.mPending = nullptr;
+    }
+    return *this;
+}
+
+CRpc::param* CRpcReply::Out() const
+{
+    return (mPending != nullptr ? mPending->mOut : nullptr);
+}
+
+void CRpcReply::Send()
+{
+    Complete(true);
+}
+
+void CRpcReply::Fail()
+{
+    Complete(false);
+}
+
+void CRpcReply::Complete(bool ok)
+{
+    // The pending call can be gone as soon as it is completed
+    CRpcPendingReply* pending = mPending;
+    mPending = nullptr;
+    if(pending != nullptr)
+        pending->Complete(ok);
 }
 
 void CRpcServer::RpcDispatch(struct svc_req* rqstp, SVCXPRT* transp)
@@ -717,61 +2388,97 @@ void CRpcServer::RpcDispatch(struct svc_req* rqstp, SVCXPRT* transp)
             return;
     }
 
-    // Make sure that we have a valid CRpcServer object
-    if(mServer == nullptr)
+    // Find the server the connection belongs to
+    CRpcServer* server = nullptr;
+    {
+        std::unique_lock<std::recursive_mutex> lock(sSunRpcMutex);
+        auto it = sSunRpcServers.find(transp);
+        if(it != sSunRpcServers.end())
+            server = it->second->server;
+    }
+
+    if(server == nullptr)
     {
         svcerr_systemerr(transp);
         return;
     }
     
-    // Call CRpc::XdrParam to decode RPC request param
+    // The program version selects the payload codec
+    CODEC codec = (rqstp->rq_vers == RPC_PROTOBUF_VERSION_BULK ? CODEC::BULK : CODEC::LEGACY);
+    xdrproc_t xdrParam = CRpc::XdrParamProc(codec);
+
+    // Decode RPC request param straight into this thread's receive buffer
+    // instead of letting XDR allocate a new one for every call.
+    // Note: A connection is served by one thread at a time, and a thread
+    // serves one connection at a time, so the buffer is never shared.
+    static thread_local CRpcRecvBuffer recvBuf;
+    size_t capacity = recvBuf.capacity;
+
     param in, out;
-    
-    if(!svc_getargs(transp, (xdrproc_t)CRpc::XdrParam, (caddr_t)&in))
+    CRpcRecvArgs args;
+    args.pr = &in;
+    args.buf = &recvBuf;
+    args.codec = codec;
+
+    bool decoded = svc_getargs(transp, (xdrproc_t)XdrRecvArgs, (caddr_t)&args);
+    server->CountRecvBuffer(capacity, recvBuf.capacity);
+    if(!decoded)
     {
+        if(recvBuf.capacity > RPC_RECV_BUFFER_KEEP)
+            recvBuf.Release();
         svcerr_decode(transp);
         return;
     }
     
+    server->mCalls++;
     out.type = in.type; // Initially, can be reset in OnCall if desired
     
     // 1. Call CRpcServer::OnCall to handle the RPC call
     // 2. Reply with RPC response
-    if(!mServer->OnCall(&in, &out))
+    if(!server->CallAndWait(&in, &out))
     {
         //printf("OnCall failed\n");
         svcerr_systemerr(transp);
     }
-    else if(!svc_sendreply(transp, (xdrproc_t)CRpc::XdrParam, (char*)&out))
+    else if(!svc_sendreply(transp, xdrParam, (char*)&out))
     {
         //printf("svc_sendreply failed\n");
         svcerr_systemerr(transp);
     }
     
     // Post-reply cleanup to free the memory (if any) allocated by OnCall
-    mServer->OnCleanup(&out);
+    server->OnCleanup(&out);
     
     out.type = 0;
     out.data_len = 0;
     out.data_val = nullptr;
-
-    // Free the memory that was allocated when RPC request param was decoded
-    if(!svc_freeargs(transp, (xdrproc_t)CRpc::XdrParam, (caddr_t)&in))
-    {
-        std::string err;
-        err = "CRpcServer::" + std::string(__func__) + ": svc_freeargs() failed to free arguments";
-        mServer->LogError(err.c_str());
-        //exit(1); // TODO
-    }
+    out.data_iov = nullptr;
+    out.data_iovcnt = 0;
+    
+    // A large request doesn't hold its memory for the life of the thread
+    if(recvBuf.capacity > RPC_RECV_BUFFER_KEEP)
+        recvBuf.Release();
 }
 
 void CRpcServer::GetClientInfo(int sock, std::string& clientName, std::string& clientIp)
 {
     // Get the connected client host name and ip addr
-    struct sockaddr addr;
-    socklen_t alen = sizeof(addr);
+    struct sockaddr_storage storage;
+    struct sockaddr& addr = (struct sockaddr&)storage;
+    socklen_t alen = sizeof(storage);
 
-    if(getpeername(sock, &addr, &alen) == 0)
+    if(getpeername(sock, &addr, &alen) != 0)
+    {
+        clientName = "Unknown Host";
+        clientIp = "Unknown IP";
+    }
+    else if(addr.sa_family == AF_UNIX)
+    {
+        // Unix domain socket clients are always on this host
+        clientName = "localhost";
+        clientIp = "Unix socket";
+    }
+    else
     {
         char hostName[NI_MAXHOST]{};
         if(getnameinfo(&addr, alen, hostName, sizeof(hostName), nullptr, 0, NI_NAMEREQD) == 0)
@@ -782,11 +2489,4 @@ void CRpcServer::GetClientInfo(int sock, std::string& clientName, std::string& c
         const char* ip = inet_ntoa(((struct sockaddr_in*)&addr)->sin_addr);
         clientIp = (ip != nullptr ? ip : "Unknown IP");
     }
-    else
-    {
-        clientName = "Unknown Host";
-        clientIp = "Unknown IP";
-    }
 }
-
-
@@ -20,11 +20,28 @@
 #endif // SOLARIS
 
 #include <rpc/rpc.h>
+#include <sys/uio.h>    // iovec
+#include <sys/socket.h> // sockaddr_storage
+#include <stdint.h>
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
 #include <string>
+#include <vector>
+
+// Maximum number of segments in a scatter-gather payload
+#define RPC_MAX_IOV 64
 
 // Forward declaraiton for google::protobuf::Message
 namespace google { namespace protobuf { class Message; } }
 
+class CRpcTransport;
+class CRpcShmChannel;
+class CRpcEventLoop;
+class CRpcPendingReply;
+struct CRpcFrameHeader;
+class CRpcFrameReader;
+
 //
 // Class CRpc
 //
@@ -36,24 +53,94 @@ public:
         int type = 0;
         u_int data_len = 0;
         u_char* data_val = nullptr;
+
+        // Optional scatter-gather payload. When set, the payload is the
+        // data_iovcnt segments in order and data_val is not used. The
+        // segments are sent as they are, without copying them into one buffer.
+        const struct iovec* data_iov = nullptr;
+        int data_iovcnt = 0;
+    };
+
+    // Wire encoding of the param payload. Each codec is served under its own
+    // RPC program version, so old peers that only know LEGACY keep working.
+    enum class CODEC : char
+    {
+        LEGACY=1,  // xdr_array of xdr_u_char: one 4-byte XDR unit per payload byte
+        BULK       // xdr_bytes: 4-byte length followed by the payload padded to 4 bytes
+    };
+
+    // Client connection transport. The server accepts both on the same port.
+    enum class TRANSPORT : char
+    {
+        SUNRPC=1,  // SunRPC: clnttcp_create/svcfd_create, XDR and record marking
+        NATIVE,    // Native length-prefixed frames (see rpcTransport.h)
+        SHM        // Native frames over shared memory rings, same host only (see rpcShm.h)
     };
 
     CRpc() = default;
     virtual ~CRpc() = default;
 
+    // Host names are resolved with getaddrinfo and the addresses are shared
+    // by all the clients in the process for ttlSeconds (60 by default), so
+    // reconnecting doesn't go to the resolver every time. Failed lookups
+    // are cached for up to 5 seconds. 0 resolves the name on every connect.
+    static void SetResolverCacheTtl(int ttlSeconds);
+
 protected:
+    friend class CRpcTransport;
+
     static bool_t XdrParam(XDR* xdrs, param* pr, unsigned int)
     {
         if(!xdr_int(xdrs, &pr->type))
             return (FALSE);
+        if(xdrs->x_op == XDR_ENCODE && pr->data_iov != nullptr)
+            return XdrEncodeIov(xdrs, pr, CODEC::LEGACY);
         if(!xdr_array(xdrs, (char**)&pr->data_val, (u_int*)&pr->data_len, ~0, sizeof(u_char), (xdrproc_t)xdr_u_char))
             return (FALSE);
         return (TRUE);
     }
 
+    static bool_t XdrParamBytes(XDR* xdrs, param* pr, unsigned int)
+    {
+        if(!xdr_int(xdrs, &pr->type))
+            return (FALSE);
+        if(xdrs->x_op == XDR_ENCODE && pr->data_iov != nullptr)
+            return XdrEncodeIov(xdrs, pr, CODEC::BULK);
+        if(!xdr_bytes(xdrs, (char**)&pr->data_val, (u_int*)&pr->data_len, ~0))
+            return (FALSE);
+        return (TRUE);
+    }
+
+    // Encode the data_iov payload the same way as data_val
+    static bool_t XdrEncodeIov(XDR* xdrs, param* pr, CODEC codec);
+
+    static u_int IovLength(const struct iovec* iov, int iovcnt)
+    {
+        size_t len = 0;
+        for(int i = 0; i < iovcnt; i++)
+            len += iov[i].iov_len;
+        return (u_int)len;
+    }
+
+    static xdrproc_t XdrParamProc(CODEC codec)
+    {
+        return (codec == CODEC::BULK ? (xdrproc_t)CRpc::XdrParamBytes : (xdrproc_t)CRpc::XdrParam);
+    }
+
+    // Resolve the server address for Connect. A host name can resolve to
+    // several addresses (IPv4 and IPv6, for example), to be tried in order.
+    struct address_t
+    {
+        struct sockaddr_storage addr;
+        socklen_t addrLen;
+    };
+    bool MakeAddress(const char* hostName, unsigned short port, std::vector<address_t>& addrs);
+    bool MakeAddress(const char* socketPath, struct sockaddr_storage& addr, socklen_t& addrLen);
+
     // Protocol Buffers support
     int MsgToPtr(const google::protobuf::Message* msg, void** pptr);
     bool PtrToMsg(google::protobuf::Message* msg, const void* ptr, int size);
+    bool PtrToMsg(google::protobuf::Message* msg, const param* pr); // data_val or data_iov (see rpcStream.h)
     void MsgPtrDelete(void* ptr) { if(ptr != nullptr) delete [] (unsigned char*)ptr; }
     void* MsgPtrClone(void* ptr, size_t size);
 
@@ -75,31 +162,128 @@ protected:
     const struct timeval RPC_TIMEOUT_INFINITE = {31536000,0};
 #endif
 
+// Default time to connect to a server, all its addresses included
+const struct timeval RPC_CONNECT_TIMEOUT = {10,0};
+
 //
 // Class CRpcClient
 //
 class CRpcClient : public CRpc
 {
 public:
-    CRpcClient() = default;
-    virtual ~CRpcClient() { Destroy(); }
-    
+    CRpcClient(TRANSPORT transport = TRANSPORT::SUNRPC);
+    virtual ~CRpcClient();
+
+    CRpcClient(const CRpcClient&) = delete;
+    CRpcClient& operator=(const CRpcClient&) = delete;
+
     bool Connect(const char* hostName, unsigned short port);
-    bool IsValid() { return (cl != nullptr); }
-    
+    bool Connect(const char* socketPath); // Unix domain socket
+    bool IsValid();
+
+    // NATIVE and SHM transports: the server said it is stopping. A Call
+    // closes the connection once it is done, so the next one connects
+    // again; a pipelining client should stop sending on this connection,
+    // receive the replies still to come and connect again.
+    bool IsGoingAway();
+
+    // Connect gives up when the server doesn't accept the connection in
+    // time (RPC_CONNECT_TIMEOUT by default). When the host name resolves
+    // to several addresses, they are tried in order within that time.
+    void SetConnectTimeout(const struct timeval timeout) { mConnectTimeout = timeout; }
+
+    // SunRPC transport only: the client starts every connection with
+    // CODEC::BULK and falls back to CODEC::LEGACY on the first call if
+    // the server doesn't support it. Setting the codec explicitly disables
+    // that fallback.
+    void SetCodec(CODEC codec);
+    CODEC GetCodec();
+
+    // Shared memory transport only: the number of times to poll for the
+    // reply before going to sleep. Spinning trades CPU for latency.
+    void SetSpinCount(int spinCount);
+
     clnt_stat Call(int type, const google::protobuf::Message* req, google::protobuf::Message* resp,
                    const struct timeval timeout = RPC_TIMEOUT_INFINITE);
     
     clnt_stat Call(int type, const void* req, size_t reqSize, void*& resp, size_t& respSize,
                    const struct timeval timeout = RPC_TIMEOUT_INFINITE);
 
+    // Scatter-gather requests: the request is the reqCount (up to RPC_MAX_IOV)
+    // segments in order. They go to the transport without being copied into
+    // one buffer first (a serialized message followed by blobs, for example).
+    clnt_stat Call(int type, const struct iovec* req, int reqCount, google::protobuf::Message* resp,
+                   const struct timeval timeout = RPC_TIMEOUT_INFINITE);
+
+    clnt_stat Call(int type, const struct iovec* req, int reqCount, void*& resp, size_t& respSize,
+                   const struct timeval timeout = RPC_TIMEOUT_INFINITE);
+
+    // Pipelining, NATIVE and SHM transports only. Send returns as soon as
+    // the request is sent, so many requests can be in flight on one
+    // connection. Receive returns the next reply in the order the server
+    // sent it, with the id Send returned for its request. The server
+    // replies in the order the requests arrived (unlike CRpcAsyncClient,
+    // which lets it reply in the order the calls finish).
+    // Note: Keep the number of requests in flight bounded and keep
+    // receiving, the server stops reading when the client doesn't read.
+    clnt_stat Send(int type, const google::protobuf::Message* req, uint32_t& reqId,
+                   const struct timeval timeout = RPC_TIMEOUT_INFINITE);
+    clnt_stat Send(int type, const void* req, size_t reqSize, uint32_t& reqId,
+                   const struct timeval timeout = RPC_TIMEOUT_INFINITE);
+
+    clnt_stat Receive(uint32_t& reqId, google::protobuf::Message* resp,
+                      const struct timeval timeout = RPC_TIMEOUT_INFINITE);
+    clnt_stat Receive(uint32_t& reqId, void*& resp, size_t& respSize,
+                      const struct timeval timeout = RPC_TIMEOUT_INFINITE);
+
 private:
-    CLIENT* cl = nullptr;
-    
+    CRpcTransport* mTransport = nullptr;
+    struct timeval mConnectTimeout = RPC_CONNECT_TIMEOUT;
+
     void Destroy();
+    clnt_stat CallMsg(param* in, google::protobuf::Message* resp, const struct timeval& timeout);
+    clnt_stat CallRaw(param* in, void*& resp, size_t& respSize, const struct timeval& timeout);
+    clnt_stat ReplyToMsg(clnt_stat res, param* out, google::protobuf::Message* resp);
+    clnt_stat ReplyToPtr(clnt_stat res, param* out, void*& resp, size_t& respSize);
 };
 
 
+//
+// Class CRpcReply
+//
+// The reply to a call passed to CRpcServer::OnCallAsync. It can be moved
+// to another thread and sent from there, once. A reply that is neither
+// sent nor failed fails when it is destroyed, so the client always gets
+// an answer.
+//
+class CRpcReply
+{
+public:
+    CRpcReply() = default;
+    explicit CRpcReply(CRpcPendingReply* pending) : mPending(pending) {}
+    ~CRpcReply() { Fail(); }
+
+    CRpcReply(CRpcReply&& other) : mPending(other.mPending) { other.mPending = nullptr; }
+    CRpcReply& operator=(CRpcReply&& other);
+    CRpcReply(const CRpcReply&) = delete;
+    CRpcReply& operator=(const CRpcReply&) = delete;
+
+    // The reply to fill in, like out in OnCall (its type is the type of
+    // the call). OnCleanup gets it once the reply doesn't need it anymore.
+    CRpc::param* Out() const;
+
+    // Send Out(), or send the error reply (the client gets RPC_SYSTEMERROR)
+    void Send();
+    void Fail();
+
+    explicit operator bool() const { return (mPending != nullptr); }
+
+private:
+    CRpcPendingReply* mPending = nullptr;
+
+    void Complete(bool ok);
+};
+
 //
 // Class CRpcServer
 //
@@ -107,23 +291,162 @@ class CRpcServer : public CRpc
 {
 public:
     CRpcServer();
-    virtual ~CRpcServer() = default;
+    virtual ~CRpcServer();
     
     // The maxPendingConnections defines the maximum length to which 
     // the queue of pending connections for the listening sockfd may grow.  
     // If a connection request arrives when the queue is full, the client 
     // may receive "connection refused" error.
+    // With timeoutSeconds > 0 the server also wakes up that often when
+    // there is nothing to do, to call OnNotify. With 0 it only wakes up
+    // for connections, calls and Stop.
     bool Run(unsigned short port, time_t timeoutSeconds, int maxPendingConnections=100);
+
+    // Listen on a Unix domain socket, or on both the TCP port and the Unix
+    // domain socket at the same time. The socket file is replaced if it
+    // exists, and removed when the server stops.
+    bool Run(const char* socketPath, time_t timeoutSeconds, int maxPendingConnections=100);
+    bool Run(unsigned short port, const char* socketPath, time_t timeoutSeconds, int maxPendingConnections=100);
+
+    // Can be called from any thread or a signal handler (it only sets
+    // flags and writes to a descriptor). Run and the connections waiting
+    // for calls wake up right away; a connection stops once the call in
+    // progress, if any, is done. In a forked process Stop only stops the
+    // server of that process.
     void Stop();
+
+    // Graceful stop (set before Run): Stop closes the listening sockets and
+    // tells the native and shared memory clients to go elsewhere
+    // (RPC_FRAME_FLAG_GOAWAY). The calls already on their way are still
+    // served for up to timeoutSeconds, every connection is closed once it
+    // has nothing left to do, and Run returns when the last one is closed.
+    // A second Stop stops right away. SunRPC connections are closed when
+    // idle, without being told. 0 (default) stops right away.
+    void SetDrainTimeout(time_t timeoutSeconds) { mDrainSeconds = timeoutSeconds; }
+
+    // Number of times a shared memory connection polls for the next call
+    // before going to sleep. 0 (default) sleeps right away.
+    void SetShmSpinCount(int spinCount) { mShmSpinCount = spinCount; }
+
+    // Event loop mode (Linux only, set before Run): numIoThreads threads
+    // serve all the native connections with epoll on non-blocking sockets,
+    // and OnCall runs on the thread that read the call, so it shouldn't
+    // block for long. SunRPC and shared memory connections still get a
+    // thread each. 0 (default) handles every connection in Run, or in the
+    // thread OnConnection passes it to.
+    void SetEventLoop(int numIoThreads) { mIoThreads = numIoThreads; }
+
+    // Event loop mode only: every I/O thread listens on the TCP port with a
+    // socket of its own (SO_REUSEPORT) and accepts its connections itself,
+    // so the kernel spreads them over the threads without a shared accept.
+    // The Unix domain socket is still accepted by Run. OnConnection is
+    // called on the I/O threads then.
+    void SetReusePort(bool reusePort) { mReusePort = reusePort; }
+
+    // Event loop mode only: numThreads handler threads run OnCall and the
+    // I/O threads only read the calls and send the replies. A slow call
+    // holds up neither its I/O thread nor the calls after it on the same
+    // connection (their replies still follow its reply). Up to maxQueued
+    // calls wait for a handler thread, connections are not read while the
+    // queue is full. 0 (default) runs OnCall on the I/O threads.
+    void SetHandlerThreads(int numThreads, int maxQueued = 1024) { mHandlerThreads = numThreads; mMaxQueued = maxQueued; }
+
+    // Pre-fork mode (set before Run): Run creates the listening sockets and
+    // forks numProcesses worker processes that all accept on them, each one
+    // serving its connections the way Run would (with its own event loop if
+    // one is set). The parent only supervises: a worker that exits, or calls
+    // Stop, is started again. Stop in the parent stops the workers (their
+    // calls in progress finish first, those still running 10 seconds after
+    // the drain timeout are killed) and waits for them. Run returns in the
+    // workers as well, once they stop. 0 (default) serves in Run.
+    void SetWorkerProcesses(int numProcesses) { mWorkerProcesses = numProcesses; }
+
+    // Request path counters. Requests are decoded into receive buffers that
+    // are reused from call to call, so once they have grown to the largest
+    // request recvBufferAllocs stops changing.
+    struct Stats
+    {
+        uint64_t calls = 0;             // Calls passed to OnCall
+        uint64_t recvBufferAllocs = 0;  // Times a receive buffer had to grow
+        uint64_t recvBufferBytes = 0;   // Bytes allocated by those
+
+        // Handler threads (see SetHandlerThreads)
+        uint64_t queuedCalls = 0;       // Calls passed to the handler threads
+        uint64_t queueWaitUs = 0;       // Time they waited for a handler thread, all together
+        uint64_t queueFull = 0;         // Calls that found the queue full (their connection waited)
+        int queueDepth = 0;             // Calls waiting now
+        int queueMaxDepth = 0;          // Most calls waiting at once
+
+        // Stopping (see SetDrainTimeout)
+        uint64_t goAways = 0;           // Connections told to go elsewhere
+        uint64_t droppedCalls = 0;      // Calls received but not run, the server stopped
+        uint64_t drainUs = 0;           // Time from Stop until the last connection closed
+    };
+    Stats GetStats() const;
     
 private:
-    bool mContinueRunning = true;
-    time_t mTimeoutSeconds = 1; // One second default pselect timeout
-    static CRpcServer* mServer;
+    std::atomic<bool> mContinueRunning{true};
+    std::atomic<bool> mStopping{false};
+    std::atomic<bool> mDraining{false};  // Stopping, the calls on their way are still served
+    std::atomic<int64_t> mStopTime{0};   // steady_clock, in nanoseconds
+    time_t mDrainSeconds = 0;
+    time_t mTimeoutSeconds = 1; // One second default pselect timeout, 0 for none
+    pid_t mPid = 0;             // Process that created the server
+    int mStopFd[2] = { -1, -1 };// Readable once stopped (eventfd, or a pipe)
+    pid_t mStopFdPid = 0;       // Process mStopFd belongs to
+    int mParentStopFd = -1;     // Worker process: the parent stops it
+    std::mutex mShmMutex;
+    std::vector<CRpcShmChannel*> mShmChannels; // Woken up by Stop
+    int mShmSpinCount = 0;
+    int mIoThreads = 0;
+    bool mReusePort = false;
+    int mWorkerProcesses = 0;
+    int mHandlerThreads = 0;
+    int mMaxQueued = 1024;
+    CRpcEventLoop* mEventLoop = nullptr;
+    std::atomic<uint64_t> mCalls{0};
+    std::atomic<uint64_t> mRecvBufferAllocs{0};
+    std::atomic<uint64_t> mRecvBufferBytes{0};
+    std::atomic<uint64_t> mQueuedCalls{0};
+    std::atomic<uint64_t> mQueueWaitUs{0};
+    std::atomic<uint64_t> mQueueFull{0};
+    std::atomic<int> mQueueDepth{0};
+    std::atomic<int> mQueueMaxDepth{0};
+    std::atomic<uint64_t> mGoAways{0};
+    std::atomic<uint64_t> mDroppedCalls{0};
+    std::atomic<uint64_t> mDrainUs{0};
+
+    // Connections being served, Run waits for them when draining
+    std::mutex mConnMutex;
+    std::condition_variable mConnCond;
+    int mConnections = 0;
+    friend class CRpcEventLoop;
     static void RpcDispatch(struct svc_req* rqstp, SVCXPRT* transp);
     
-    int CreateSocket(unsigned short port);
+    int CreateSocket(unsigned short port, bool reusePort = false);
+    int CreateSocket(const char* socketPath);
+    bool Listen(int sock, int maxPendingConnections);
+    void StartEventLoop();
+    void StopEventLoop();
+    void Serve(const int* socks, int sockCount);
+    int StopFd();
+    void InterruptShmConnections(bool writers = true);
+    bool Serving();
+    void LogStopping();
+    void CountConnection(int delta);
+    void DrainConnections();
+    void DropCalls(CRpcFrameReader& reader);
+    bool RunWorkers(unsigned short port, const char* socketPath, int maxPendingConnections);
     int AcceptConnection(int sock);
+    int SetupConnection(int fd, int family);
+    int WaitForCall(int sock); // 1 readable, 0 stopping or timed out, -1 poll failed, -2 the socket is closed
+    void HandleSunRpcConnection(int sock);
+    void HandleNativeConnection(int sock);
+    void HandleShmConnection(int sock, CRpcShmChannel& channel);
+    void CountRecvBuffer(size_t oldCapacity, size_t newCapacity);
+    bool DispatchFrame(const CRpcFrameHeader& hdr, u_char* data, CRpcFrameHeader& reply, CRpc::param* out);
+    void ReplyHeader(const CRpcFrameHeader& hdr, bool ok, CRpc::param* out, CRpcFrameHeader& reply);
+    bool CallAndWait(const CRpc::param* in, CRpc::param* out);
     
 protected:
     void HandleConnection(int fd);
@@ -132,17 +455,36 @@ protected:
     // Notification sent to derived class
     enum class NOTIFY_TYPE : char
     {
-        WAITING_FOR_CONNECTION=1,  // Sent when timed out waiting for client to connect
-        WAITING_FOR_CALL           // Sent when timed out waiting for client to make a call
+        WAITING_FOR_CONNECTION=1,  // Sent before waiting for a client to connect (again)
+        WAITING_FOR_CALL           // Sent before waiting for a client to make a call (again)
     };
 
     // Note: The derived class might reset sock to 0 to do its own processing.
     // For example, to process the connection in a different thread.
     virtual bool OnConnection(int& sock) { return true; }
 
+    // Called before the server goes to wait: when it starts, after
+    // whatever woke it up and every timeoutSeconds (see Run) it waited for
+    // nothing. Never periodically with a timeout of 0.
     virtual void OnNotify(NOTIFY_TYPE /*type*/) { /**/ }
+
+    // OnCall can reply with either out->data_val or out->data_iov (the
+    // segments must stay valid until OnCleanup). in->data_val can be parsed
+    // with PtrToMsg or read through CRpcInputStream (see rpcStream.h).
+    // in->data_val points into the connection receive buffer: it is only
+    // valid until OnCall returns and must not be modified or freed.
     virtual bool OnCall(const CRpc::param* in, CRpc::param* out) = 0;
     virtual void OnCleanup(CRpc::param* out) = 0;
+
+    // Deferred replies: every call goes to OnCallAsync, which may return
+    // before the reply is sent and complete it later from any thread, so
+    // a call waiting on something else doesn't hold a thread. in is only
+    // valid until OnCallAsync returns. In event loop mode the connection
+    // keeps being served meanwhile (the replies after it wait for it,
+    // unless the client takes them in any order), and Stop waits for the
+    // replies still to come. Elsewhere the connection's thread waits for
+    // the reply. The default calls OnCall and sends its reply.
+    virtual void OnCallAsync(const CRpc::param* in, CRpcReply reply);
 };
 
 
@@ -0,0 +1,583 @@
+//
+//  rpcAsync.cpp
+//
+#include <stdio.h>
+#include <memory.h>
+#include <unistd.h>     // close(), pipe()
+#include <errno.h>
+#include <fcntl.h>      // fcntl()
+#include <poll.h>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+#if defined(__linux__)
+  #include <sys/eventfd.h>
+#endif
+#include <google/protobuf/message.h>
+#include "rpcAsync.h"
+#include "rpcInternal.h"
+#include "rpcTransport.h"
+
+//
+// Class CRpcAsyncClient::CConnection
+//
+// One native connection and its I/O thread. Callers append their frames to
+// the send buffer and send as much as the socket takes right away. The I/O
+// thread sends the rest, reads the replies and calls the callbacks.
+//
+class CRpcAsyncClient::CConnection
+{
+public:
+    CConnection(CRpcAsyncClient* owner) : mOwner(owner), mTransport(owner) {}
+    ~CConnection() { Close(); }
+
+    bool Connect(const struct sockaddr* addr, socklen_t addrLen, CRpcFrame::deadline_t deadline);
+    void Close();
+    bool IsValid();
+
+    // Returns RPC_CANTSEND if the connection is gone, the callback is not called then
+    clnt_stat Send(const CRpc::param* in, callback_t& callback, CRpcFrame::deadline_t deadline);
+
+private:
+    struct CPending
+    {
+        callback_t callback;
+        CRpcFrame::deadline_t deadline;
+    };
+
+    CRpcAsyncClient* mOwner = nullptr;
+    CRpcNativeTransport mTransport; // Connects and owns the socket
+    int mSock = -1;
+    int mWakeFd[2] = { -1, -1 };    // Wakes up the I/O thread
+    std::thread mThread;
+    std::atomic<bool> mStop{false};
+
+    // Protected by mMutex
+    std::mutex mMutex;
+    bool mConnected = false;
+    bool mGoAway = false;           // The server is stopping, no new calls
+    bool mWakeRequested = false;
+    uint32_t mNextReqId = 1;
+    std::vector<u_char> mSendBuf;
+    size_t mSendOffset = 0;         // Bytes of mSendBuf already sent
+    std::unordered_map<uint32_t, CPending> mPending;
+
+    void Run();
+    void Wake();
+    bool FlushLocked();
+    void Complete(const CRpcFrameHeader& hdr, u_char* payload);
+    void ExpireCalls();
+    void FailAll(clnt_stat res);
+
+    void LogInfo(const char* msg) { mOwner->LogInfo(msg); }
+    void LogError(const char* err) { mOwner->LogError(err); }
+};
+
+bool CRpcAsyncClient::CConnection::Connect(const struct sockaddr* addr, socklen_t addrLen, CRpcFrame::deadline_t deadline)
+{
+    if(!mTransport.Connect(addr, addrLen, deadline))
+        return false;
+
+    mSock = mTransport.GetSocket();
+
+    // The I/O thread must never block on the socket
+    int flags = fcntl(mSock, F_GETFL, 0);
+    if(flags < 0 || fcntl(mSock, F_SETFL, flags | O_NONBLOCK) < 0)
+    {
+        ERRMSG("CRpcAsyncClient", "fcntl(O_NONBLOCK) failed: " << strerror(errno));
+        mTransport.Close();
+        return false;
+    }
+
+#if defined(__linux__)
+    mWakeFd[0] = mWakeFd[1] = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if(mWakeFd[0] < 0)
+#else
+    if(pipe(mWakeFd) != 0 ||
+       fcntl(mWakeFd[0], F_SETFL, O_NONBLOCK) < 0 || fcntl(mWakeFd[1], F_SETFL, O_NONBLOCK) < 0)
+#endif
+    {
+        ERRMSG("CRpcAsyncClient", "Failed to create the wake up descriptor: " << strerror(errno));
+        mTransport.Close();
+        return false;
+    }
+
+    mConnected = true;
+    mStop = false;
+    mThread = std::thread(&CConnection::Run, this);
+    return true;
+}
+
+void CRpcAsyncClient::CConnection::Close()
+{
+    if(mThread.joinable())
+    {
+        mStop = true;
+        Wake();
+        mThread.join();
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+        mConnected = false;
+        mSendBuf.clear();
+        mSendOffset = 0;
+    }
+
+    // Calls still in flight won't get their replies
+    FailAll(RPC_CANTRECV);
+
+    if(mWakeFd[0] >= 0)
+        close(mWakeFd[0]);
+    if(mWakeFd[1] >= 0 && mWakeFd[1] != mWakeFd[0])
+        close(mWakeFd[1]);
+    mWakeFd[0] = mWakeFd[1] = -1;
+
+    mTransport.Close();
+    mSock = -1;
+}
+
+bool CRpcAsyncClient::CConnection::IsValid()
+{
+    std::lock_guard<std::mutex> lock(mMutex);
+    return mConnected;
+}
+
+void CRpcAsyncClient::CConnection::Wake()
+{
+#if defined(__linux__)
+    uint64_t val = 1;
+    ssize_t res = write(mWakeFd[1], &val, sizeof(val));
+#else
+    char val = 1;
+    ssize_t res = write(mWakeFd[1], &val, sizeof(val));
+#endif
+    (void)res; // Already awake if it is full
+}
+
+clnt_stat CRpcAsyncClient::CConnection::Send(const CRpc::param* in, callback_t& callback, CRpcFrame::deadline_t deadline)
+{
+    std::lock_guard<std::mutex> lock(mMutex);
+    if(!mConnected)
+        return RPC_CANTSEND;
+
+    CRpcFrameHeader hdr;
+    hdr.type = (uint32_t)in->type;
+    hdr.reqId = mNextReqId++;
+    hdr.flags = (mOwner->mOrderedReplies ? 0 : RPC_FRAME_FLAG_ANY_ORDER);
+    hdr.length = in->data_len;
+
+    // Append the frame, the payload is copied so the caller can reuse it right away
+    bool wasEmpty = (mSendOffset == mSendBuf.size());
+    size_t offset = mSendBuf.size();
+    mSendBuf.resize(offset + CRpcFrame::HEADER_SIZE + hdr.length);
+    CRpcFrame::EncodeHeader(hdr, mSendBuf.data() + offset);
+    if(hdr.length > 0)
+        memcpy(mSendBuf.data() + offset + CRpcFrame::HEADER_SIZE, in->data_val, hdr.length);
+
+    CPending& pending = mPending[hdr.reqId];
+    pending.callback = std::move(callback);
+    pending.deadline = deadline;
+
+    // Send right away if nothing is queued ahead of us, otherwise the I/O
+    // thread is already waiting for the socket to take more.
+    if(wasEmpty && FlushLocked() && mSendOffset == mSendBuf.size())
+        return RPC_SUCCESS;
+
+    if(!mWakeRequested)
+    {
+        mWakeRequested = true;
+        Wake();
+    }
+
+    return RPC_SUCCESS;
+}
+
+bool CRpcAsyncClient::CConnection::FlushLocked()
+{
+    while(mSendOffset < mSendBuf.size())
+    {
+        ssize_t res = send(mSock, mSendBuf.data() + mSendOffset, mSendBuf.size() - mSendOffset, RPC_SEND_FLAGS);
+        if(res < 0)
+        {
+            if(errno == EINTR)
+                continue;
+            return (errno == EAGAIN || errno == EWOULDBLOCK);
+        }
+        mSendOffset += (size_t)res;
+    }
+
+    mSendBuf.clear(); // Keeps the capacity
+    mSendOffset = 0;
+    return true;
+}
+
+void CRpcAsyncClient::CConnection::Run()
+{
+    CRpcFrameReader reader;
+    CRpcFrameHeader hdr;
+    u_char* payload = nullptr;
+    auto lastExpireCheck = std::chrono::steady_clock::now();
+
+    while(!mStop)
+    {
+        bool hasOutput = false;
+        int timeoutMs = -1;
+        {
+            std::lock_guard<std::mutex> lock(mMutex);
+            hasOutput = (mSendOffset < mSendBuf.size());
+            mWakeRequested = false;
+            if(!mPending.empty())
+                timeoutMs = 100; // Check the call deadlines now and then
+        }
+
+        struct pollfd fds[2];
+        fds[0].fd = mSock;
+        fds[0].events = POLLIN | (hasOutput ? POLLOUT : 0);
+        fds[0].revents = 0;
+        fds[1].fd = mWakeFd[0];
+        fds[1].events = POLLIN;
+        fds[1].revents = 0;
+
+        int res = poll(fds, 2, timeoutMs);
+        if(res < 0 && errno != EINTR)
+        {
+            ERRMSG("CRpcAsyncClient", "poll() failed: " << strerror(errno));
+            break;
+        }
+
+        if(fds[1].revents & POLLIN)
+        {
+            char buf[64];
+            while(read(mWakeFd[0], buf, sizeof(buf)) > 0) {}
+        }
+
+        if(fds[0].revents & POLLOUT)
+        {
+            std::lock_guard<std::mutex> lock(mMutex);
+            if(!FlushLocked())
+            {
+                INFOMSG("CRpcAsyncClient", "Failed to send: " << strerror(errno));
+                break;
+            }
+        }
+
+        if(fds[0].revents & (POLLIN | POLLHUP | POLLERR))
+        {
+            // Complete every call whose reply has arrived
+            while((res = reader.Next(mSock, hdr, payload, CRpcFrame::NoDeadline())) > 0)
+            {
+                if(!(hdr.flags & RPC_FRAME_FLAG_REPLY))
+                {
+                    res = -2;
+                    break;
+                }
+
+                if(hdr.flags & RPC_FRAME_FLAG_GOAWAY)
+                {
+                    // New calls go to the other connections, the replies
+                    // to the calls made so far still come
+                    INFOMSG("CRpcAsyncClient", "The server is stopping, the connection is closed once the calls are done");
+                    std::lock_guard<std::mutex> lock(mMutex);
+                    mConnected = false;
+                    mGoAway = true;
+                    continue;
+                }
+
+                Complete(hdr, payload);
+            }
+
+            if(res == -2)
+            {
+                ERRMSG("CRpcAsyncClient", "Invalid reply frame received");
+                break;
+            }
+            else if(res < 0)
+            {
+                INFOMSG("CRpcAsyncClient", "Disconnected: " << strerror(errno));
+                break;
+            }
+        }
+
+        auto now = std::chrono::steady_clock::now();
+        if(now - lastExpireCheck >= std::chrono::milliseconds(100))
+        {
+            ExpireCalls();
+            lastExpireCheck = now;
+        }
+
+        {
+            std::lock_guard<std::mutex> lock(mMutex);
+            if(mGoAway && mPending.empty())
+                break;
+        }
+    }
+
+    // The connection is gone, the callers will find out on the next call.
+    // After RPC_FRAME_FLAG_GOAWAY the calls without a reply were not run.
+    bool goAway = false;
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+        mConnected = false;
+        goAway = mGoAway;
+    }
+
+    FailAll(goAway ? RPC_CANTSEND : RPC_CANTRECV);
+}
+
+void CRpcAsyncClient::CConnection::Complete(const CRpcFrameHeader& hdr, u_char* payload)
+{
+    callback_t callback;
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+        auto it = mPending.find(hdr.reqId);
+        if(it == mPending.end())
+            return; // The call has timed out
+        callback = std::move(it->second.callback);
+        mPending.erase(it);
+    }
+
+    if(hdr.flags & RPC_FRAME_FLAG_ERROR)
+    {
+        ERRMSG("CRpcAsyncClient", "Server failed the call, type=" << hdr.type);
+        callback(RPC_SYSTEMERROR, nullptr);
+        return;
+    }
+
+    CRpc::param out;
+    out.type = (int)hdr.type;
+    out.data_len = hdr.length;
+    out.data_val = payload;
+    callback(RPC_SUCCESS, &out);
+}
+
+void CRpcAsyncClient::CConnection::ExpireCalls()
+{
+    std::vector<callback_t> expired;
+    auto now = std::chrono::steady_clock::now();
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+        for(auto it = mPending.begin(); it != mPending.end(); )
+        {
+            if(it->second.deadline <= now)
+            {
+                expired.push_back(std::move(it->second.callback));
+                it = mPending.erase(it);
+            }
+            else
+            {
+                ++it;
+            }
+        }
+    }
+
+    for(callback_t& callback : expired)
+        callback(RPC_TIMEDOUT, nullptr);
+}
+
+void CRpcAsyncClient::CConnection::FailAll(clnt_stat res)
+{
+    std::unordered_map<uint32_t, CPending> pending;
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+        pending.swap(mPending);
+    }
+
+    for(auto& it : pending)
+        it.second.callback(res, nullptr);
+}
+
+
+//
+// Class CRpcAsyncClient
+//
+CRpcAsyncClient::CRpcAsyncClient(int numConnections /*= 1*/)
+    : mNumConnections(numConnections > 0 ? numConnections : 1)
+{
+}
+
+CRpcAsyncClient::~CRpcAsyncClient()
+{
+    Close();
+}
+
+bool CRpcAsyncClient::IsValid()
+{
+    for(CConnection* conn : mConnections)
+    {
+        if(conn->IsValid())
+            return true;
+    }
+    return false;
+}
+
+void CRpcAsyncClient::Close()
+{
+    for(CConnection* conn : mConnections)
+        delete conn;
+    mConnections.clear();
+}
+
+bool CRpcAsyncClient::Connect(const char* hostName, unsigned short port)
+{
+    std::vector<address_t> addrs;
+    if(!MakeAddress(hostName, port, addrs))
+        return false;
+
+    INFOMSG("CRpcAsyncClient", "Connecting to " << hostName << ":" << port << " with " << mNumConnections << " connections");
+
+    // Every address gets an equal share of the time that is left
+    CRpcFrame::deadline_t deadline = CRpcFrame::Deadline(mConnectTimeout);
+    for(size_t i = 0; i < addrs.size(); i++)
+    {
+        auto now = std::chrono::steady_clock::now();
+        if(now >= deadline)
+            break;
+
+        CRpcFrame::deadline_t addrDeadline = now + (deadline - now) / (addrs.size() - i);
+        if(Connect((struct sockaddr*)&addrs[i].addr, addrs[i].addrLen, addrDeadline))
+        {
+            INFOMSG("CRpcAsyncClient", "Succeeded");
+            return true;
+        }
+    }
+
+    ERRMSG("CRpcAsyncClient", "Failed to connect to " << hostName << ":" << port);
+    return false;
+}
+
+bool CRpcAsyncClient::Connect(const char* socketPath)
+{
+    struct sockaddr_storage addr;
+    socklen_t addrLen = 0;
+    if(!MakeAddress(socketPath, addr, addrLen))
+        return false;
+
+    INFOMSG("CRpcAsyncClient", "Connecting to " << socketPath << " with " << mNumConnections << " connections");
+
+    if(!Connect((struct sockaddr*)&addr, addrLen, CRpcFrame::Deadline(mConnectTimeout)))
+    {
+        ERRMSG("CRpcAsyncClient", "Failed to connect to " << socketPath);
+        return false;
+    }
+
+    INFOMSG("CRpcAsyncClient", "Succeeded");
+    return true;
+}
+
+bool CRpcAsyncClient::Connect(const struct sockaddr* addr, socklen_t addrLen, CRpcFrame::deadline_t deadline)
+{
+    if(!mConnections.empty())
+    {
+        ERRMSG("CRpcAsyncClient", "Failed - the client is already connected");
+        return false;
+    }
+
+    for(int i = 0; i < mNumConnections; i++)
+    {
+        CConnection* conn = new CConnection(this);
+        mConnections.push_back(conn);
+
+        if(!conn->Connect(addr, addrLen, deadline))
+        {
+            Close();
+            return false;
+        }
+    }
+
+    return true;
+}
+
+clnt_stat CRpcAsyncClient::CallAsync(int type, const void* req, size_t reqSize, callback_t callback,
+                                     const struct timeval timeout /*= RPC_TIMEOUT_INFINITE*/)
+{
+    if(mConnections.empty())
+    {
+        ERRMSG("CRpcAsyncClient", "Client is not yet connected");
+        return RPC_FAILED;
+    }
+
+    param in;
+    in.type = type;
+    in.data_val = (u_char*)req;
+    in.data_len = (u_int)reqSize;
+
+    CRpcFrame::deadline_t deadline = CRpcFrame::Deadline(timeout);
+
+    // Round-robin over the connections, skip the ones that are gone
+    size_t count = mConnections.size();
+    size_t first = mNextConnection++;
+    for(size_t i = 0; i < count; i++)
+    {
+        if(mConnections[(first + i) % count]->Send(&in, callback, deadline) == RPC_SUCCESS)
+            return RPC_SUCCESS;
+    }
+
+    ERRMSG("CRpcAsyncClient", "All connections are closed");
+    return RPC_CANTSEND;
+}
+
+clnt_stat CRpcAsyncClient::CallAsync(int type, const google::protobuf::Message* req, callback_t callback,
+                                     const struct timeval timeout /*= RPC_TIMEOUT_INFINITE*/)
+{
+    if(req == nullptr)
+        return CallAsync(type, nullptr, 0, std::move(callback), timeout);
+
+    // Serialize into a per-thread buffer, the connection copies it anyway
+    static thread_local std::vector<u_char> buf;
+    int size = req->ByteSize();
+    if(buf.size() < (size_t)size)
+        buf.resize(size);
+
+    if(size > 0 && !req->SerializeToArray(buf.data(), size))
+    {
+        ERRMSG("CRpcAsyncClient", "Failed to write protobuf message: size=" << size);
+        return RPC_FAILED;
+    }
+
+    return CallAsync(type, buf.data(), (size_t)size, std::move(callback), timeout);
+}
+
+std::future<clnt_stat> CRpcAsyncClient::Call(int type, const google::protobuf::Message* req, google::protobuf::Message* resp,
+                                             const struct timeval timeout /*= RPC_TIMEOUT_INFINITE*/)
+{
+    auto promise = std::make_shared<std::promise<clnt_stat>>();
+    std::future<clnt_stat> future = promise->get_future();
+
+    callback_t callback = [this, promise, resp](clnt_stat res, const CRpc::param* out)
+    {
+        if(res != RPC_SUCCESS)
+        {
+            // Already logged
+        }
+        // Is response expected?
+        else if(resp != nullptr)
+        {
+            if(out->data_len == 0 || out->data_val == nullptr)
+            {
+                ERRMSG("CRpcAsyncClient", "No response received");
+                res = RPC_FAILED;
+            }
+            else if(!resp->ParseFromArray(out->data_val, (int)out->data_len))
+            {
+                resp->Clear();
+                ERRMSG("CRpcAsyncClient", "Failed to read protobuf message: size=" << out->data_len);
+                res = RPC_FAILED;
+            }
+        }
+        // We don't expect any response
+        else if(out->data_len != 0)
+        {
+            ERRMSG("CRpcAsyncClient", "Unexpected response received (data_len=" << out->data_len << ")");
+            res = RPC_FAILED;
+        }
+
+        promise->set_value(res);
+    };
+
+    clnt_stat res = CallAsync(type, req, std::move(callback), timeout);
+    if(res != RPC_SUCCESS)
+        promise->set_value(res);
+
+    return future;
+}
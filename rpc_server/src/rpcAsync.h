@@ -0,0 +1,79 @@
+//
+//  rpcAsync.h
+//
+#ifndef __RPC_ASYNC_H__
+#define __RPC_ASYNC_H__
+
+#include <functional>
+#include <future>
+#include <vector>
+#include "rpc.h"
+
+//
+// Class CRpcAsyncClient
+//
+// Thread-safe client: any number of threads can make calls at the same
+// time over a fixed set of native connections to the same server. Calls
+// don't block, the reply is delivered to a completion callback or through
+// a std::future. Every connection has its own I/O thread that receives the
+// replies and sends what the callers couldn't send right away. Calls are
+// spread over the connections round-robin and pipelined on each of them.
+// A connection the server says goodbye on (see CRpcServer::SetDrainTimeout)
+// takes no new calls; its calls get their replies, or RPC_CANTSEND if the
+// server did not run them, and then it closes.
+//
+class CRpcAsyncClient : public CRpc
+{
+public:
+    // Runs on the I/O thread of the connection, so it must not block.
+    // On RPC_SUCCESS resp->data_val is only valid during the callback.
+    typedef std::function<void(clnt_stat res, const CRpc::param* resp)> callback_t;
+
+    CRpcAsyncClient(int numConnections = 1);
+    virtual ~CRpcAsyncClient();
+
+    CRpcAsyncClient(const CRpcAsyncClient&) = delete;
+    CRpcAsyncClient& operator=(const CRpcAsyncClient&) = delete;
+
+    bool Connect(const char* hostName, unsigned short port);
+    bool Connect(const char* socketPath); // Unix domain socket
+    bool IsValid();
+
+    // Time to open all the connections (RPC_CONNECT_TIMEOUT by default)
+    void SetConnectTimeout(const struct timeval timeout) { mConnectTimeout = timeout; }
+
+    // The replies are matched to the calls by request id, so by default the
+    // server may send each one as soon as its call is done (a server with
+    // handler threads does). With ordered replies a call's reply waits for
+    // the replies to the calls made before it on the same connection.
+    void SetOrderedReplies(bool ordered) { mOrderedReplies = ordered; }
+
+    // Stop the I/O threads and close the connections. Calls still waiting
+    // for replies complete with RPC_CANTRECV.
+    void Close();
+
+    // Returns RPC_SUCCESS if the request was queued, then the callback is
+    // called exactly once. Otherwise the callback is not called.
+    clnt_stat CallAsync(int type, const void* req, size_t reqSize, callback_t callback,
+                        const struct timeval timeout = RPC_TIMEOUT_INFINITE);
+    clnt_stat CallAsync(int type, const google::protobuf::Message* req, callback_t callback,
+                        const struct timeval timeout = RPC_TIMEOUT_INFINITE);
+
+    // resp is filled in before the future becomes ready and must stay
+    // valid until then. resp can be nullptr if no response is expected.
+    std::future<clnt_stat> Call(int type, const google::protobuf::Message* req, google::protobuf::Message* resp,
+                                const struct timeval timeout = RPC_TIMEOUT_INFINITE);
+
+private:
+    class CConnection;
+
+    int mNumConnections = 1;
+    std::vector<CConnection*> mConnections;
+    std::atomic<unsigned> mNextConnection{0};
+    struct timeval mConnectTimeout = RPC_CONNECT_TIMEOUT;
+    bool mOrderedReplies = false;
+
+    bool Connect(const struct sockaddr* addr, socklen_t addrLen, std::chrono::steady_clock::time_point deadline);
+};
+
+#endif // __RPC_ASYNC_H__
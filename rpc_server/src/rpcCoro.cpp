@@ -0,0 +1,171 @@
+//
+//  rpcCoro.cpp
+//
+#include <algorithm>
+#include "rpcCoro.h"
+
+#if defined(RPC_COROUTINES)
+
+//
+// Class CRpcExecutor
+//
+bool CRpcExecutor::Start(int numThreads)
+{
+    if(!mThreads.empty())
+        return false; // Started already
+
+    mStop = false;
+    for(int i = 0; i < std::max(numThreads, 1); i++)
+        mThreads.push_back(std::thread(&CRpcExecutor::Run, this));
+    return true;
+}
+
+void CRpcExecutor::Stop()
+{
+    {
+        std::unique_lock<std::mutex> lock(mMutex);
+        mStop = true;
+    }
+    mCond.notify_all();
+
+    for(std::thread& thread : mThreads)
+        thread.join();
+    mThreads.clear();
+
+    // Suspended for good, their frames are left to their owners
+    std::unique_lock<std::mutex> lock(mMutex);
+    mReady.clear();
+    mTimers.clear();
+}
+
+void CRpcExecutor::Resume(std::coroutine_handle<> h)
+{
+    {
+        std::unique_lock<std::mutex> lock(mMutex);
+        mReady.push_back(h);
+    }
+    mCond.notify_one();
+}
+
+void CRpcExecutor::ResumeAt(Clock::time_point when, std::coroutine_handle<> h)
+{
+    bool first = false;
+    {
+        std::unique_lock<std::mutex> lock(mMutex);
+        first = (mTimers.empty() || when < mTimers.begin()->first);
+        mTimers.emplace(when, h);
+    }
+
+    // Only a new earliest timer changes how long the threads wait
+    if(first)
+        mCond.notify_one();
+}
+
+void CRpcExecutor::Run()
+{
+    std::unique_lock<std::mutex> lock(mMutex);
+
+    while(true)
+    {
+        // Timers that are due go after the coroutines already waiting
+        Clock::time_point now = Clock::now();
+        while(!mTimers.empty() && mTimers.begin()->first <= now)
+        {
+            mReady.push_back(mTimers.begin()->second);
+            mTimers.erase(mTimers.begin());
+        }
+
+        if(!mReady.empty())
+        {
+            std::coroutine_handle<> h = mReady.front();
+            mReady.pop_front();
+            bool more = !mReady.empty();
+            lock.unlock();
+
+            if(more)
+                mCond.notify_one();
+            h.resume();
+
+            lock.lock();
+            continue;
+        }
+
+        if(mStop)
+            break;
+
+        if(mTimers.empty())
+            mCond.wait(lock);
+        else
+            mCond.wait_until(lock, mTimers.begin()->first);
+    }
+}
+
+//
+// Class CRpcAsyncCall
+//
+bool CRpcAsyncCall::await_suspend(std::coroutine_handle<> h)
+{
+    // The reply can come on the client I/O thread before CallAsync returns,
+    // and the coroutine go on (and this object be gone) right then
+    clnt_stat res = mClient->CallAsync(mType, mReq, mReqSize,
+        [this, h](clnt_stat res, const CRpc::param* resp)
+        {
+            mRes = res;
+            if(res == RPC_SUCCESS)
+            {
+                mReplyType = resp->type;
+                mReply.assign(resp->data_val, resp->data_val + resp->data_len);
+            }
+
+            if(mExecutor != nullptr)
+                mExecutor->Resume(h);
+            else
+                h.resume();
+        });
+
+    if(res != RPC_SUCCESS)
+    {
+        mRes = res; // No callback, go on right away
+        return false;
+    }
+
+    return true;
+}
+
+//
+// Class CRpcCoServer
+//
+// Runs a call to the end on its own, the reply goes with it
+struct CRpcCoServer::CDetached
+{
+    struct promise_type
+    {
+        CDetached get_return_object() { return CDetached(); }
+        std::suspend_never initial_suspend() noexcept { return {}; }
+        std::suspend_never final_suspend() noexcept { return {}; }
+        void return_void() {}
+        void unhandled_exception() { std::terminate(); }
+    };
+};
+
+void CRpcCoServer::OnCallAsync(const CRpc::param* in, CRpcReply reply)
+{
+    // The coroutine can outlive in, it gets a copy of the request
+    const u_char* data = in->data_val;
+    RunCall(in->type, std::vector<u_char>(data, data + (data != nullptr ? in->data_len : 0)), std::move(reply));
+}
+
+CRpcCoServer::CDetached CRpcCoServer::RunCall(int type, std::vector<u_char> request, CRpcReply reply)
+{
+    CRpc::param in;
+    in.type = type;
+    in.data_len = (u_int)request.size();
+    in.data_val = (request.empty() ? nullptr : request.data());
+
+    if(co_await OnCallCo(&in, reply.Out()))
+        reply.Send();
+    else
+        reply.Fail();
+}
+
+#endif // RPC_COROUTINES
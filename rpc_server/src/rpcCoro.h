@@ -0,0 +1,282 @@
+//
+//  rpcCoro.h
+//
+#ifndef __RPC_CORO_H__
+#define __RPC_CORO_H__
+
+//
+// Coroutine handlers, for C++20 builds only (make CORO=1). Everything else
+// stays C++11, and with an older standard this header declares nothing.
+//
+#if __cplusplus >= 202002L && defined(__cpp_impl_coroutine)
+
+#define RPC_COROUTINES 1
+
+#include <coroutine>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <map>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include "rpcAsync.h"
+
+class CRpcExecutor;
+
+//
+// Class CRpcTask
+//
+// A coroutine that returns T. It starts when it is awaited and resumes its
+// awaiter when it is done. No exceptions: an exception that leaves the
+// coroutine terminates the program.
+//
+template<typename T>
+class CRpcTask
+{
+public:
+    struct promise_type;
+    typedef std::coroutine_handle<promise_type> handle_t;
+
+    // Resumes whoever awaits the task once it is done
+    struct CFinal
+    {
+        bool await_ready() noexcept { return false; }
+        std::coroutine_handle<> await_suspend(handle_t h) noexcept
+        {
+            std::coroutine_handle<> next = h.promise().mAwaiter;
+            return (next ? next : std::noop_coroutine());
+        }
+        void await_resume() noexcept {}
+    };
+
+    struct promise_type
+    {
+        T mValue{};
+        std::coroutine_handle<> mAwaiter;
+
+        CRpcTask get_return_object() { return CRpcTask(handle_t::from_promise(*this)); }
+        std::suspend_always initial_suspend() noexcept { return {}; }
+        CFinal final_suspend() noexcept { return {}; }
+        void return_value(T value) { mValue = std::move(value); }
+        void unhandled_exception() { std::terminate(); }
+    };
+
+    CRpcTask(CRpcTask&& other) : mHandle(other.mHandle) { other.mHandle = nullptr; }
+    CRpcTask(const CRpcTask&) = delete;
+    CRpcTask& operator=(const CRpcTask&) = delete;
+    ~CRpcTask() { if(mHandle) mHandle.destroy(); }
+
+    bool await_ready() const noexcept { return false; }
+    std::coroutine_handle<> await_suspend(std::coroutine_handle<> awaiter)
+    {
+        mHandle.promise().mAwaiter = awaiter;
+        return mHandle; // Start it, on this thread
+    }
+    T await_resume() { return std::move(mHandle.promise().mValue); }
+
+private:
+    handle_t mHandle;
+
+    explicit CRpcTask(handle_t handle) : mHandle(handle) {}
+};
+
+template<>
+struct CRpcTask<void>::promise_type
+{
+    std::coroutine_handle<> mAwaiter;
+
+    CRpcTask get_return_object() { return CRpcTask(handle_t::from_promise(*this)); }
+    std::suspend_always initial_suspend() noexcept { return {}; }
+    CFinal final_suspend() noexcept { return {}; }
+    void return_void() {}
+    void unhandled_exception() { std::terminate(); }
+};
+
+template<>
+inline void CRpcTask<void>::await_resume() {}
+
+//
+// Class CRpcExecutor
+//
+// A few threads that coroutines move to, to run work that must not hold
+// the thread they are on (a server I/O thread or the I/O thread of a
+// CRpcAsyncClient connection), and to wait for timers. Nothing waits on a
+// thread of its own: however many coroutines are suspended, the number of
+// threads stays the same.
+//
+class CRpcExecutor
+{
+public:
+    typedef std::chrono::steady_clock Clock;
+
+    CRpcExecutor() = default;
+    ~CRpcExecutor() { Stop(); }
+
+    CRpcExecutor(const CRpcExecutor&) = delete;
+    CRpcExecutor& operator=(const CRpcExecutor&) = delete;
+
+    bool Start(int numThreads);
+
+    // The coroutines that are due run first, the others are never resumed
+    // and must not be waited for anymore
+    void Stop();
+
+    // Resume h on one of the threads, at the given time or right away
+    void Resume(std::coroutine_handle<> h);
+    void ResumeAt(Clock::time_point when, std::coroutine_handle<> h);
+
+    // co_await executor.Schedule(): go on on one of the threads
+    struct CSchedule
+    {
+        CRpcExecutor* mExecutor;
+        bool await_ready() const noexcept { return false; }
+        void await_suspend(std::coroutine_handle<> h) { mExecutor->Resume(h); }
+        void await_resume() const noexcept {}
+    };
+    CSchedule Schedule() { return CSchedule{this}; }
+
+    // co_await executor.Sleep(ms): go on on one of the threads once the
+    // time is up, without holding any thread meanwhile
+    struct CSleep
+    {
+        CRpcExecutor* mExecutor;
+        Clock::time_point mWhen;
+        bool await_ready() const noexcept { return false; }
+        void await_suspend(std::coroutine_handle<> h) { mExecutor->ResumeAt(mWhen, h); }
+        void await_resume() const noexcept {}
+    };
+    CSleep Sleep(std::chrono::milliseconds duration) { return CSleep{this, Clock::now() + duration}; }
+
+private:
+    std::vector<std::thread> mThreads;
+    std::mutex mMutex;
+    std::condition_variable mCond;
+    std::deque<std::coroutine_handle<>> mReady;
+    std::multimap<Clock::time_point, std::coroutine_handle<>> mTimers;
+    bool mStop = false;
+
+    void Run();
+};
+
+//
+// Class CRpcLatch
+//
+// Wait for count things to be done, each one calls CountDown once, from
+// any thread (a CRpcAsyncClient callback for instance). The coroutine goes
+// on on the executor, or on the thread of the last CountDown without one.
+//
+//     CRpcLatch latch(n);
+//     for(...) client.CallAsync(..., [&](clnt_stat res, const CRpc::param* resp) { ...; latch.CountDown(); });
+//     co_await latch.Wait(&executor);
+//
+class CRpcLatch
+{
+public:
+    explicit CRpcLatch(int count) : mCount(count + 1) {} // Plus the waiter
+
+    CRpcLatch(const CRpcLatch&) = delete;
+    CRpcLatch& operator=(const CRpcLatch&) = delete;
+
+    void CountDown()
+    {
+        if(--mCount == 0)
+            Done();
+    }
+
+    struct CWait
+    {
+        CRpcLatch* mLatch;
+        bool await_ready() const noexcept { return (mLatch->mCount == 1); }
+        bool await_suspend(std::coroutine_handle<> h)
+        {
+            mLatch->mAwaiter = h;
+            return (--mLatch->mCount > 0); // Done already, go on here
+        }
+        void await_resume() const noexcept {}
+    };
+
+    // Once, by one coroutine
+    CWait Wait(CRpcExecutor* executor = nullptr)
+    {
+        mExecutor = executor;
+        return CWait{this};
+    }
+
+private:
+    std::atomic<int> mCount;
+    std::coroutine_handle<> mAwaiter;
+    CRpcExecutor* mExecutor = nullptr;
+
+    void Done()
+    {
+        if(mExecutor != nullptr)
+            mExecutor->Resume(mAwaiter);
+        else
+            mAwaiter.resume();
+    }
+};
+
+//
+// Class CRpcAsyncCall
+//
+// co_await a call of a CRpcAsyncClient. Returns the status, the reply is
+// copied to Reply() on RPC_SUCCESS. Without an executor the coroutine goes
+// on on the I/O thread of the client connection, so it must not block there.
+//
+class CRpcAsyncCall
+{
+public:
+    CRpcAsyncCall(CRpcAsyncClient* client, int type, const void* req, size_t reqSize, CRpcExecutor* executor = nullptr)
+        : mClient(client), mType(type), mReq(req), mReqSize(reqSize), mExecutor(executor) {}
+
+    const std::vector<u_char>& Reply() const { return mReply; }
+    int ReplyType() const { return mReplyType; }
+
+    bool await_ready() const noexcept { return false; }
+    bool await_suspend(std::coroutine_handle<> h);
+    clnt_stat await_resume() const noexcept { return mRes; }
+
+private:
+    CRpcAsyncClient* mClient = nullptr;
+    int mType = 0;
+    const void* mReq = nullptr;
+    size_t mReqSize = 0;
+    CRpcExecutor* mExecutor = nullptr;
+
+    clnt_stat mRes = RPC_SUCCESS;
+    int mReplyType = 0;
+    std::vector<u_char> mReply;
+};
+
+//
+// Class CRpcCoServer
+//
+// A server whose calls are coroutines: OnCallCo fills in out like OnCall
+// and co_returns true, or false to fail the call, and can co_await in
+// between without holding the thread that runs it. The call starts on the
+// thread that read it (a server I/O or handler thread) and goes on wherever
+// what it awaits resumes it, an executor thread for instance. in and its
+// data are valid until the coroutine is done, OnCleanup(out) is called once
+// the reply is sent.
+//
+class CRpcCoServer : public CRpcServer
+{
+public:
+    CRpcCoServer() = default;
+    virtual ~CRpcCoServer() = default;
+
+protected:
+    virtual CRpcTask<bool> OnCallCo(const CRpc::param* in, CRpc::param* out) = 0;
+
+private:
+    struct CDetached;
+
+    virtual void OnCallAsync(const CRpc::param* in, CRpcReply reply);
+    virtual bool OnCall(const CRpc::param* /*in*/, CRpc::param* /*out*/) { return false; } // Not called
+    CDetached RunCall(int type, std::vector<u_char> request, CRpcReply reply);
+};
+
+#endif // C++20 coroutines
+
+#endif // __RPC_CORO_H__
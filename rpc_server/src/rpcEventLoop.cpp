@@ -0,0 +1,1013 @@
+//
+//  rpcEventLoop.cpp
+//
+#include <memory.h>
+#include <unistd.h>     // close()
+#include <errno.h>
+#include <fcntl.h>      // fcntl()
+#include <arpa/inet.h>  // ntohl()
+#include <unordered_set>
+#include <algorithm>
+#include <chrono>
+#if defined(__linux__)
+  #include <sys/epoll.h>
+  #include <sys/eventfd.h>
+#endif
+#include "rpcEventLoop.h"
+#include "rpcInternal.h"
+#include "rpcTransport.h"
+
+// Receive buffer every connection starts with. Smaller than the one of a
+// connection with a thread of its own, there can be many thousands of them.
+#define RPC_EVENT_LOOP_READ_SIZE    (8 * 1024)
+
+// Stop reading from a connection while that many reply bytes are not sent
+#define RPC_EVENT_LOOP_MAX_PENDING  (1024 * 1024)
+
+// Events taken with one epoll_wait call
+#define RPC_EVENT_LOOP_MAX_EVENTS   256
+
+// Connections accepted in a row before serving the others again
+#define RPC_EVENT_LOOP_MAX_ACCEPTS  64
+
+// Finished calls an I/O thread keeps for reuse
+#define RPC_EVENT_LOOP_FREE_CALLS   1024
+
+// Where a call is when its reply is completed
+#define RPC_CALL_DISPATCHING        0   // Still in OnCallAsync
+#define RPC_CALL_DONE_IN_DISPATCH   1   // Completed before OnCallAsync returned
+#define RPC_CALL_DEFERRED           2   // OnCallAsync returned without a reply
+
+// A call, the reply of which may come from any thread
+struct CRpcEventLoop::CCall : public CRpcPendingReply
+{
+    CRpcEventLoop* eventLoop = nullptr;
+    CLoop* loop = nullptr;
+    CConnection* conn = nullptr;
+    bool ordered = true;        // Replied to after the calls before it
+    bool pending = false;       // Queued, on a handler thread or waiting for a deferred reply
+    bool done = false;          // The reply is ready
+    CRpcFrameHeader hdr;
+    std::vector<u_char> request;
+    CRpc::param out;
+    std::atomic<int> state{RPC_CALL_DISPATCHING};
+    CRpcFrameWriter reply;
+    std::chrono::steady_clock::time_point queuedTime;
+
+    virtual void Complete(bool ok) { eventLoop->OnReply(this, ok); }
+};
+
+struct CRpcEventLoop::CConnection
+{
+    int sock = -1;
+    bool native = false;        // Native frames, handled by the event loop
+    bool readBlocked = false;   // Not read until the replies are sent
+    CRpcFrameReader reader{RPC_EVENT_LOOP_READ_SIZE};
+    CRpcFrameWriter writer;
+
+    // With handler threads: the calls in the order they came, replies are
+    // sent from the front as they get done. Calls the client lets be
+    // answered in any order (RPC_FRAME_FLAG_ANY_ORDER) are not kept here,
+    // their replies are sent as soon as they are done.
+    std::deque<CCall*> calls;
+    CCall* parked = nullptr;    // Not queued yet, the queue was full
+    bool queueBlocked = false;  // In CLoop::queueBlocked
+    int inFlight = 0;           // Calls the handler threads have
+    bool closed = false;        // Closed, waiting for the calls in flight
+    bool ready = false;         // Got replies since the last send
+    bool goAway = false;        // Told that the server is stopping
+};
+
+struct CRpcEventLoop::CLoop
+{
+    int epollFd = -1;
+    int wakeFd = -1;
+    int listenSock = -1;        // With Listen()
+    bool draining = false;      // Closing the connections as they become idle
+    std::thread thread;
+    std::unordered_set<CConnection*> connections;
+    std::vector<CConnection*> queueBlocked; // Waiting for room in the queue
+    std::vector<CCall*> freeCalls;
+
+    // Protected by mutex
+    std::mutex mutex;
+    std::vector<int> added;     // Sockets to register
+    std::vector<CCall*> completed; // Done by the handler threads or deferred
+    int deferred = 0;           // Deferred replies still to come
+    bool drain = false;
+    bool stop = false;
+};
+
+#if defined(__linux__)
+
+bool CRpcEventLoop::Start(int numThreads, int numHandlers /*= 0*/, int maxQueued /*= 1024*/)
+{
+    for(int i = 0; i < numThreads; i++)
+    {
+        CLoop* loop = new CLoop;
+        mLoops.push_back(loop);
+
+        loop->epollFd = epoll_create1(EPOLL_CLOEXEC);
+        loop->wakeFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if(loop->epollFd < 0 || loop->wakeFd < 0)
+        {
+            ERRMSG("CRpcEventLoop", "Failed to create the epoll set: " << strerror(errno));
+            Stop();
+            return false;
+        }
+
+        // The wake up descriptor is the only one without a connection
+        struct epoll_event ev;
+        memset(&ev, 0, sizeof(ev));
+        ev.events = EPOLLIN;
+        ev.data.ptr = nullptr;
+        if(epoll_ctl(loop->epollFd, EPOLL_CTL_ADD, loop->wakeFd, &ev) < 0)
+        {
+            ERRMSG("CRpcEventLoop", "epoll_ctl() failed: " << strerror(errno));
+            Stop();
+            return false;
+        }
+
+        loop->thread = std::thread(&CRpcEventLoop::Run, this, loop);
+    }
+
+    mMaxQueued = (size_t)std::max(maxQueued, 1);
+    mHandlersStop = false;
+    for(int i = 0; i < numHandlers; i++)
+        mHandlers.push_back(std::thread(&CRpcEventLoop::RunHandler, this));
+
+    if(numHandlers > 0)
+        INFOMSG("CRpcEventLoop", "Serving connections with " << numThreads << " I/O threads and " << numHandlers << " handler threads");
+    else
+        INFOMSG("CRpcEventLoop", "Serving connections with " << numThreads << " I/O threads");
+    return true;
+}
+
+void CRpcEventLoop::Stop()
+{
+    // The handler threads finish the queued calls first, the I/O threads
+    // still send the replies. Calls read from now on run on the I/O threads.
+    {
+        std::unique_lock<std::mutex> lock(mQueueMutex);
+        mHandlersStop = true;
+    }
+    mQueueCond.notify_all();
+
+    for(std::thread& handler : mHandlers)
+        handler.join();
+    mHandlers.clear();
+
+    for(CLoop* loop : mLoops)
+    {
+        {
+            std::unique_lock<std::mutex> lock(loop->mutex);
+            loop->stop = true;
+        }
+
+        if(loop->wakeFd >= 0)
+            Wake(loop);
+    }
+
+    for(CLoop* loop : mLoops)
+    {
+        if(loop->thread.joinable())
+            loop->thread.join();
+
+        // Sockets that were added but never registered
+        for(int sock : loop->added)
+            close(sock);
+
+        // Calls of connections the I/O thread gave up on (only if it failed)
+        for(CCall* call : loop->completed)
+            delete call;
+
+        if(loop->listenSock >= 0)
+            close(loop->listenSock);
+        if(loop->epollFd >= 0)
+            close(loop->epollFd);
+        if(loop->wakeFd >= 0)
+            close(loop->wakeFd);
+        delete loop;
+    }
+    mLoops.clear();
+
+    std::unique_lock<std::mutex> lock(mMutex);
+    mCond.wait(lock, [this]{ return (mHandedOff == 0); });
+}
+
+void CRpcEventLoop::Add(int sock)
+{
+    if(mLoops.empty())
+    {
+        close(sock);
+        return;
+    }
+
+    // Spread the connections over the I/O threads
+    CLoop* loop = mLoops[mNextLoop++ % mLoops.size()];
+    {
+        std::unique_lock<std::mutex> lock(loop->mutex);
+        loop->added.push_back(sock);
+    }
+
+    Wake(loop);
+}
+
+void CRpcEventLoop::Drain()
+{
+    for(CLoop* loop : mLoops)
+    {
+        {
+            std::unique_lock<std::mutex> lock(loop->mutex);
+            loop->drain = true;
+        }
+
+        Wake(loop);
+    }
+}
+
+void CRpcEventLoop::Wake(CLoop* loop)
+{
+    uint64_t one = 1;
+    if(write(loop->wakeFd, &one, sizeof(one)) < 0)
+        ERRMSG("CRpcEventLoop", "write() failed: " << strerror(errno));
+}
+
+bool CRpcEventLoop::Listen(unsigned short port, int maxPendingConnections)
+{
+    for(CLoop* loop : mLoops)
+    {
+        int sock = mServer->CreateSocket(port, true);
+        if(sock < 0 || !mServer->Listen(sock, maxPendingConnections))
+            return false; // The sockets created so far are closed by Stop
+
+        int flags = fcntl(sock, F_GETFL, 0);
+        if(flags < 0 || fcntl(sock, F_SETFL, flags | O_NONBLOCK) < 0)
+        {
+            ERRMSG("CRpcEventLoop", "fcntl(O_NONBLOCK) failed: " << strerror(errno));
+            close(sock);
+            return false;
+        }
+        loop->listenSock = sock;
+
+        // Level-triggered, so connections left in the backlog are reported again
+        struct epoll_event ev;
+        memset(&ev, 0, sizeof(ev));
+        ev.events = EPOLLIN;
+        ev.data.ptr = &loop->listenSock;
+        if(epoll_ctl(loop->epollFd, EPOLL_CTL_ADD, sock, &ev) < 0)
+        {
+            ERRMSG("CRpcEventLoop", "epoll_ctl() failed: " << strerror(errno));
+            return false;
+        }
+    }
+
+    return true;
+}
+
+void CRpcEventLoop::Accept(CLoop* loop)
+{
+    for(int i = 0; i < RPC_EVENT_LOOP_MAX_ACCEPTS; i++)
+    {
+        struct sockaddr_storage addr;
+        socklen_t addrLen = sizeof(addr);
+
+        int fd = accept(loop->listenSock, (struct sockaddr*)&addr, &addrLen);
+        if(fd < 0)
+        {
+            if(errno == EINTR || errno == ECONNABORTED)
+                continue;
+            if(errno != EAGAIN && errno != EWOULDBLOCK)
+                ERRMSG("CRpcEventLoop", "accept() failed: " << strerror(errno));
+            return;
+        }
+
+        // OnConnection can take the connection over, then fd is 0
+        fd = mServer->SetupConnection(fd, addr.ss_family);
+        if(fd > 0)
+            Register(loop, fd);
+    }
+}
+
+void CRpcEventLoop::Run(CLoop* loop)
+{
+    std::vector<struct epoll_event> events(RPC_EVENT_LOOP_MAX_EVENTS);
+    std::vector<int> added;
+
+    while(true)
+    {
+        int count = epoll_wait(loop->epollFd, events.data(), (int)events.size(), -1);
+        if(count < 0)
+        {
+            if(errno == EINTR)
+                continue;
+            ERRMSG("CRpcEventLoop", "epoll_wait() failed: " << strerror(errno));
+            break;
+        }
+
+        bool wake = false;
+        for(int i = 0; i < count; i++)
+        {
+            if(events[i].data.ptr == &loop->listenSock)
+            {
+                Accept(loop);
+                continue;
+            }
+
+            CConnection* conn = (CConnection*)events[i].data.ptr;
+            if(conn == nullptr)
+            {
+                wake = true;
+                continue;
+            }
+
+            // A hang up or an error is found out by reading
+            uint32_t flags = events[i].events;
+            bool open = true;
+            if(flags & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR))
+                open = OnReadable(loop, conn);
+            if(open && (flags & EPOLLOUT))
+                open = OnWritable(loop, conn);
+            if(!open)
+                Close(loop, conn);
+        }
+
+        if(!wake)
+        {
+            if(loop->draining)
+                Sweep(loop);
+            continue;
+        }
+
+        uint64_t value = 0;
+        if(read(loop->wakeFd, &value, sizeof(value)) < 0 && errno != EAGAIN)
+            ERRMSG("CRpcEventLoop", "read() failed: " << strerror(errno));
+
+        // Stopping waits for the deferred replies. The count can be below
+        // zero for a moment, when a reply comes before the call is counted.
+        bool stop = false;
+        bool drain = false;
+        {
+            std::unique_lock<std::mutex> lock(loop->mutex);
+            added.swap(loop->added);
+            stop = (loop->stop && loop->deferred <= 0);
+            drain = loop->drain;
+        }
+
+        for(int sock : added)
+            Register(loop, sock);
+        added.clear();
+
+        OnCompleted(loop);
+
+        // Read again from the connections that waited for room in the queue
+        if(!loop->queueBlocked.empty())
+        {
+            std::vector<CConnection*> blocked;
+            blocked.swap(loop->queueBlocked);
+            for(CConnection* conn : blocked)
+            {
+                conn->queueBlocked = false;
+                if(!OnReadable(loop, conn))
+                    Close(loop, conn);
+            }
+        }
+
+        if(drain && !loop->draining)
+            StartDrain(loop);
+        else if(loop->draining)
+            Sweep(loop);
+
+        if(stop)
+            break;
+    }
+
+    // Send what the sockets take and close the connections. The calls that
+    // have arrived are not run anymore, the native clients are told so.
+    OnCompleted(loop);
+    for(CConnection* conn : loop->connections)
+    {
+        if(conn->native)
+        {
+            if(conn->parked != nullptr)
+                mServer->mDroppedCalls++;
+            mServer->DropCalls(conn->reader);
+
+            if(!conn->goAway)
+            {
+                mServer->mGoAways++;
+                conn->writer.Append(CRpcFrame::GoAway(), nullptr);
+            }
+        }
+
+        if(conn->writer.Pending() > 0)
+            conn->writer.Send(conn->sock);
+        close(conn->sock);
+        Release(loop, conn);
+        mServer->CountConnection(-1);
+    }
+    loop->connections.clear();
+
+    for(CCall* call : loop->freeCalls)
+        delete call;
+    loop->freeCalls.clear();
+}
+
+void CRpcEventLoop::Register(CLoop* loop, int sock)
+{
+    int flags = fcntl(sock, F_GETFL, 0);
+    if(flags < 0 || fcntl(sock, F_SETFL, flags | O_NONBLOCK) < 0)
+    {
+        ERRMSG("CRpcEventLoop", "fcntl(O_NONBLOCK) failed: " << strerror(errno));
+        close(sock);
+        return;
+    }
+
+    CConnection* conn = new CConnection;
+    conn->sock = sock;
+
+    // Edge-triggered: reported once each time data arrives or room frees
+    // up, so every event is handled until the socket would block. Data
+    // that is already there is reported right away.
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+    ev.data.ptr = conn;
+    if(epoll_ctl(loop->epollFd, EPOLL_CTL_ADD, sock, &ev) < 0)
+    {
+        ERRMSG("CRpcEventLoop", "epoll_ctl() failed: " << strerror(errno));
+        close(sock);
+        delete conn;
+        return;
+    }
+
+    loop->connections.insert(conn);
+    mServer->CountConnection(1);
+}
+
+void CRpcEventLoop::StartDrain(CLoop* loop)
+{
+    loop->draining = true;
+
+    // Closing the socket takes it out of the epoll set
+    if(loop->listenSock >= 0)
+        close(loop->listenSock);
+    loop->listenSock = -1;
+
+    Sweep(loop);
+}
+
+void CRpcEventLoop::Sweep(CLoop* loop)
+{
+    std::vector<CConnection*> connections(loop->connections.begin(), loop->connections.end());
+    for(CConnection* conn : connections)
+    {
+        // Along with the replies still to send
+        if(conn->native && !conn->goAway)
+        {
+            conn->goAway = true;
+            mServer->mGoAways++;
+            conn->writer.Append(CRpcFrame::GoAway(), nullptr);
+        }
+
+        if(!OnWritable(loop, conn) || IsIdle(conn))
+            Close(loop, conn);
+    }
+}
+
+bool CRpcEventLoop::IsIdle(CConnection* conn)
+{
+    if(!conn->native)
+    {
+        // Nothing has arrived yet, or the client is gone
+        char c = 0;
+        ssize_t len = recv(conn->sock, &c, sizeof(c), MSG_PEEK);
+        return (len == 0 || (len < 0 && errno != EINTR));
+    }
+
+    // Every call is answered and sent. What arrives from now on is not
+    // read, the client finds out from RPC_FRAME_FLAG_GOAWAY.
+    return (conn->calls.empty() && conn->inFlight == 0 && conn->parked == nullptr &&
+            conn->writer.Pending() == 0 && conn->reader.Buffered() == 0);
+}
+
+void CRpcEventLoop::Close(CLoop* loop, CConnection* conn)
+{
+    // Closing the socket takes it out of the epoll set
+    if(conn->sock >= 0)
+        close(conn->sock);
+    conn->sock = -1;
+
+    loop->connections.erase(conn);
+    mServer->CountConnection(-1);
+    if(conn->queueBlocked)
+    {
+        loop->queueBlocked.erase(std::remove(loop->queueBlocked.begin(), loop->queueBlocked.end(), conn),
+                                 loop->queueBlocked.end());
+        conn->queueBlocked = false;
+    }
+
+    // The calls the handler threads have still come back to the connection
+    if(conn->inFlight > 0)
+        conn->closed = true;
+    else
+        Release(loop, conn);
+}
+
+void CRpcEventLoop::Release(CLoop* loop, CConnection* conn)
+{
+    for(CCall* call : conn->calls)
+    {
+        // A call still pending is deleted by Stop
+        if(!call->pending)
+            Recycle(loop, call);
+    }
+
+    if(conn->parked != nullptr && !conn->parked->ordered)
+        Recycle(loop, conn->parked);
+
+    delete conn;
+}
+
+void CRpcEventLoop::Recycle(CLoop* loop, CCall* call)
+{
+    if(loop->freeCalls.size() < RPC_EVENT_LOOP_FREE_CALLS)
+        loop->freeCalls.push_back(call);
+    else
+        delete call;
+}
+
+bool CRpcEventLoop::OnReadable(CLoop* loop, CConnection* conn)
+{
+    if(!conn->native)
+    {
+        // Look at the first frame header without taking it: SunRPC clients
+        // and shared memory clients need a thread of their own
+        u_char buf[CRpcFrame::HEADER_SIZE];
+        ssize_t len = recv(conn->sock, buf, sizeof(buf), MSG_PEEK);
+        if(len < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+            return true;
+        if(len <= 0)
+        {
+            INFOMSG("CRpcEventLoop", "Disconnected (sock=" << conn->sock << ")");
+            return false;
+        }
+
+        uint32_t magic = 0;
+        if(len < (ssize_t)sizeof(magic))
+            return true; // Wait for more
+
+        memcpy(&magic, buf, sizeof(magic));
+        if(ntohl(magic) != RPC_FRAME_MAGIC)
+            return HandOff(loop, conn);
+
+        CRpcFrameHeader hdr;
+        if(len < (ssize_t)sizeof(buf))
+            return true; // Wait for the whole header
+        if(CRpcFrame::DecodeHeader(buf, hdr) && (hdr.flags & RPC_FRAME_FLAG_SHM))
+            return HandOff(loop, conn);
+
+        conn->native = true;
+    }
+
+    CRpcFrameHeader hdr;
+    u_char* payload = nullptr;
+
+    while(true)
+    {
+        // A call that found the queue full goes first, the connection
+        // isn't read until it is queued
+        if(conn->parked != nullptr && !Dispatch(loop, conn, conn->parked))
+            break;
+
+        // Let the client catch up with the replies first
+        if(conn->writer.Pending() >= RPC_EVENT_LOOP_MAX_PENDING)
+        {
+            if(!conn->writer.Send(conn->sock))
+            {
+                INFOMSG("CRpcEventLoop", "Failed to send reply (sock=" << conn->sock << "): " << strerror(errno));
+                return false;
+            }
+
+            if(conn->writer.Pending() >= RPC_EVENT_LOOP_MAX_PENDING)
+            {
+                conn->readBlocked = true;
+                return true;
+            }
+        }
+
+        size_t capacity = conn->reader.Capacity();
+        int res = conn->reader.Next(conn->sock, hdr, payload, CRpcFrame::NoDeadline());
+        mServer->CountRecvBuffer(capacity, conn->reader.Capacity());
+        if(res == 0)
+        {
+            break; // Everything that has arrived is handled
+        }
+        else if(res == -2 || (res > 0 && (hdr.flags & RPC_FRAME_FLAG_REPLY)))
+        {
+            ERRMSG("CRpcEventLoop", "Invalid request frame received (sock=" << conn->sock << ")");
+            return false;
+        }
+        else if(res < 0)
+        {
+            INFOMSG("CRpcEventLoop", "Disconnected (sock=" << conn->sock << ")");
+            return false;
+        }
+
+        if(hdr.flags & RPC_FRAME_FLAG_SHM)
+        {
+            // Only the first frame can switch to shared memory, the client stays on the socket
+            CRpcFrameHeader reply;
+            reply.reqId = hdr.reqId;
+            reply.flags = RPC_FRAME_FLAG_REPLY | RPC_FRAME_FLAG_SHM | RPC_FRAME_FLAG_ERROR;
+            // After the replies to the calls before it
+            CCall* call = NewCall(loop, conn, hdr);
+            call->reply.Append(reply, nullptr);
+            Reply(loop, conn, call);
+            continue;
+        }
+
+        CCall* call = NewCall(loop, conn, hdr);
+        if(!mHandlers.empty())
+        {
+            // The payload is only valid until the next frame is read
+            call->request.assign(payload, payload + hdr.length);
+            if(!Dispatch(loop, conn, call))
+                break;
+            continue;
+        }
+
+        ExecuteHere(loop, conn, call, payload);
+    }
+
+    if(!conn->writer.Send(conn->sock))
+    {
+        INFOMSG("CRpcEventLoop", "Failed to send reply (sock=" << conn->sock << "): " << strerror(errno));
+        return false;
+    }
+
+    return true;
+}
+
+bool CRpcEventLoop::OnWritable(CLoop* loop, CConnection* conn)
+{
+    if(conn->writer.Pending() > 0 && !conn->writer.Send(conn->sock))
+    {
+        INFOMSG("CRpcEventLoop", "Failed to send reply (sock=" << conn->sock << "): " << strerror(errno));
+        return false;
+    }
+
+    // Catch up with the calls that were left unread
+    if(conn->readBlocked && conn->writer.Pending() < RPC_EVENT_LOOP_MAX_PENDING)
+    {
+        conn->readBlocked = false;
+        return OnReadable(loop, conn);
+    }
+
+    return true;
+}
+
+CRpcEventLoop::CCall* CRpcEventLoop::NewCall(CLoop* loop, CConnection* conn, const CRpcFrameHeader& hdr)
+{
+    CCall* call = nullptr;
+    if(!loop->freeCalls.empty())
+    {
+        call = loop->freeCalls.back();
+        loop->freeCalls.pop_back();
+    }
+    else
+    {
+        call = new CCall;
+    }
+
+    call->eventLoop = this;
+    call->loop = loop;
+    call->conn = conn;
+    call->hdr = hdr;
+    call->ordered = !(hdr.flags & RPC_FRAME_FLAG_ANY_ORDER);
+    call->pending = false;
+    call->done = false;
+    if(call->ordered)
+        conn->calls.push_back(call);
+    return call;
+}
+
+bool CRpcEventLoop::Dispatch(CLoop* loop, CConnection* conn, CCall* call)
+{
+    int res = Post(call);
+    if(res > 0)
+    {
+        conn->parked = nullptr;
+        conn->inFlight++;
+        return true;
+    }
+    else if(res == 0)
+    {
+        // Read again once a handler thread makes room
+        if(conn->parked != call)
+        {
+            conn->parked = call;
+            mServer->mQueueFull++;
+        }
+        // At most once, a second entry would outlive Close() in Run()
+        if(!conn->queueBlocked)
+        {
+            conn->queueBlocked = true;
+            loop->queueBlocked.push_back(conn);
+        }
+        return false;
+    }
+
+    // The handler threads are stopping, run it here
+    conn->parked = nullptr;
+    ExecuteHere(loop, conn, call, call->request.data());
+    return true;
+}
+
+void CRpcEventLoop::ExecuteHere(CLoop* loop, CConnection* conn, CCall* call, u_char* data)
+{
+    if(Execute(call, data))
+    {
+        Reply(loop, conn, call);
+    }
+    else
+    {
+        // The reply comes back like the ones of the handler threads
+        call->pending = true;
+        conn->inFlight++;
+    }
+}
+
+void CRpcEventLoop::Reply(CLoop* loop, CConnection* conn, CCall* call)
+{
+    if(call->ordered)
+    {
+        call->done = true;
+        Deliver(loop, conn);
+    }
+    else
+    {
+        conn->writer.Append(call->reply);
+        Recycle(loop, call);
+    }
+}
+
+int CRpcEventLoop::Post(CCall* call)
+{
+    std::unique_lock<std::mutex> lock(mQueueMutex);
+
+    if(mHandlersStop)
+        return -1;
+
+    if(mQueue.size() >= mMaxQueued)
+    {
+        mQueueBlocked = true;
+        return 0;
+    }
+
+    call->pending = true;
+    call->queuedTime = std::chrono::steady_clock::now();
+    mQueue.push_back(call);
+
+    int depth = (int)mQueue.size();
+    mServer->mQueueDepth = depth;
+    if(depth > mServer->mQueueMaxDepth)
+        mServer->mQueueMaxDepth = depth;
+    lock.unlock();
+
+    mServer->mQueuedCalls++;
+    mQueueCond.notify_one();
+    return 1;
+}
+
+void CRpcEventLoop::RunHandler()
+{
+    std::unique_lock<std::mutex> lock(mQueueMutex);
+
+    while(true)
+    {
+        mQueueCond.wait(lock, [this]{ return (mHandlersStop || !mQueue.empty()); });
+        if(mQueue.empty())
+            break; // Stopping and every queued call is done
+
+        CCall* call = mQueue.front();
+        mQueue.pop_front();
+        mServer->mQueueDepth = (int)mQueue.size();
+
+        // There is room now for the connections that wait for it
+        bool wakeAll = mQueueBlocked;
+        mQueueBlocked = false;
+        lock.unlock();
+
+        auto waited = std::chrono::steady_clock::now() - call->queuedTime;
+        mServer->mQueueWaitUs += std::chrono::duration_cast<std::chrono::microseconds>(waited).count();
+
+        if(wakeAll)
+        {
+            for(CLoop* loop : mLoops)
+                Wake(loop);
+        }
+
+        if(!Execute(call, call->request.data()))
+        {
+            lock.lock();
+            continue; // Sent back when the reply comes
+        }
+
+        // Back to the I/O thread of the connection
+        CLoop* loop = call->loop;
+        bool wake = false;
+        {
+            std::unique_lock<std::mutex> loopLock(loop->mutex);
+            wake = loop->completed.empty(); // Otherwise it is woken up already
+            loop->completed.push_back(call);
+        }
+
+        if(wake)
+            Wake(loop);
+
+        lock.lock();
+    }
+}
+
+bool CRpcEventLoop::Execute(CCall* call, u_char* data)
+{
+    CRpc::param in;
+    in.type = (int)call->hdr.type;
+    in.data_len = call->hdr.length;
+    in.data_val = (call->hdr.length > 0 ? data : nullptr);
+
+    call->out = CRpc::param();
+    call->out.type = in.type; // Initially, can be reset in OnCall if desired
+    call->mOut = &call->out;
+    call->state = RPC_CALL_DISPATCHING;
+    mServer->mCalls++;
+
+    mServer->OnCallAsync(&in, CRpcReply(call));
+
+    // Whoever comes second, this thread or the one that completes the
+    // reply, takes the call on
+    int state = RPC_CALL_DISPATCHING;
+    if(!call->state.compare_exchange_strong(state, RPC_CALL_DEFERRED))
+        return true; // The reply is ready
+
+    std::unique_lock<std::mutex> lock(call->loop->mutex);
+    call->loop->deferred++;
+    return false;
+}
+
+void CRpcEventLoop::OnReply(CCall* call, bool ok)
+{
+    CRpcFrameHeader reply;
+    mServer->ReplyHeader(call->hdr, ok, &call->out, reply);
+    call->reply.Append(reply, ok ? &call->out : nullptr);
+
+    // Post-reply cleanup to free the memory (if any) allocated by OnCall.
+    // Note: The reply is copied by now.
+    mServer->OnCleanup(&call->out);
+
+    int state = RPC_CALL_DISPATCHING;
+    if(call->state.compare_exchange_strong(state, RPC_CALL_DONE_IN_DISPATCH))
+        return; // Execute takes it on
+
+    // Deferred, back to the I/O thread of the connection. It is woken up
+    // under the lock: once the lock is released the loop can be gone.
+    CLoop* loop = call->loop;
+    std::unique_lock<std::mutex> lock(loop->mutex);
+    bool wake = loop->completed.empty(); // Otherwise it is woken up already
+    loop->completed.push_back(call);
+    loop->deferred--;
+    if(wake || (loop->stop && loop->deferred <= 0))
+        Wake(loop);
+}
+
+void CRpcEventLoop::Deliver(CLoop* loop, CConnection* conn)
+{
+    // The replies go out in the order of the calls
+    while(!conn->calls.empty() && conn->calls.front()->done)
+    {
+        CCall* call = conn->calls.front();
+        conn->calls.pop_front();
+        conn->writer.Append(call->reply);
+        Recycle(loop, call);
+    }
+}
+
+void CRpcEventLoop::OnCompleted(CLoop* loop)
+{
+    std::vector<CCall*> completed;
+    {
+        std::unique_lock<std::mutex> lock(loop->mutex);
+        completed.swap(loop->completed);
+    }
+
+    if(completed.empty())
+        return;
+
+    std::vector<CConnection*> ready;
+    for(CCall* call : completed)
+    {
+        CConnection* conn = call->conn;
+        call->pending = false;
+        conn->inFlight--;
+
+        if(conn->closed)
+        {
+            // Only the ordered calls are freed with the connection
+            if(call->ordered)
+                call->done = true;
+            else
+                Recycle(loop, call);
+
+            if(conn->inFlight == 0)
+                Release(loop, conn);
+            continue;
+        }
+
+        if(call->ordered)
+            call->done = true;
+        else
+        {
+            conn->writer.Append(call->reply);
+            Recycle(loop, call);
+        }
+
+        if(!conn->ready)
+        {
+            conn->ready = true;
+            ready.push_back(conn);
+        }
+    }
+
+    // Send the replies, every connection once
+    for(CConnection* conn : ready)
+    {
+        conn->ready = false;
+        Deliver(loop, conn);
+        if(!OnWritable(loop, conn))
+            Close(loop, conn);
+    }
+}
+
+bool CRpcEventLoop::HandOff(CLoop* loop, CConnection* conn)
+{
+    int sock = conn->sock;
+    conn->sock = -1; // Not closed with the connection
+
+    int flags = fcntl(sock, F_GETFL, 0);
+    if(epoll_ctl(loop->epollFd, EPOLL_CTL_DEL, sock, nullptr) < 0 ||
+       flags < 0 || fcntl(sock, F_SETFL, flags & ~O_NONBLOCK) < 0)
+    {
+        ERRMSG("CRpcEventLoop", "Failed to hand off the connection (sock=" << sock << "): " << strerror(errno));
+        close(sock);
+        return false;
+    }
+
+    {
+        std::unique_lock<std::mutex> lock(mMutex);
+        mHandedOff++;
+    }
+
+    // Still counted once this one is closed
+    mServer->CountConnection(1);
+
+    std::thread([this, sock]()
+    {
+        mServer->HandleConnection(sock); // Closes the socket
+        mServer->CountConnection(-1);
+
+        std::unique_lock<std::mutex> lock(mMutex);
+        mHandedOff--;
+        mCond.notify_all();
+    }).detach();
+
+    return false; // Done with it here
+}
+
+#else // No epoll
+
+bool CRpcEventLoop::Start(int /*numThreads*/, int /*numHandlers = 0*/, int /*maxQueued = 1024*/)
+{
+    ERRMSG("CRpcEventLoop", "The event loop needs epoll, which is not available on this platform");
+    return false;
+}
+
+void CRpcEventLoop::Stop()
+{
+}
+
+void CRpcEventLoop::Add(int sock)
+{
+    close(sock);
+}
+
+void CRpcEventLoop::Drain()
+{
+}
+
+bool CRpcEventLoop::Listen(unsigned short /*port*/, int /*maxPendingConnections*/)
+{
+    return false;
+}
+
+#endif // __linux__
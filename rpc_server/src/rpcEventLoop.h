@@ -0,0 +1,132 @@
+//
+//  rpcEventLoop.h
+//
+#ifndef __RPC_EVENT_LOOP_H__
+#define __RPC_EVENT_LOOP_H__
+
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include "rpc.h"
+
+//
+// Class CRpcEventLoop
+//
+// The server side of CRpcServer::SetEventLoop. Every I/O thread waits on
+// its own epoll set, edge-triggered, for the non-blocking connections
+// assigned to it. When a connection is readable the thread takes every
+// frame that has arrived, passes the calls to OnCall and sends the
+// replies together. Whatever the socket doesn't take is sent when it
+// becomes writable again, and the connection isn't read while too much
+// is waiting to be sent.
+//
+// SunRPC clients and clients that ask for shared memory (told apart by
+// the first bytes they send) are handed to CRpcServer::HandleConnection
+// on a thread of their own.
+//
+// The connections are accepted by CRpcServer::Run and spread over the
+// threads round-robin, or with Listen() every thread accepts its own.
+//
+// With handler threads the calls don't run on the I/O threads: a call is
+// copied out of the receive buffer and queued, a handler thread runs it
+// and queues the reply back to the I/O thread of the connection, which
+// sends the replies of a connection in the order of the calls. A slow
+// call holds neither the I/O thread nor the calls after it. When the
+// queue is full a connection is not read until there is room again.
+// Calls flagged RPC_FRAME_FLAG_ANY_ORDER are answered as soon as they are
+// done, so a cheap call doesn't wait for the reply to a slow one.
+//
+// A reply deferred by CRpcServer::OnCallAsync comes back to the I/O thread
+// of the connection the same way, from whatever thread completes it, and
+// holds neither an I/O thread nor a handler thread meanwhile.
+//
+// When draining, the I/O threads stop accepting, tell every native client
+// to go elsewhere (RPC_FRAME_FLAG_GOAWAY) and close each connection once
+// its calls are answered and nothing else has arrived.
+//
+class CRpcEventLoop
+{
+public:
+    CRpcEventLoop(CRpcServer* server) : mServer(server) {}
+    ~CRpcEventLoop() { Stop(); }
+
+    CRpcEventLoop(const CRpcEventLoop&) = delete;
+    CRpcEventLoop& operator=(const CRpcEventLoop&) = delete;
+
+    // numHandlers 0 runs the calls on the I/O threads
+    bool Start(int numThreads, int numHandlers = 0, int maxQueued = 1024);
+
+    // Finish the queued calls and wait for the deferred replies, close the
+    // connections and wait for the threads. Connections that were handed
+    // off stop once CRpcServer::Stop has been called.
+    void Stop();
+
+    // Take over a connected socket
+    void Add(int sock);
+
+    // CRpcServer::Stop with a drain timeout: stop accepting and close the
+    // connections as they become idle. Stop closes the others.
+    void Drain();
+
+    // After Start: every I/O thread listens on the port with a SO_REUSEPORT
+    // socket of its own and accepts the connections the kernel gives it
+    bool Listen(unsigned short port, int maxPendingConnections);
+
+private:
+    struct CConnection;
+    struct CLoop;
+    struct CCall;
+
+    CRpcServer* mServer = nullptr;
+    std::vector<CLoop*> mLoops;
+    unsigned mNextLoop = 0;
+
+    // Calls waiting for a handler thread
+    std::vector<std::thread> mHandlers;
+    std::mutex mQueueMutex;
+    std::condition_variable mQueueCond;
+    std::deque<CCall*> mQueue;
+    size_t mMaxQueued = 1024;
+    bool mQueueBlocked = false;     // A connection waits for room in the queue
+    bool mHandlersStop = false;
+
+    // Number of connections handed to threads of their own
+    std::mutex mMutex;
+    std::condition_variable mCond;
+    int mHandedOff = 0;
+
+    void Run(CLoop* loop);
+    void Register(CLoop* loop, int sock);
+    void StartDrain(CLoop* loop);
+    void Sweep(CLoop* loop);    // Draining: close the connections that are done
+    bool IsIdle(CConnection* conn);
+    void Accept(CLoop* loop);
+    void Close(CLoop* loop, CConnection* conn);
+    bool OnReadable(CLoop* loop, CConnection* conn);
+    bool OnWritable(CLoop* loop, CConnection* conn);
+    bool HandOff(CLoop* loop, CConnection* conn);
+
+    void Wake(CLoop* loop);
+    void Release(CLoop* loop, CConnection* conn);
+
+    // Calls, handler threads and deferred replies
+    CCall* NewCall(CLoop* loop, CConnection* conn, const CRpcFrameHeader& hdr);
+    bool Dispatch(CLoop* loop, CConnection* conn, CCall* call);
+    void ExecuteHere(CLoop* loop, CConnection* conn, CCall* call, u_char* data);
+    void Reply(CLoop* loop, CConnection* conn, CCall* call);
+    void Recycle(CLoop* loop, CCall* call);
+    int Post(CCall* call); // 1 queued, 0 the queue is full, -1 stopping
+    void RunHandler();
+    bool Execute(CCall* call, u_char* data); // false if the reply is deferred
+    void OnReply(CCall* call, bool ok);
+    void Deliver(CLoop* loop, CConnection* conn);
+    void OnCompleted(CLoop* loop);
+
+    // Logging goes to the server
+    void LogInfo(const char* msg) { mServer->LogInfo(msg); }
+    void LogError(const char* err) { mServer->LogError(err); }
+};
+
+#endif // __RPC_EVENT_LOOP_H__
@@ -0,0 +1,57 @@
+//
+//  rpcInternal.h
+//
+#ifndef __RPC_INTERNAL_H__
+#define __RPC_INTERNAL_H__
+
+//
+// Definitions shared by the libprotorpc sources. Not for use by applications.
+//
+
+#include <sstream>
+#include "rpc.h"
+
+#define RPC_PROTOBUF_PROG_NUMBER        ((u_int)0x2fffffff)
+#define RPC_PROTOBUF_VERSION            ((u_int)1) // CRpc::CODEC::LEGACY payload
+#define RPC_PROTOBUF_VERSION_BULK       ((u_int)2) // CRpc::CODEC::BULK payload
+#define RPC_PROTOBUF_FUNC_PROC          ((u_int)1) // function to call
+
+// Don't raise SIGPIPE when the peer is gone, fail with EPIPE instead
+#ifdef MSG_NOSIGNAL
+  #define RPC_SEND_FLAGS MSG_NOSIGNAL
+#else
+  #define RPC_SEND_FLAGS 0
+#endif
+
+// Logging helpers
+#define INFOMSG(className, msg)                          \
+do{                                                      \
+    std::stringstream ss;                                \
+    ss << className << "::" << __func__ << ": " << msg;  \
+    LogInfo(ss.str().c_str());                           \
+}while(0)
+
+#define ERRMSG(className, msg)                           \
+do{                                                      \
+    std::stringstream ss;                                \
+    ss << className << "::" << __func__ << ": " << msg;  \
+    LogError(ss.str().c_str());                          \
+}while(0)
+
+//
+// Class CRpcPendingReply
+//
+// A call waiting for its reply, what CRpcReply completes
+//
+class CRpcPendingReply
+{
+public:
+    virtual ~CRpcPendingReply() = default;
+
+    // Called once, from any thread: send out, or the error reply if !ok
+    virtual void Complete(bool ok) = 0;
+
+    CRpc::param* mOut = nullptr;
+};
+
+#endif // __RPC_INTERNAL_H__
@@ -0,0 +1,280 @@
+//
+//  rpcPool.cpp
+//
+#include <algorithm>
+#include "rpcPool.h"
+#include "rpcInternal.h"
+#include "rpcTransport.h"
+
+// Delay between attempts to connect while the server is not reachable
+#define RPC_POOL_RETRY_MIN_MS   100
+#define RPC_POOL_RETRY_MAX_MS   5000
+
+//
+// Class CRpcClientPool::CPooledClient
+//
+// The clients log through the pool
+//
+class CRpcClientPool::CPooledClient : public CRpcClient
+{
+public:
+    CPooledClient(CRpcClientPool* pool) : CRpcClient(pool->mTransport), mPool(pool) {}
+
+    bool mConnectedOnce = false;
+
+protected:
+    virtual void LogInfo(const char* msg) { mPool->LogInfo(msg); }
+    virtual void LogError(const char* err) { mPool->LogError(err); }
+
+private:
+    CRpcClientPool* mPool = nullptr;
+};
+
+//
+// Class CRpcClientPool::CLease
+//
+CRpcClientPool::CLease& CRpcClientPool::CLease::operator=(CLease&& other)
+{
+    if(this != &other)
+    {
+        Release();
+        mPool = other.mPool;
+        mClient = other.mClient;
+        other.mPool = nullptr;
+        other.mClient = nullptr;
+    }
+    return *this;
+}
+
+void CRpcClientPool::CLease::Release()
+{
+    if(mPool != nullptr && mClient != nullptr)
+        mPool->Return(mClient);
+
+    mPool = nullptr;
+    mClient = nullptr;
+}
+
+//
+// Class CRpcClientPool
+//
+CRpcClientPool::CRpcClientPool(TRANSPORT transport /*= TRANSPORT::SUNRPC*/, int maxClients /*= 8*/, int minClients /*= 1*/)
+    : mTransport(transport)
+{
+    mMaxClients = std::max(maxClients, 1);
+    mMinClients = std::min(std::max(minClients, 0), mMaxClients);
+}
+
+CRpcClientPool::~CRpcClientPool()
+{
+    Stop();
+}
+
+bool CRpcClientPool::Start(const char* hostName, unsigned short port)
+{
+    if(hostName == nullptr || *hostName == '\0')
+    {
+        ERRMSG("CRpcClientPool", "Invalid host name");
+        return false;
+    }
+
+    mHostName = hostName;
+    mPort = port;
+    mSocketPath.clear();
+    return Start();
+}
+
+bool CRpcClientPool::Start(const char* socketPath)
+{
+    if(socketPath == nullptr || *socketPath == '\0')
+    {
+        ERRMSG("CRpcClientPool", "Invalid socket path");
+        return false;
+    }
+
+    mHostName.clear();
+    mPort = 0;
+    mSocketPath = socketPath;
+    return Start();
+}
+
+bool CRpcClientPool::Start()
+{
+    std::unique_lock<std::mutex> lock(mMutex);
+
+    if(mRunning || mThread.joinable())
+    {
+        ERRMSG("CRpcClientPool", "The pool is already started");
+        return false;
+    }
+
+    mRunning = true;
+    mThread = std::thread(&CRpcClientPool::Run, this);
+    return true;
+}
+
+void CRpcClientPool::Stop()
+{
+    {
+        std::unique_lock<std::mutex> lock(mMutex);
+        mRunning = false;
+    }
+
+    mWorkCond.notify_all();
+    mIdleCond.notify_all();
+
+    if(mThread.joinable())
+        mThread.join();
+
+    // Leased clients are deleted when they are given back
+    std::unique_lock<std::mutex> lock(mMutex);
+    for(CPooledClient* client : mIdle)
+        delete client;
+    for(CPooledClient* client : mBroken)
+        delete client;
+
+    mTotal -= (int)(mIdle.size() + mBroken.size());
+    mIdle.clear();
+    mBroken.clear();
+}
+
+void CRpcClientPool::SetConnectTimeout(const struct timeval timeout)
+{
+    std::unique_lock<std::mutex> lock(mMutex);
+    mConnectTimeout = timeout;
+}
+
+CRpcClientPool::CLease CRpcClientPool::Lease(const struct timeval timeout /*= RPC_TIMEOUT_INFINITE*/)
+{
+    std::unique_lock<std::mutex> lock(mMutex);
+
+    if(mRunning && mIdle.empty())
+    {
+        // Let the background thread know it may need to grow the pool
+        mStats.waits++;
+        mWaiting++;
+        mWorkCond.notify_one();
+
+        bool ready = mIdleCond.wait_until(lock, CRpcFrame::Deadline(timeout),
+                                          [this]{ return (!mRunning || !mIdle.empty()); });
+        mWaiting--;
+
+        if(!ready)
+        {
+            mStats.waitTimeouts++;
+            return CLease();
+        }
+    }
+
+    if(!mRunning)
+        return CLease();
+
+    CPooledClient* client = mIdle.front();
+    mIdle.pop_front();
+    mStats.leases++;
+
+    return CLease(this, client);
+}
+
+void CRpcClientPool::Return(CRpcClient* rpcClient)
+{
+    CPooledClient* client = static_cast<CPooledClient*>(rpcClient);
+    std::unique_lock<std::mutex> lock(mMutex);
+
+    if(!mRunning)
+    {
+        mTotal--;
+        lock.unlock();
+        delete client;
+        return;
+    }
+
+    if(client->IsValid())
+    {
+        mIdle.push_front(client);
+        lock.unlock();
+        mIdleCond.notify_one();
+    }
+    else
+    {
+        mStats.evictions++;
+        mBroken.push_back(client);
+        lock.unlock();
+        mWorkCond.notify_one();
+    }
+}
+
+CRpcClientPool::Stats CRpcClientPool::GetStats()
+{
+    std::unique_lock<std::mutex> lock(mMutex);
+
+    Stats stats = mStats;
+    stats.total = mTotal;
+    stats.idle = (int)mIdle.size();
+    return stats;
+}
+
+bool CRpcClientPool::Connect(CPooledClient* client)
+{
+    if(!mSocketPath.empty())
+        return client->Connect(mSocketPath.c_str());
+    else
+        return client->Connect(mHostName.c_str(), mPort);
+}
+
+void CRpcClientPool::Run()
+{
+    std::chrono::milliseconds retryDelay(0);
+    std::unique_lock<std::mutex> lock(mMutex);
+
+    while(mRunning)
+    {
+        // Add clients to keep minClients and to serve the threads that are
+        // waiting, unless the clients being connected already cover them
+        while(mTotal < mMaxClients &&
+              (mTotal < mMinClients || mWaiting > (int)mBroken.size()))
+        {
+            mBroken.push_back(new CPooledClient(this));
+            mTotal++;
+        }
+
+        if(mBroken.empty())
+        {
+            mWorkCond.wait(lock);
+            continue;
+        }
+
+        CPooledClient* client = mBroken.front();
+        mBroken.pop_front();
+
+        // Connect without holding the lock, leases and returns go on meanwhile
+        client->SetConnectTimeout(mConnectTimeout);
+        lock.unlock();
+        bool connected = Connect(client);
+        lock.lock();
+
+        if(connected)
+        {
+            if(client->mConnectedOnce)
+                mStats.reconnects++;
+            else
+                mStats.connects++;
+
+            client->mConnectedOnce = true;
+            retryDelay = std::chrono::milliseconds(0);
+
+            mIdle.push_front(client);
+            mIdleCond.notify_one();
+        }
+        else
+        {
+            // The server is likely down, back off before trying again
+            mStats.connectFailures++;
+            mBroken.push_back(client);
+
+            retryDelay = std::min(std::max(retryDelay * 2, std::chrono::milliseconds(RPC_POOL_RETRY_MIN_MS)),
+                                  std::chrono::milliseconds(RPC_POOL_RETRY_MAX_MS));
+            mWorkCond.wait_for(lock, retryDelay, [this]{ return !mRunning; });
+        }
+    }
+}
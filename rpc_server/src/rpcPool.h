@@ -0,0 +1,123 @@
+//
+//  rpcPool.h
+//
+#ifndef __RPC_POOL_H__
+#define __RPC_POOL_H__
+
+#include <condition_variable>
+#include <list>
+#include <mutex>
+#include <thread>
+#include "rpc.h"
+
+//
+// Class CRpcClientPool
+//
+// Connections to one server shared by many threads. A thread leases a
+// connected CRpcClient for as long as it needs it, and the lease gives it
+// back when it goes out of scope:
+//
+//     CRpcClientPool::CLease client = pool.Lease();
+//     if(client)
+//         client->Call(...);
+//
+// Clients are created on demand up to maxClients (minClients are kept
+// connected from the start). All connecting is done by a background
+// thread: a client that comes back broken (Call destroys the connection
+// on RPC_CANTSEND/RPC_CANTRECV) is reconnected there, with a growing
+// delay while the server is down, and never handed out until it is
+// connected again.
+//
+class CRpcClientPool : public CRpc
+{
+public:
+    class CLease
+    {
+    public:
+        CLease() = default;
+        ~CLease() { Release(); }
+
+        CLease(CLease&& other) : mPool(other.mPool), mClient(other.mClient) { other.mPool = nullptr; other.mClient = nullptr; }
+        CLease& operator=(CLease&& other);
+        CLease(const CLease&) = delete;
+        CLease& operator=(const CLease&) = delete;
+
+        CRpcClient* Get() const { return mClient; }
+        CRpcClient* operator->() const { return mClient; }
+        explicit operator bool() const { return (mClient != nullptr); }
+
+        // Give the client back to the pool before the lease goes out of scope
+        void Release();
+
+    private:
+        friend class CRpcClientPool;
+        CLease(CRpcClientPool* pool, CRpcClient* client) : mPool(pool), mClient(client) {}
+
+        CRpcClientPool* mPool = nullptr;
+        CRpcClient* mClient = nullptr;
+    };
+
+    struct Stats
+    {
+        uint64_t leases = 0;            // Clients handed out
+        uint64_t waits = 0;             // Leases that had to wait for a client
+        uint64_t waitTimeouts = 0;      // Leases that gave up waiting
+        uint64_t connects = 0;          // New clients connected
+        uint64_t reconnects = 0;        // Broken clients connected again
+        uint64_t connectFailures = 0;   // Failed connection attempts
+        uint64_t evictions = 0;         // Broken clients given back
+        int total = 0;                  // Clients in the pool
+        int idle = 0;                   // Connected clients not leased
+    };
+
+    CRpcClientPool(TRANSPORT transport = TRANSPORT::SUNRPC, int maxClients = 8, int minClients = 1);
+    virtual ~CRpcClientPool();
+
+    CRpcClientPool(const CRpcClientPool&) = delete;
+    CRpcClientPool& operator=(const CRpcClientPool&) = delete;
+
+    // Set the server and start the background thread
+    bool Start(const char* hostName, unsigned short port);
+    bool Start(const char* socketPath); // Unix domain socket
+    void Stop();
+
+    // Time a client has to connect (RPC_CONNECT_TIMEOUT by default)
+    void SetConnectTimeout(const struct timeval timeout);
+
+    // Wait up to timeout for a connected client. Returns an empty lease
+    // if there was none in time or the pool is stopped. Leases must not
+    // outlive the pool, and a client must be given back with no pipelined
+    // requests in flight.
+    CLease Lease(const struct timeval timeout = RPC_TIMEOUT_INFINITE);
+
+    Stats GetStats();
+
+private:
+    class CPooledClient;
+
+    TRANSPORT mTransport = TRANSPORT::SUNRPC;
+    int mMaxClients = 8;
+    int mMinClients = 1;
+    std::string mHostName;
+    unsigned short mPort = 0;
+    std::string mSocketPath;
+    struct timeval mConnectTimeout = RPC_CONNECT_TIMEOUT;
+
+    std::thread mThread;
+    std::mutex mMutex;
+    std::condition_variable mIdleCond;      // A client became idle or the pool stopped
+    std::condition_variable mWorkCond;      // There is something to connect
+    bool mRunning = false;
+    std::list<CPooledClient*> mIdle;        // Connected, most recently used first
+    std::list<CPooledClient*> mBroken;      // Waiting to be (re)connected
+    int mTotal = 0;                         // All the clients, leased included
+    int mWaiting = 0;                       // Threads waiting in Lease()
+    Stats mStats;
+
+    bool Start();
+    bool Connect(CPooledClient* client);
+    void Run();
+    void Return(CRpcClient* client);
+};
+
+#endif // __RPC_POOL_H__
@@ -0,0 +1,621 @@
+//
+//  rpcShm.cpp
+//
+#include <stdio.h>
+#include <memory.h>
+#include <unistd.h>     // close(), ftruncate()
+#include <errno.h>
+#include <fcntl.h>      // O_CREAT
+#include <poll.h>
+#include <limits.h>     // INT_MAX
+#include <sys/mman.h>   // shm_open(), mmap()
+#include <sys/stat.h>   // fstat()
+#include <sys/socket.h>
+#include <new>          // placement new
+#include <time.h>       // nanosleep()
+#if defined(__linux__)
+  #include <linux/futex.h>
+  #include <sys/syscall.h>
+#endif
+#include "rpcShm.h"
+#include "rpcInternal.h"
+
+#define RPC_SHM_MAGIC       ((uint32_t)0x50534d31) // "PSM1"
+#define RPC_SHM_CACHE_LINE  64
+
+//
+// Shared memory layout: CRpcShmSegment, then the client to server ring
+// data, then the server to client ring data.
+//
+// head and tail are running byte counts, so the ring is empty when they
+// are equal and full when they are ringSize apart. Each side bumps a
+// sequence number after moving its counter and wakes the other side only
+// if it announced that it is going to sleep.
+//
+struct CRpcShmRing
+{
+    alignas(RPC_SHM_CACHE_LINE) std::atomic<uint64_t> head;  // Bytes written, updated by the producer
+    alignas(RPC_SHM_CACHE_LINE) std::atomic<uint64_t> tail;  // Bytes read, updated by the consumer
+    alignas(RPC_SHM_CACHE_LINE) std::atomic<uint32_t> dataSeq;       // Futex word, bumped after every write
+    std::atomic<uint32_t> readerWaiting;
+    alignas(RPC_SHM_CACHE_LINE) std::atomic<uint32_t> spaceSeq;      // Futex word, bumped after every read
+    std::atomic<uint32_t> writerWaiting;
+};
+
+struct CRpcShmSegment
+{
+    uint32_t magic;
+    uint32_t ringSize;
+    std::atomic<uint32_t> clientClosed;
+    std::atomic<uint32_t> serverClosed;
+    CRpcShmRing rings[2]; // [0] client to server, [1] server to client
+};
+
+static const size_t RPC_SHM_DATA_OFFSET =
+    (sizeof(CRpcShmSegment) + RPC_SHM_CACHE_LINE - 1) & ~(size_t)(RPC_SHM_CACHE_LINE - 1);
+
+// Sleep until *addr != val, woken up or timed out
+static void FutexWait(std::atomic<uint32_t>* addr, uint32_t val, int timeoutMs)
+{
+#if defined(__linux__)
+    struct timespec ts = { timeoutMs / 1000, (long)(timeoutMs % 1000) * 1000000 };
+    syscall(SYS_futex, (uint32_t*)addr, FUTEX_WAIT, val, &ts, nullptr, 0);
+#else
+    // No cross-process futex, nap for a short time instead
+    (void)addr; (void)val;
+    struct timespec ts = { 0, (timeoutMs > 0 ? 100000 : 0) }; // 100 usec
+    nanosleep(&ts, nullptr);
+#endif
+}
+
+static void FutexWake(std::atomic<uint32_t>* addr)
+{
+#if defined(__linux__)
+    syscall(SYS_futex, (uint32_t*)addr, FUTEX_WAKE, INT_MAX, nullptr, nullptr, 0);
+#else
+    (void)addr;
+#endif
+}
+
+//
+// Class CRpcShmChannel
+//
+bool CRpcShmChannel::Create(int sock, uint32_t ringSize, std::string& name)
+{
+    if(ringSize < 4096 || (ringSize & (ringSize - 1)) != 0)
+    {
+        mError = "Ring size must be a power of 2 of at least 4096 bytes";
+        return false;
+    }
+
+    // The name only has to be unique on this host
+    static std::atomic<unsigned> counter(0);
+    name = "/protorpc." + std::to_string(getpid()) + "." + std::to_string(counter++);
+
+    int fd = shm_open(name.c_str(), O_RDWR | O_CREAT | O_EXCL, S_IRUSR | S_IWUSR);
+    if(fd < 0 && errno == EEXIST)
+    {
+        // Left behind by a dead process that had our pid
+        shm_unlink(name.c_str());
+        fd = shm_open(name.c_str(), O_RDWR | O_CREAT | O_EXCL, S_IRUSR | S_IWUSR);
+    }
+
+    if(fd < 0)
+    {
+        mError = "shm_open(" + name + ") failed: " + strerror(errno);
+        return false;
+    }
+
+    size_t size = RPC_SHM_DATA_OFFSET + 2 * (size_t)ringSize;
+    if(ftruncate(fd, size) != 0)
+    {
+        mError = "ftruncate(" + name + ") failed: " + strerror(errno);
+        close(fd);
+        shm_unlink(name.c_str());
+        return false;
+    }
+
+    bool res = Map(fd, size);
+    close(fd); // The mapping stays valid
+    if(!res)
+    {
+        shm_unlink(name.c_str());
+        return false;
+    }
+
+    // Initialize the new segment
+    new (mSegment) CRpcShmSegment();
+    mSegment->magic = RPC_SHM_MAGIC;
+    mSegment->ringSize = ringSize;
+
+    mIsClient = true;
+    mName = name;
+    mSock = sock;
+    mRingSize = ringSize;
+    mTxRing = &mSegment->rings[0];
+    mRxRing = &mSegment->rings[1];
+    mTxData = (u_char*)mSegment + RPC_SHM_DATA_OFFSET;
+    mRxData = mTxData + ringSize;
+    return true;
+}
+
+bool CRpcShmChannel::Open(int sock, const std::string& name)
+{
+    int fd = shm_open(name.c_str(), O_RDWR, 0);
+    if(fd < 0)
+    {
+        mError = "shm_open(" + name + ") failed: " + strerror(errno);
+        return false;
+    }
+
+    struct stat st;
+    if(fstat(fd, &st) != 0 || (size_t)st.st_size < RPC_SHM_DATA_OFFSET)
+    {
+        mError = "Invalid shared memory segment " + name;
+        close(fd);
+        return false;
+    }
+
+    bool res = Map(fd, (size_t)st.st_size);
+    close(fd); // The mapping stays valid
+    if(!res)
+        return false;
+
+    uint32_t ringSize = mSegment->ringSize;
+    if(mSegment->magic != RPC_SHM_MAGIC || ringSize == 0 || (ringSize & (ringSize - 1)) != 0 ||
+       (size_t)st.st_size < RPC_SHM_DATA_OFFSET + 2 * (size_t)ringSize)
+    {
+        // Not ours to tell anything, and the rings aren't set up to Close()
+        mError = "Invalid shared memory segment " + name;
+        munmap(mSegment, mSegmentSize);
+        mSegment = nullptr;
+        mSegmentSize = 0;
+        return false;
+    }
+
+    mIsClient = false;
+    mSock = sock;
+    mRingSize = ringSize;
+    mRxRing = &mSegment->rings[0];
+    mTxRing = &mSegment->rings[1];
+    mRxData = (u_char*)mSegment + RPC_SHM_DATA_OFFSET;
+    mTxData = mRxData + ringSize;
+    return true;
+}
+
+bool CRpcShmChannel::Map(int fd, size_t size)
+{
+    void* ptr = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if(ptr == MAP_FAILED)
+    {
+        mError = std::string("mmap() failed: ") + strerror(errno);
+        return false;
+    }
+
+    mSegment = (CRpcShmSegment*)ptr;
+    mSegmentSize = size;
+    return true;
+}
+
+void CRpcShmChannel::Unlink()
+{
+    // Both sides have it mapped now, the name is not needed anymore
+    if(!mName.empty())
+    {
+        shm_unlink(mName.c_str());
+        mName.clear();
+    }
+}
+
+void CRpcShmChannel::Close()
+{
+    if(mSegment == nullptr)
+        return;
+
+    // Tell the peer and wake it up if it is waiting on us
+    (mIsClient ? mSegment->clientClosed : mSegment->serverClosed).store(1);
+    mTxRing->dataSeq.fetch_add(1);
+    FutexWake(&mTxRing->dataSeq);
+    mRxRing->spaceSeq.fetch_add(1);
+    FutexWake(&mRxRing->spaceSeq);
+
+    Unlink();
+    munmap(mSegment, mSegmentSize);
+
+    mSegment = nullptr;
+    mSegmentSize = 0;
+    mTxRing = mRxRing = nullptr;
+    mTxData = mRxData = nullptr;
+    mSock = -1;
+}
+
+void CRpcShmChannel::Interrupt(bool writers /*= true*/)
+{
+    mInterrupted = true;
+    if(writers)
+        mInterruptedWrites = true;
+    if(mSegment == nullptr)
+        return;
+
+    // Wake up this end where it sleeps, it sees the flags then
+    mRxRing->dataSeq.fetch_add(1);
+    FutexWake(&mRxRing->dataSeq);
+    if(writers)
+    {
+        mTxRing->spaceSeq.fetch_add(1);
+        FutexWake(&mTxRing->spaceSeq);
+    }
+}
+
+bool CRpcShmChannel::IsPeerAlive()
+{
+    if((mIsClient ? mSegment->serverClosed : mSegment->clientClosed).load() != 0)
+        return false;
+
+    // Nothing is sent over the socket after the setup, so if it
+    // becomes readable the peer is gone.
+    struct pollfd pfd;
+    pfd.fd = mSock;
+    pfd.events = POLLIN;
+    pfd.revents = 0;
+
+    if(poll(&pfd, 1, 0) > 0)
+    {
+        char c;
+        if((pfd.revents & (POLLERR | POLLHUP)) || recv(mSock, &c, 1, MSG_PEEK) <= 0)
+            return false;
+    }
+
+    return true;
+}
+
+template<class COND>
+int CRpcShmChannel::Wait(std::atomic<uint32_t>& seq, std::atomic<uint32_t>& waiting, COND cond,
+                         CRpcFrame::deadline_t deadline, const std::atomic<bool>* interrupted)
+{
+    // Spinning only helps if the peer can run on another CPU at the same time
+    static const bool multiCpu = (sysconf(_SC_NPROCESSORS_ONLN) > 1);
+
+    for(int i = 0; multiCpu && i < mSpinCount; i++)
+    {
+        if(cond())
+            return 1;
+    }
+
+    while(true)
+    {
+        // Announce that we are going to sleep, then re-check the condition.
+        // The peer bumps seq before checking waiting, so the wake-up can't be missed.
+        waiting.store(1);
+        uint32_t val = seq.load();
+
+        if(cond())
+        {
+            waiting.store(0);
+            return 1;
+        }
+
+        if(interrupted != nullptr && interrupted->load())
+        {
+            waiting.store(0);
+            return 0;
+        }
+
+        if(!IsPeerAlive())
+        {
+            waiting.store(0);
+            return -1;
+        }
+
+        // Sleep in slices of at most a second to check on the peer
+        int timeoutMs = 1000;
+        if(deadline != CRpcFrame::NoDeadline())
+        {
+            auto left = std::chrono::duration_cast<std::chrono::milliseconds>(
+                            deadline - std::chrono::steady_clock::now()).count();
+            if(left <= 0)
+            {
+                waiting.store(0);
+                return (cond() ? 1 : 0);
+            }
+            if(left < timeoutMs)
+                timeoutMs = (int)left;
+        }
+
+        FutexWait(&seq, val, timeoutMs);
+        waiting.store(0);
+
+        if(cond())
+            return 1;
+    }
+}
+
+int CRpcShmChannel::WriteBytes(const struct iovec* iov, int iovcnt, CRpcFrame::deadline_t deadline)
+{
+    CRpcShmRing* ring = mTxRing;
+    int part = 0;
+    size_t partOffset = 0; // Bytes of iov[part] already copied
+    bool started = false;  // Part of the frame is published
+
+    while(true)
+    {
+        // Skip empty and completed segments
+        while(part < iovcnt && partOffset >= iov[part].iov_len)
+        {
+            part++;
+            partOffset = 0;
+        }
+
+        if(part >= iovcnt)
+            break;
+
+        uint64_t head = ring->head.load(std::memory_order_relaxed);
+        auto hasSpace = [&]() { return (head - ring->tail.load(std::memory_order_acquire) < mRingSize); };
+
+        if(!hasSpace())
+        {
+            // Once the reader can see part of the frame the rest is waited
+            // for whatever the deadline, or the stream would be out of sync
+            int res = Wait(ring->spaceSeq, ring->writerWaiting, hasSpace,
+                           (started ? CRpcFrame::NoDeadline() : deadline), &mInterruptedWrites);
+            if(res <= 0)
+                return res;
+        }
+
+        // Copy as much as fits, in up to two pieces around the end of the ring
+        uint64_t tail = ring->tail.load(std::memory_order_acquire);
+        size_t space = mRingSize - (size_t)(head - tail);
+        while(space > 0 && part < iovcnt)
+        {
+            size_t offset = (size_t)(head & (mRingSize - 1));
+            size_t len = iov[part].iov_len - partOffset;
+            if(len > space)
+                len = space;
+            if(len > mRingSize - offset)
+                len = mRingSize - offset;
+
+            memcpy(mTxData + offset, (const u_char*)iov[part].iov_base + partOffset, len);
+            head += len;
+            space -= len;
+            partOffset += len;
+
+            while(part < iovcnt && partOffset >= iov[part].iov_len)
+            {
+                part++;
+                partOffset = 0;
+            }
+        }
+
+        // Publish and wake up the reader if it is sleeping
+        ring->head.store(head, std::memory_order_release);
+        started = true;
+        ring->dataSeq.fetch_add(1);
+        if(ring->readerWaiting.load() != 0)
+            FutexWake(&ring->dataSeq);
+    }
+
+    return 1;
+}
+
+int CRpcShmChannel::ReadBytes(void* buf, size_t len, CRpcFrame::deadline_t deadline, bool interruptible)
+{
+    CRpcShmRing* ring = mRxRing;
+    u_char* ptr = (u_char*)buf;
+
+    while(len > 0)
+    {
+        uint64_t tail = ring->tail.load(std::memory_order_relaxed);
+        auto hasData = [&]() { return (ring->head.load(std::memory_order_acquire) != tail); };
+
+        if(!hasData())
+        {
+            // Once the first byte is taken the rest is waited for whatever
+            // happens, or the stream would be out of sync
+            bool started = (ptr != (u_char*)buf);
+            int res = Wait(ring->dataSeq, ring->readerWaiting, hasData,
+                           (started ? CRpcFrame::NoDeadline() : deadline),
+                           (interruptible && !started ? &mInterrupted : nullptr));
+            if(res <= 0)
+                return res;
+        }
+
+        uint64_t head = ring->head.load(std::memory_order_acquire);
+        while(len > 0 && tail != head)
+        {
+            size_t offset = (size_t)(tail & (mRingSize - 1));
+            size_t n = (size_t)(head - tail);
+            if(n > len)
+                n = len;
+            if(n > mRingSize - offset)
+                n = mRingSize - offset;
+
+            memcpy(ptr, mRxData + offset, n);
+            tail += n;
+            ptr += n;
+            len -= n;
+        }
+
+        // Release the space and wake up the writer if it is sleeping
+        ring->tail.store(tail, std::memory_order_release);
+        ring->spaceSeq.fetch_add(1);
+        if(ring->writerWaiting.load() != 0)
+            FutexWake(&ring->spaceSeq);
+    }
+
+    return 1;
+}
+
+bool CRpcShmChannel::Write(const CRpcFrameHeader& hdr, const void* data, size_t len, CRpcFrame::deadline_t deadline)
+{
+    struct iovec iov;
+    iov.iov_base = (void*)data;
+    iov.iov_len = (data != nullptr ? len : 0);
+    return Write(hdr, &iov, 1, deadline);
+}
+
+bool CRpcShmChannel::Write(const CRpcFrameHeader& hdr, const struct iovec* iov, int iovcnt, CRpcFrame::deadline_t deadline)
+{
+    if(mSegment == nullptr)
+    {
+        errno = ENOTCONN;
+        return false;
+    }
+
+    if(iovcnt < 0 || iovcnt > RPC_MAX_IOV)
+    {
+        errno = EINVAL;
+        return false;
+    }
+
+    unsigned char hdrBuf[CRpcFrame::HEADER_SIZE];
+    CRpcFrame::EncodeHeader(hdr, hdrBuf);
+
+    // The header and the segments are copied in one pass. The deadline
+    // only holds until the first of them is published.
+    struct iovec vec[RPC_MAX_IOV + 1];
+    vec[0].iov_base = hdrBuf;
+    vec[0].iov_len = sizeof(hdrBuf);
+    for(int i = 0; i < iovcnt; i++)
+        vec[i + 1] = iov[i];
+
+    int res = WriteBytes(vec, iovcnt + 1, deadline);
+    if(res <= 0)
+    {
+        errno = (res == 0 ? ETIMEDOUT : ECONNRESET);
+        return false;
+    }
+
+    return true;
+}
+
+int CRpcShmChannel::Read(CRpcFrameHeader& hdr, std::vector<u_char>& buf, CRpcFrame::deadline_t deadline)
+{
+    if(mSegment == nullptr)
+    {
+        errno = ENOTCONN;
+        return -1;
+    }
+
+    unsigned char hdrBuf[CRpcFrame::HEADER_SIZE];
+
+    int res = ReadBytes(hdrBuf, sizeof(hdrBuf), deadline, true);
+    if(res <= 0)
+    {
+        errno = (res == 0 ? ETIMEDOUT : ECONNRESET);
+        return res;
+    }
+
+    if(!CRpcFrame::DecodeHeader(hdrBuf, hdr))
+        return -2;
+
+    if(buf.size() < hdr.length)
+        buf.resize(hdr.length);
+
+    // Note: Once the header is in, the rest of the frame is on its way,
+    // so wait for it without a deadline, or an interrupt, to keep the
+    // stream in sync.
+    res = (hdr.length > 0 ? ReadBytes(buf.data(), hdr.length, CRpcFrame::NoDeadline(), false) : 1);
+    if(res < 0)
+        errno = ECONNRESET;
+    return res;
+}
+
+
+//
+// Class CRpcShmTransport
+//
+bool CRpcShmTransport::Connect(const struct sockaddr* addr, socklen_t addrLen, CRpcFrame::deadline_t deadline)
+{
+    if(!CRpcNativeTransport::Connect(addr, addrLen, deadline))
+        return false;
+
+    if(!Setup(deadline))
+    {
+        if(!IsValid())
+            return false; // No reply in time, the socket was closed
+
+        INFOMSG("CRpcShmTransport", "Shared memory is not available, using the socket");
+    }
+
+    return true;
+}
+
+bool CRpcShmTransport::Setup(CRpcFrame::deadline_t deadline)
+{
+    std::string name;
+    if(!mChannel.Create(mSock, RPC_SHM_RING_SIZE, name))
+    {
+        ERRMSG("CRpcShmTransport", mChannel.GetError());
+        return false;
+    }
+
+    mChannel.SetSpinCount(mSpinCount);
+
+    // Ask the server to map the segment and switch to it
+    CRpcFrameHeader hdr;
+    hdr.reqId = mNextReqId++;
+    hdr.flags = RPC_FRAME_FLAG_SHM;
+    hdr.length = (uint32_t)name.size();
+
+    CRpcFrameHeader reply;
+    u_char* payload = nullptr;
+    int res = -1;
+    if(CRpcFrame::Write(mSock, hdr, name.data(), name.size()))
+        res = mReader.Next(mSock, reply, payload, deadline);
+
+    // Either way the server is done with the name
+    mChannel.Unlink();
+
+    if(res <= 0 || reply.reqId != hdr.reqId || !(reply.flags & RPC_FRAME_FLAG_REPLY))
+    {
+        ERRMSG("CRpcShmTransport", "Failed to set up shared memory with the server");
+        mChannel.Close();
+        CRpcNativeTransport::Close(); // The stream is out of sync
+        return false;
+    }
+
+    if(reply.flags & RPC_FRAME_FLAG_ERROR)
+    {
+        // The server couldn't map the segment or doesn't support it
+        mChannel.Close();
+        return false;
+    }
+
+    return true;
+}
+
+void CRpcShmTransport::Close()
+{
+    mChannel.Close();
+    CRpcNativeTransport::Close();
+}
+
+clnt_stat CRpcShmTransport::Send(CRpc::param* in, uint32_t& reqId, const struct timeval& timeout)
+{
+    if(!mChannel.IsValid())
+        return CRpcNativeTransport::Send(in, reqId, timeout);
+
+    CRpcFrameHeader hdr;
+    hdr.type = (uint32_t)in->type;
+    hdr.reqId = mNextReqId++;
+    hdr.length = in->data_len;
+
+    if(!mChannel.Write(hdr, in, CRpcFrame::Deadline(timeout)))
+    {
+        ERRMSG("CRpcShmTransport", "Failed to send request: " << strerror(errno));
+        return (errno == ETIMEDOUT ? RPC_TIMEDOUT : RPC_CANTSEND);
+    }
+
+    reqId = hdr.reqId;
+    return RPC_SUCCESS;
+}
+
+int CRpcShmTransport::ReadFrame(CRpcFrameHeader& hdr, u_char*& payload, CRpcFrame::deadline_t deadline)
+{
+    if(!mChannel.IsValid())
+        return CRpcNativeTransport::ReadFrame(hdr, payload, deadline);
+
+    int res = mChannel.Read(hdr, mRecvBuf, deadline);
+    payload = (res > 0 && hdr.length > 0 ? mRecvBuf.data() : nullptr);
+    return res;
+}
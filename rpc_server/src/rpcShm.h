@@ -0,0 +1,133 @@
+//
+//  rpcShm.h
+//
+#ifndef __RPC_SHM_H__
+#define __RPC_SHM_H__
+
+#include <atomic>
+#include <string>
+#include "rpcTransport.h"
+
+#define RPC_SHM_RING_SIZE   ((uint32_t)1 << 20) // Default size of each ring
+
+struct CRpcShmSegment;
+struct CRpcShmRing;
+
+//
+// Class CRpcShmChannel
+//
+// One end of a shared memory connection: a pair of lock-free single
+// producer/single consumer byte rings in a shared memory segment, one per
+// direction. Native frames are streamed through the rings, so messages
+// larger than a ring are fine. A waiting side spins for a while and then
+// sleeps on a futex in the ring (on Linux; elsewhere it naps in short
+// sleeps). The socket the connection was set up over stays open to detect
+// a peer that died without closing the channel.
+//
+class CRpcShmChannel
+{
+public:
+    CRpcShmChannel() = default;
+    ~CRpcShmChannel() { Close(); }
+
+    CRpcShmChannel(const CRpcShmChannel&) = delete;
+    CRpcShmChannel& operator=(const CRpcShmChannel&) = delete;
+
+    // Client side: create and map a new segment. The name is then sent to the server.
+    bool Create(int sock, uint32_t ringSize, std::string& name);
+
+    // Server side: map the segment created by the client
+    bool Open(int sock, const std::string& name);
+
+    // Called by the client once the server has mapped the segment
+    void Unlink();
+
+    // Tell the peer we are gone and unmap the segment
+    void Close();
+    bool IsValid() const { return (mSegment != nullptr); }
+
+    // Number of times to poll the ring before going to sleep
+    void SetSpinCount(int spinCount) { mSpinCount = spinCount; }
+
+    // From any thread: a Read waiting for the next frame on this end, or any
+    // later one that would have to wait, returns 0 as if it timed out. A
+    // frame that has started to arrive is still read whole, so the stream
+    // stays in sync and the channel can go on being read. With writers, a
+    // Write that waits for room fails too (the channel is done then).
+    void Interrupt(bool writers = true);
+
+    // Same return values as CRpcFrame::Write and CRpcFrame::Read. Write
+    // only times out before any of the frame is in the ring: once the peer
+    // can see part of it, it waits for room for the rest (as long as the
+    // peer is alive and it isn't interrupted).
+    bool Write(const CRpcFrameHeader& hdr, const void* data, size_t len, CRpcFrame::deadline_t deadline);
+    bool Write(const CRpcFrameHeader& hdr, const struct iovec* iov, int iovcnt, CRpcFrame::deadline_t deadline);
+    bool Write(const CRpcFrameHeader& hdr, const CRpc::param* pr, CRpcFrame::deadline_t deadline)
+    {
+        return (pr->data_iov != nullptr ? Write(hdr, pr->data_iov, pr->data_iovcnt, deadline) :
+                                          Write(hdr, pr->data_val, pr->data_len, deadline));
+    }
+    int Read(CRpcFrameHeader& hdr, std::vector<u_char>& buf, CRpcFrame::deadline_t deadline);
+
+    const char* GetError() const { return mError.c_str(); }
+
+private:
+    CRpcShmSegment* mSegment = nullptr;
+    size_t mSegmentSize = 0;
+    CRpcShmRing* mTxRing = nullptr;
+    CRpcShmRing* mRxRing = nullptr;
+    u_char* mTxData = nullptr;
+    u_char* mRxData = nullptr;
+    uint32_t mRingSize = 0;
+    bool mIsClient = false;
+    int mSock = -1;
+    int mSpinCount = 0;
+    std::atomic<bool> mInterrupted{false};      // Readers, see Interrupt
+    std::atomic<bool> mInterruptedWrites{false};
+    std::string mName;
+    std::string mError;
+
+    bool Map(int fd, size_t size);
+    bool IsPeerAlive();
+    int WriteBytes(const struct iovec* iov, int iovcnt, CRpcFrame::deadline_t deadline);
+    int ReadBytes(void* buf, size_t len, CRpcFrame::deadline_t deadline, bool interruptible);
+
+    // interrupted is the flag that makes it return 0, nullptr for none
+    template<class COND>
+    int Wait(std::atomic<uint32_t>& seq, std::atomic<uint32_t>& waiting, COND cond, CRpcFrame::deadline_t deadline,
+             const std::atomic<bool>* interrupted);
+};
+
+//
+// Class CRpcShmTransport
+//
+// Native framing over a CRpcShmChannel. The channel is set up over a
+// native socket connection. If that fails (the server is on another host,
+// runs as a different user or doesn't support it), the transport keeps
+// using native framing over the socket.
+//
+class CRpcShmTransport : public CRpcNativeTransport
+{
+public:
+    CRpcShmTransport(CRpc* owner) : CRpcNativeTransport(owner) {}
+    virtual ~CRpcShmTransport() { Close(); }
+
+    virtual bool Connect(const struct sockaddr* addr, socklen_t addrLen, CRpcFrame::deadline_t deadline);
+    virtual void Close();
+
+    virtual clnt_stat Send(CRpc::param* in, uint32_t& reqId, const struct timeval& timeout);
+
+    virtual void SetSpinCount(int spinCount) { mSpinCount = spinCount; mChannel.SetSpinCount(spinCount); }
+
+protected:
+    virtual int ReadFrame(CRpcFrameHeader& hdr, u_char*& payload, CRpcFrame::deadline_t deadline);
+
+private:
+    CRpcShmChannel mChannel;
+    int mSpinCount = 0;
+    std::vector<u_char> mRecvBuf;  // Reused for every reply
+
+    bool Setup(CRpcFrame::deadline_t deadline);
+};
+
+#endif // __RPC_SHM_H__
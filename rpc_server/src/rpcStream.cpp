@@ -0,0 +1,87 @@
+//
+//  rpcStream.cpp
+//
+#include <limits.h>     // INT_MAX
+#include "rpcStream.h"
+
+//
+// Class CRpcInputStream
+//
+CRpcInputStream::CRpcInputStream(const struct iovec* iov, int iovcnt)
+    : mIov(iov), mIovCount(iovcnt)
+{
+    mSingle.iov_base = nullptr;
+    mSingle.iov_len = 0;
+}
+
+CRpcInputStream::CRpcInputStream(const CRpc::param* pr)
+{
+    mSingle.iov_base = pr->data_val;
+    mSingle.iov_len = (pr->data_val != nullptr ? pr->data_len : 0);
+
+    if(pr->data_iov != nullptr)
+    {
+        mIov = pr->data_iov;
+        mIovCount = pr->data_iovcnt;
+    }
+    else
+    {
+        mIov = &mSingle;
+        mIovCount = 1;
+    }
+}
+
+bool CRpcInputStream::Next(const void** data, int* size)
+{
+    // Skip empty segments
+    while(mIndex < mIovCount && mOffset >= mIov[mIndex].iov_len)
+    {
+        mIndex++;
+        mOffset = 0;
+    }
+
+    if(mIndex >= mIovCount)
+        return false;
+
+    size_t len = mIov[mIndex].iov_len - mOffset;
+    if(len > INT_MAX)
+        len = INT_MAX;
+
+    *data = (const char*)mIov[mIndex].iov_base + mOffset;
+    *size = (int)len;
+
+    mOffset += len;
+    mByteCount += len;
+    return true;
+}
+
+void CRpcInputStream::BackUp(int count)
+{
+    // Only valid right after Next(), so the bytes are in the current segment
+    mOffset -= count;
+    mByteCount -= count;
+}
+
+bool CRpcInputStream::Skip(int count)
+{
+    while(count > 0)
+    {
+        if(mIndex >= mIovCount)
+            return false;
+
+        size_t left = mIov[mIndex].iov_len - mOffset;
+        if((size_t)count < left)
+        {
+            mOffset += count;
+            mByteCount += count;
+            return true;
+        }
+
+        count -= (int)left;
+        mByteCount += left;
+        mIndex++;
+        mOffset = 0;
+    }
+
+    return true;
+}
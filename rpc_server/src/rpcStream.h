@@ -0,0 +1,42 @@
+//
+//  rpcStream.h
+//
+#ifndef __RPC_STREAM_H__
+#define __RPC_STREAM_H__
+
+#include <google/protobuf/io/zero_copy_stream.h>
+#include "rpc.h"
+
+//
+// Class CRpcInputStream
+//
+// Read-only protobuf ZeroCopyInputStream over a segmented payload, so a
+// message can be parsed straight from the segments without joining them:
+//
+//     CRpcInputStream stream(in);
+//     req.ParseFromZeroCopyStream(&stream);
+//
+// The segments are not copied and must outlive the stream.
+//
+class CRpcInputStream : public google::protobuf::io::ZeroCopyInputStream
+{
+public:
+    CRpcInputStream(const struct iovec* iov, int iovcnt);
+    CRpcInputStream(const CRpc::param* pr); // data_iov if set, data_val otherwise
+    virtual ~CRpcInputStream() = default;
+
+    virtual bool Next(const void** data, int* size);
+    virtual void BackUp(int count);
+    virtual bool Skip(int count);
+    virtual int64_t ByteCount() const { return mByteCount; }
+
+private:
+    struct iovec mSingle;               // data_val as a segment
+    const struct iovec* mIov = nullptr;
+    int mIovCount = 0;
+    int mIndex = 0;                     // Segment to return by the next Next()
+    size_t mOffset = 0;                 // Offset in that segment
+    int64_t mByteCount = 0;
+};
+
+#endif // __RPC_STREAM_H__
@@ -0,0 +1,800 @@
+//
+//  rpcTransport.cpp
+//
+#include <stdio.h>
+#include <memory.h>
+#include <unistd.h>     // close()
+#include <errno.h>
+#include <fcntl.h>      // fcntl()
+#include <poll.h>
+#include <sys/uio.h>    // iovec
+#include <netinet/in.h>
+#include <sys/un.h>     // sockaddr_un
+#include <netinet/tcp.h>
+#include <arpa/inet.h>  // htonl()
+#include <atomic>
+#include <thread>
+#include "rpcTransport.h"
+#include "rpcInternal.h"
+
+//
+// Class CRpcFrame
+//
+static std::atomic<uint32_t> sMaxFrameSize(RPC_MAX_FRAME_SIZE);
+
+void CRpcFrame::SetMaxFrameSize(uint32_t maxSize)
+{
+    sMaxFrameSize = maxSize;
+}
+
+uint32_t CRpcFrame::MaxFrameSize()
+{
+    return sMaxFrameSize;
+}
+
+CRpcFrame::deadline_t CRpcFrame::Deadline(const struct timeval& timeout)
+{
+    return std::chrono::steady_clock::now() +
+           std::chrono::seconds(timeout.tv_sec) + std::chrono::microseconds(timeout.tv_usec);
+}
+
+void CRpcFrame::EncodeHeader(const CRpcFrameHeader& hdr, unsigned char* buf)
+{
+    uint32_t* p = (uint32_t*)buf;
+    p[0] = htonl(hdr.magic);
+    p[1] = htonl(hdr.type);
+    p[2] = htonl(hdr.reqId);
+    p[3] = htonl(hdr.flags);
+    p[4] = htonl(hdr.length);
+}
+
+bool CRpcFrame::DecodeHeader(const unsigned char* buf, CRpcFrameHeader& hdr)
+{
+    const uint32_t* p = (const uint32_t*)buf;
+    hdr.magic = ntohl(p[0]);
+    hdr.type = ntohl(p[1]);
+    hdr.reqId = ntohl(p[2]);
+    hdr.flags = ntohl(p[3]);
+    hdr.length = ntohl(p[4]);
+
+    // Checked before anything is allocated for the payload
+    return (hdr.magic == RPC_FRAME_MAGIC && hdr.length <= sMaxFrameSize.load(std::memory_order_relaxed));
+}
+
+bool CRpcFrame::Write(int fd, const CRpcFrameHeader& hdr, const void* data, size_t len)
+{
+    struct iovec iov;
+    iov.iov_base = (void*)data;
+    iov.iov_len = (data != nullptr ? len : 0);
+    return Write(fd, hdr, &iov, 1);
+}
+
+bool CRpcFrame::Write(int fd, const CRpcFrameHeader& hdr, const struct iovec* iov, int iovcnt)
+{
+    if(iovcnt < 0 || iovcnt > RPC_MAX_IOV)
+    {
+        errno = EINVAL;
+        return false;
+    }
+
+    uint32_t hdrBuf[HEADER_SIZE / sizeof(uint32_t)];
+    EncodeHeader(hdr, (unsigned char*)hdrBuf);
+
+    // The header and the payload segments go out with one sendmsg().
+    // Copy the segments, since a partial send updates them.
+    struct iovec vec[RPC_MAX_IOV + 1];
+    vec[0].iov_base = hdrBuf;
+    vec[0].iov_len = HEADER_SIZE;
+
+    int count = 1;
+    for(int i = 0; i < iovcnt; i++)
+    {
+        if(iov[i].iov_len > 0)
+            vec[count++] = iov[i];
+    }
+
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = vec;
+    msg.msg_iovlen = count;
+
+    while(msg.msg_iovlen > 0)
+    {
+        ssize_t res = sendmsg(fd, &msg, RPC_SEND_FLAGS);
+        if(res < 0)
+        {
+            if(errno == EINTR)
+                continue;
+            return false;
+        }
+
+        // Skip what has been sent and send the rest
+        size_t sent = (size_t)res;
+        while(msg.msg_iovlen > 0 && sent >= msg.msg_iov->iov_len)
+        {
+            sent -= msg.msg_iov->iov_len;
+            msg.msg_iov++;
+            msg.msg_iovlen--;
+        }
+        if(msg.msg_iovlen > 0)
+        {
+            msg.msg_iov->iov_base = (char*)msg.msg_iov->iov_base + sent;
+            msg.msg_iov->iov_len -= sent;
+        }
+    }
+
+    return true;
+}
+
+int CRpcFrame::ReadFull(int fd, void* buf, size_t len, deadline_t deadline)
+{
+    char* ptr = (char*)buf;
+
+    while(len > 0)
+    {
+        if(deadline != NoDeadline())
+        {
+            auto left = std::chrono::duration_cast<std::chrono::milliseconds>(
+                            deadline - std::chrono::steady_clock::now()).count();
+            if(left <= 0)
+                return 0;
+
+            struct pollfd pfd;
+            pfd.fd = fd;
+            pfd.events = POLLIN;
+            pfd.revents = 0;
+
+            int res = poll(&pfd, 1, (left > 0x7fffffff ? 0x7fffffff : (int)left));
+            if(res < 0 && errno != EINTR)
+                return -1;
+            if(res <= 0)
+                continue; // Interrupted or timed out, re-check the deadline
+        }
+
+        ssize_t res = recv(fd, ptr, len, 0);
+        if(res < 0)
+        {
+            if(errno == EINTR)
+                continue;
+            return -1;
+        }
+        else if(res == 0)
+        {
+            errno = ECONNRESET;
+            return -1; // The peer disconnected
+        }
+
+        ptr += res;
+        len -= (size_t)res;
+    }
+
+    return 1;
+}
+
+int CRpcFrame::Read(int fd, CRpcFrameHeader& hdr, std::vector<u_char>& buf, deadline_t deadline)
+{
+    unsigned char hdrBuf[HEADER_SIZE];
+
+    int res = ReadFull(fd, hdrBuf, HEADER_SIZE, deadline);
+    if(res <= 0)
+        return res;
+
+    if(!DecodeHeader(hdrBuf, hdr))
+        return -2;
+
+    if(buf.size() < hdr.length)
+        buf.resize(hdr.length);
+
+    return (hdr.length > 0 ? ReadFull(fd, buf.data(), hdr.length, deadline) : 1);
+}
+
+
+//
+// Class CRpcFrameReader
+//
+bool CRpcFrameReader::HasFrame() const
+{
+    if(mEnd - mStart < CRpcFrame::HEADER_SIZE)
+        return false;
+
+    CRpcFrameHeader hdr;
+    if(!CRpcFrame::DecodeHeader(mBuf.data() + mStart, hdr))
+        return true; // Let Next() report it
+
+    return (mEnd - mStart >= CRpcFrame::HEADER_SIZE + hdr.length);
+}
+
+int CRpcFrameReader::Next(int fd, CRpcFrameHeader& hdr, u_char*& payload, CRpcFrame::deadline_t deadline)
+{
+    while(mEnd - mStart < CRpcFrame::HEADER_SIZE)
+    {
+        int res = Fill(fd, CRpcFrame::HEADER_SIZE, deadline);
+        if(res <= 0)
+            return res;
+    }
+
+    if(!CRpcFrame::DecodeHeader(mBuf.data() + mStart, hdr))
+        return -2;
+
+    size_t frameLen = CRpcFrame::HEADER_SIZE + (size_t)hdr.length;
+    while(mEnd - mStart < frameLen)
+    {
+        int res = Fill(fd, frameLen, deadline);
+        if(res <= 0)
+            return res;
+    }
+
+    payload = (hdr.length > 0 ? mBuf.data() + mStart + CRpcFrame::HEADER_SIZE : nullptr);
+    mStart += frameLen;
+    return 1;
+}
+
+int CRpcFrameReader::Fill(int fd, size_t need, CRpcFrame::deadline_t deadline)
+{
+    // Make room for the whole frame after mStart
+    if(mStart + need > mBuf.size())
+    {
+        if(mStart > 0)
+        {
+            memmove(mBuf.data(), mBuf.data() + mStart, mEnd - mStart);
+            mEnd -= mStart;
+            mStart = 0;
+        }
+
+        if(need > mBuf.size())
+            mBuf.resize(need > mBufferSize ? need : mBufferSize);
+    }
+    else if(mStart == mEnd)
+    {
+        mStart = mEnd = 0; // Everything has been read, start over
+    }
+
+    while(true)
+    {
+        if(deadline != CRpcFrame::NoDeadline())
+        {
+            auto left = std::chrono::duration_cast<std::chrono::milliseconds>(
+                            deadline - std::chrono::steady_clock::now()).count();
+            if(left <= 0)
+                return 0;
+
+            struct pollfd pfd;
+            pfd.fd = fd;
+            pfd.events = POLLIN;
+            pfd.revents = 0;
+
+            int res = poll(&pfd, 1, (left > 0x7fffffff ? 0x7fffffff : (int)left));
+            if(res < 0 && errno != EINTR)
+                return -1;
+            if(res <= 0)
+                continue; // Interrupted or timed out, re-check the deadline
+        }
+
+        // Take whatever is there, up to the end of the buffer
+        ssize_t res = recv(fd, mBuf.data() + mEnd, mBuf.size() - mEnd, 0);
+        if(res < 0)
+        {
+            if(errno == EINTR)
+                continue;
+            if(errno == EAGAIN || errno == EWOULDBLOCK)
+                return 0; // Non-blocking socket, nothing more for now
+            return -1;
+        }
+        else if(res == 0)
+        {
+            errno = ECONNRESET;
+            return -1; // The peer disconnected
+        }
+
+        mEnd += (size_t)res;
+        return 1;
+    }
+}
+
+
+//
+// Class CRpcFrameWriter
+//
+bool CRpcFrameWriter::Add(int fd, const CRpcFrameHeader& hdr, const CRpc::param* pr)
+{
+    size_t frameLen = CRpcFrame::HEADER_SIZE + (size_t)hdr.length;
+    if(Pending() + frameLen > RPC_WRITE_BUFFER_SIZE && !Flush(fd))
+        return false;
+
+    // Large frames aren't worth copying
+    if(frameLen > RPC_WRITE_BUFFER_SIZE)
+        return CRpcFrame::Write(fd, hdr, pr);
+
+    Append(hdr, pr);
+    return true;
+}
+
+void CRpcFrameWriter::Append(const CRpcFrameHeader& hdr, const CRpc::param* pr)
+{
+    size_t frameLen = CRpcFrame::HEADER_SIZE + (size_t)hdr.length;
+    size_t offset = mBuf.size();
+    mBuf.resize(offset + frameLen);
+    CRpcFrame::EncodeHeader(hdr, mBuf.data() + offset);
+    offset += CRpcFrame::HEADER_SIZE;
+
+    if(pr == nullptr)
+    {
+        // No payload
+    }
+    else if(pr->data_iov != nullptr)
+    {
+        for(int i = 0; i < pr->data_iovcnt; i++)
+        {
+            memcpy(mBuf.data() + offset, pr->data_iov[i].iov_base, pr->data_iov[i].iov_len);
+            offset += pr->data_iov[i].iov_len;
+        }
+    }
+    else if(pr->data_val != nullptr)
+    {
+        memcpy(mBuf.data() + offset, pr->data_val, pr->data_len);
+    }
+}
+
+void CRpcFrameWriter::Append(CRpcFrameWriter& other)
+{
+    if(mBuf.empty())
+    {
+        // Nothing waiting here, swap the buffers (both keep their capacity)
+        mBuf.swap(other.mBuf);
+    }
+    else
+    {
+        mBuf.insert(mBuf.end(), other.mBuf.begin(), other.mBuf.end());
+        other.mBuf.clear();
+    }
+}
+
+bool CRpcFrameWriter::Flush(int fd)
+{
+    while(mSent < mBuf.size())
+    {
+        ssize_t res = send(fd, mBuf.data() + mSent, mBuf.size() - mSent, RPC_SEND_FLAGS);
+        if(res < 0)
+        {
+            if(errno == EINTR)
+                continue;
+            mBuf.clear();
+            mSent = 0;
+            return false;
+        }
+        mSent += (size_t)res;
+    }
+
+    mBuf.clear(); // Keeps the capacity
+    mSent = 0;
+    return true;
+}
+
+bool CRpcFrameWriter::Send(int fd)
+{
+    while(mSent < mBuf.size())
+    {
+        ssize_t res = send(fd, mBuf.data() + mSent, mBuf.size() - mSent, RPC_SEND_FLAGS);
+        if(res < 0)
+        {
+            if(errno == EINTR)
+                continue;
+            if(errno == EAGAIN || errno == EWOULDBLOCK)
+                return true; // The socket is full, the rest goes next time
+            return false;
+        }
+        mSent += (size_t)res;
+    }
+
+    mBuf.clear(); // Keeps the capacity
+    mSent = 0;
+    return true;
+}
+
+
+//
+// Class CRpcTransport
+//
+int CRpcTransport::ConnectSocket(const struct sockaddr* addr, socklen_t addrLen, CRpcFrame::deadline_t deadline)
+{
+    int sock = socket(addr->sa_family, SOCK_STREAM, 0);
+    if(sock < 0)
+    {
+        ERRMSG("CRpcTransport", "socket() failed: " << strerror(errno));
+        return -1;
+    }
+
+    // Connect without blocking, so a host that doesn't answer can't hold
+    // the caller past the deadline
+    int flags = fcntl(sock, F_GETFL, 0);
+    if(flags < 0 || fcntl(sock, F_SETFL, flags | O_NONBLOCK) < 0)
+    {
+        ERRMSG("CRpcTransport", "fcntl(O_NONBLOCK) failed: " << strerror(errno));
+        close(sock);
+        return -1;
+    }
+
+    int res = connect(sock, addr, addrLen);
+
+    // The backlog of a Unix domain socket is full, try again shortly
+    while(res != 0 && errno == EAGAIN && addr->sa_family == AF_UNIX &&
+          std::chrono::steady_clock::now() < deadline)
+    {
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        res = connect(sock, addr, addrLen);
+    }
+
+    if(res != 0 && (errno == EINPROGRESS || errno == EINTR))
+    {
+        // Wait for the handshake to complete
+        int err = ETIMEDOUT;
+        while(true)
+        {
+            auto left = std::chrono::duration_cast<std::chrono::milliseconds>(
+                            deadline - std::chrono::steady_clock::now()).count();
+            if(left <= 0)
+                break;
+
+            struct pollfd pfd;
+            pfd.fd = sock;
+            pfd.events = POLLOUT;
+            pfd.revents = 0;
+
+            int ready = poll(&pfd, 1, (left > 0x7fffffff ? 0x7fffffff : (int)left));
+            if(ready < 0 && errno != EINTR)
+            {
+                err = errno;
+                break;
+            }
+            if(ready <= 0)
+                continue; // Interrupted or timed out, re-check the deadline
+
+            socklen_t len = sizeof(err);
+            if(getsockopt(sock, SOL_SOCKET, SO_ERROR, &err, &len) < 0)
+                err = errno;
+            break;
+        }
+
+        res = (err == 0 ? 0 : -1);
+        errno = err;
+    }
+
+    if(res != 0)
+    {
+        ERRMSG("CRpcTransport", "connect() failed: " << strerror(errno));
+        close(sock);
+        return -1;
+    }
+
+    // Calls are made on a blocking socket
+    if(fcntl(sock, F_SETFL, flags) < 0)
+    {
+        ERRMSG("CRpcTransport", "fcntl() failed: " << strerror(errno));
+        close(sock);
+        return -1;
+    }
+
+    return sock;
+}
+
+clnt_stat CRpcTransport::Send(CRpc::param* /*in*/, uint32_t& /*reqId*/, const struct timeval& /*timeout*/)
+{
+    ERRMSG("CRpcTransport", "Pipelining is not supported by this transport");
+    return RPC_FAILED;
+}
+
+clnt_stat CRpcTransport::Receive(CRpc::param* /*out*/, uint32_t& /*reqId*/, const struct timeval& /*timeout*/)
+{
+    ERRMSG("CRpcTransport", "Pipelining is not supported by this transport");
+    return RPC_FAILED;
+}
+
+
+//
+// Class CRpcSunTransport
+//
+bool CRpcSunTransport::Connect(const struct sockaddr* addr, socklen_t addrLen, CRpcFrame::deadline_t deadline)
+{
+    if(cl != nullptr)
+    {
+        ERRMSG("CRpcSunTransport", "Failed - the CLIENT already exists");
+        return false;
+    }
+
+    if(!mCodecPinned)
+    {
+        mCodec = CRpc::CODEC::BULK;
+        mNegotiate = true;
+    }
+
+    if(addr->sa_family != AF_INET && addr->sa_family != AF_INET6 && addr->sa_family != AF_UNIX)
+    {
+        ERRMSG("CRpcSunTransport", "Unsupported address family " << addr->sa_family);
+        return false;
+    }
+
+#if defined(sun) || defined(__sun) // Solaris-specific support
+    if(addr->sa_family == AF_UNIX)
+    {
+        // Note: There is no clntunix_create on Solaris
+        ERRMSG("CRpcSunTransport", "Unix domain sockets are not supported by SunRPC on Solaris");
+        return false;
+    }
+#endif
+
+    // clnt*_create connects with no timeout, so give it a connected socket
+    int sock = ConnectSocket(addr, addrLen, deadline);
+    if(sock < 0)
+        return false;
+
+    rpcvers_t vers = (mCodec == CRpc::CODEC::BULK ? RPC_PROTOBUF_VERSION_BULK : RPC_PROTOBUF_VERSION);
+
+    if(addr->sa_family != AF_UNIX)
+    {
+        // Create RPC client for the remote program on the designated hostname/port.
+        // Note: The socket is already connected, so an IPv6 address is only
+        // kept for CLGET_SERVER_ADDR and never used to connect.
+        cl = clnttcp_create((struct sockaddr_in*)addr,
+                            RPC_PROTOBUF_PROG_NUMBER,   // program number
+                            vers,                       // version number
+                            &sock,                      // connected socket
+                            0,                          // send_buf_size
+                            0);                         // recv_buf_size
+
+        //printf("CRpcSunTransport: clnttcp_create() socket=%d\n", sock);
+
+        if(cl == nullptr)
+        {
+            ERRMSG("CRpcSunTransport", "clnttcp_create() failed" << clnt_spcreateerror((char*)""));
+            close(sock);
+            return false;
+        }
+    }
+    else
+    {
+#if !defined(sun) && !defined(__sun)
+        // Create RPC client for the local program on the designated socket path.
+        cl = clntunix_create((struct sockaddr_un*)addr,
+                             RPC_PROTOBUF_PROG_NUMBER,  // program number
+                             vers,                      // version number
+                             &sock,                     // connected socket
+                             0,                         // send_buf_size
+                             0);                        // recv_buf_size
+
+        if(cl == nullptr)
+        {
+            ERRMSG("CRpcSunTransport", "clntunix_create() failed" << clnt_spcreateerror((char*)""));
+            close(sock);
+            return false;
+        }
+#endif
+    }
+
+    // The CLIENT doesn't own a socket it was given, let clnt_destroy close it
+    clnt_control(cl, CLSET_FD_CLOSE, nullptr);
+    return true;
+}
+
+void CRpcSunTransport::Close()
+{
+    // Destroys the client's RPC handle by deallocating all memory related to the handle.
+    if(cl != nullptr)
+    {
+        clnt_destroy(cl);
+        cl = nullptr;
+    }
+}
+
+void CRpcSunTransport::SetVersion()
+{
+    if(cl == nullptr)
+        return;
+
+    // Switch the program version of an existing CLIENT to match mCodec
+    rpcvers_t vers = (mCodec == CRpc::CODEC::BULK ? RPC_PROTOBUF_VERSION_BULK : RPC_PROTOBUF_VERSION);
+    if(!clnt_control(cl, CLSET_VERS, (char*)&vers))
+    {
+        ERRMSG("CRpcSunTransport", "clnt_control(CLSET_VERS=" << vers << ") failed");
+    }
+}
+
+clnt_stat CRpcSunTransport::Call(CRpc::param* in, CRpc::param* out, const struct timeval& timeout)
+{
+    clnt_stat res = clnt_call(cl, RPC_PROTOBUF_FUNC_PROC,
+                              XdrParamProc(mCodec), (caddr_t)in,
+                              XdrParamProc(mCodec), (caddr_t)out, timeout);
+
+    // Servers built before CODEC::BULK only register RPC_PROTOBUF_VERSION.
+    // Fall back to the legacy codec once, then stick with it.
+    if(res == RPC_PROGVERSMISMATCH && mNegotiate && mCodec == CRpc::CODEC::BULK)
+    {
+        INFOMSG("CRpcSunTransport", "Server doesn't support the bulk codec, falling back to the legacy codec");
+        mCodec = CRpc::CODEC::LEGACY;
+        SetVersion();
+
+        res = clnt_call(cl, RPC_PROTOBUF_FUNC_PROC,
+                        XdrParamProc(mCodec), (caddr_t)in,
+                        XdrParamProc(mCodec), (caddr_t)out, timeout);
+    }
+
+    // The negotiation is done after the first call the server answered
+    if(res != RPC_CANTSEND && res != RPC_CANTRECV && res != RPC_TIMEDOUT)
+        mNegotiate = false;
+
+    if(res != RPC_SUCCESS)
+    {
+        ERRMSG("CRpcSunTransport", "clnt_call() failed" << clnt_sperror(cl, (char*)""));
+    }
+
+    return res;
+}
+
+void CRpcSunTransport::FreeRes(CRpc::param* out)
+{
+    // Free the memory that was allocated when RPC result was decoded
+    if(!clnt_freeres(cl, XdrParamProc(mCodec), (caddr_t)out))
+    {
+        ERRMSG("CRpcSunTransport", "clnt_freeres() failed" << clnt_sperror(cl, (char*)""));
+    }
+}
+
+
+//
+// Class CRpcNativeTransport
+//
+bool CRpcNativeTransport::Connect(const struct sockaddr* addr, socklen_t addrLen, CRpcFrame::deadline_t deadline)
+{
+    if(mSock >= 0)
+    {
+        ERRMSG("CRpcNativeTransport", "Failed - the socket already exists");
+        return false;
+    }
+
+    int sock = ConnectSocket(addr, addrLen, deadline);
+    if(sock < 0)
+        return false;
+
+    int flag = 1;
+    if((addr->sa_family == AF_INET || addr->sa_family == AF_INET6) &&
+       setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &flag, sizeof(flag)) < 0)
+    {
+        ERRMSG("CRpcNativeTransport", "setsockopt(TCP_NODELAY) failed: " << strerror(errno));
+        close(sock);
+        return false;
+    }
+
+#ifdef SO_NOSIGPIPE
+    flag = 1;
+    if(setsockopt(sock, SOL_SOCKET, SO_NOSIGPIPE, &flag, sizeof(flag)) < 0)
+    {
+        ERRMSG("CRpcNativeTransport", "setsockopt(SO_NOSIGPIPE) failed: " << strerror(errno));
+        close(sock);
+        return false;
+    }
+#endif // SO_NOSIGPIPE
+
+    mSock = sock;
+    return true;
+}
+
+void CRpcNativeTransport::Close()
+{
+    if(mSock >= 0)
+    {
+        close(mSock);
+        mSock = -1;
+    }
+
+    mReader.Reset(); // Drop whatever was left from the old connection
+    mGoAway = false;
+}
+
+clnt_stat CRpcNativeTransport::Call(CRpc::param* in, CRpc::param* out, const struct timeval& timeout)
+{
+    uint32_t reqId = 0;
+    clnt_stat res = Send(in, reqId, timeout);
+    if(res != RPC_SUCCESS)
+        return res;
+
+    // Read replies until we get the one for this request. Replies to
+    // earlier calls that timed out are still in the stream, skip them.
+    CRpcFrame::deadline_t deadline = CRpcFrame::Deadline(timeout);
+    uint32_t replyId = 0;
+    do
+    {
+        res = ReceiveFrame(out, replyId, deadline);
+        if(res != RPC_SUCCESS && res != RPC_SYSTEMERROR)
+            return res;
+    }
+    while(replyId != reqId);
+
+    if(res == RPC_SYSTEMERROR)
+    {
+        ERRMSG("CRpcNativeTransport", "Server failed the call, type=" << in->type);
+    }
+
+    return res;
+}
+
+clnt_stat CRpcNativeTransport::Send(CRpc::param* in, uint32_t& reqId, const struct timeval& /*timeout*/)
+{
+    CRpcFrameHeader hdr;
+    hdr.type = (uint32_t)in->type;
+    hdr.reqId = mNextReqId++;
+    hdr.length = in->data_len;
+
+    if(!CRpcFrame::Write(mSock, hdr, in))
+    {
+        ERRMSG("CRpcNativeTransport", "Failed to send request: " << strerror(errno));
+        return RPC_CANTSEND;
+    }
+
+    reqId = hdr.reqId;
+    return RPC_SUCCESS;
+}
+
+clnt_stat CRpcNativeTransport::Receive(CRpc::param* out, uint32_t& reqId, const struct timeval& timeout)
+{
+    return ReceiveFrame(out, reqId, CRpcFrame::Deadline(timeout));
+}
+
+clnt_stat CRpcNativeTransport::ReceiveFrame(CRpc::param* out, uint32_t& reqId, CRpcFrame::deadline_t deadline)
+{
+    CRpcFrameHeader reply;
+    u_char* payload = nullptr;
+
+    int res = 0;
+    while((res = ReadFrame(reply, payload, deadline)) > 0 && (reply.flags & RPC_FRAME_FLAG_GOAWAY))
+    {
+        // The replies to the calls it has read still come
+        INFOMSG("CRpcNativeTransport", "The server is stopping, connect again for new calls");
+        mGoAway = true;
+    }
+
+    if(res == 0)
+    {
+        ERRMSG("CRpcNativeTransport", "Timed out waiting for reply");
+        return RPC_TIMEDOUT;
+    }
+    else if(res == -2 || (res > 0 && !(reply.flags & RPC_FRAME_FLAG_REPLY)))
+    {
+        // The stream is out of sync, the connection can't be used anymore
+        ERRMSG("CRpcNativeTransport", "Invalid reply frame received");
+        Close();
+        return RPC_CANTDECODERES;
+    }
+    else if(res < 0 && mGoAway)
+    {
+        // The server answers every call it runs before it closes the connection
+        ERRMSG("CRpcNativeTransport", "The server has stopped, the call was not run");
+        return RPC_CANTSEND;
+    }
+    else if(res < 0)
+    {
+        ERRMSG("CRpcNativeTransport", "Failed to receive reply: " << strerror(errno));
+        return RPC_CANTRECV;
+    }
+
+    reqId = reply.reqId;
+
+    // OnCall failed on the server
+    if(reply.flags & RPC_FRAME_FLAG_ERROR)
+        return RPC_SYSTEMERROR;
+
+    out->type = (int)reply.type;
+    out->data_len = reply.length;
+    out->data_val = payload;
+    return RPC_SUCCESS;
+}
+
+int CRpcNativeTransport::ReadFrame(CRpcFrameHeader& hdr, u_char*& payload, CRpcFrame::deadline_t deadline)
+{
+    return mReader.Next(mSock, hdr, payload, deadline);
+}
+
+void CRpcNativeTransport::FreeRes(CRpc::param* out)
+{
+    // The reply lives in the read buffer, which is reused by the next call
+    out->data_len = 0;
+    out->data_val = nullptr;
+}
@@ -0,0 +1,288 @@
+//
+//  rpcTransport.h
+//
+#ifndef __RPC_TRANSPORT_H__
+#define __RPC_TRANSPORT_H__
+
+#include <stdint.h>
+#include <sys/socket.h>
+#include <chrono>
+#include <vector>
+#include "rpc.h"
+
+//
+// Native framing
+//
+// Every message is a fixed size header followed by the payload.
+// Header fields are sent in network byte order. The magic is chosen so
+// that its first byte can't start a SunRPC record mark, which lets the
+// server tell native and SunRPC clients apart on the same port.
+//
+#define RPC_FRAME_MAGIC         ((uint32_t)0x50525043) // "PRPC"
+
+#define RPC_FRAME_FLAG_REPLY     ((uint32_t)0x0001) // The frame is the reply to request reqId
+#define RPC_FRAME_FLAG_ERROR     ((uint32_t)0x0002) // OnCall failed, there is no payload
+#define RPC_FRAME_FLAG_SHM       ((uint32_t)0x0004) // Shared memory setup, the payload is the segment name
+#define RPC_FRAME_FLAG_ANY_ORDER ((uint32_t)0x0008) // Request: the client matches replies by reqId, reply when done
+#define RPC_FRAME_FLAG_GOAWAY    ((uint32_t)0x0010) // Reply to no request (reqId 0): the server is stopping, go elsewhere
+
+// Default largest payload a reader takes, see CRpcFrame::SetMaxFrameSize
+#ifndef RPC_MAX_FRAME_SIZE
+#define RPC_MAX_FRAME_SIZE      ((uint32_t)64 << 20)
+#endif
+
+struct CRpcFrameHeader
+{
+    uint32_t magic = RPC_FRAME_MAGIC;
+    uint32_t type = 0;      // CRpc::param::type
+    uint32_t reqId = 0;     // Request id, echoed back in the reply
+    uint32_t flags = 0;     // RPC_FRAME_FLAG_XXX
+    uint32_t length = 0;    // Payload length
+};
+
+//
+// Class CRpcFrame
+//
+class CRpcFrame
+{
+public:
+    typedef std::chrono::steady_clock::time_point deadline_t;
+    static const size_t HEADER_SIZE = 5 * sizeof(uint32_t);
+
+    static deadline_t Deadline(const struct timeval& timeout);
+    static deadline_t NoDeadline() { return deadline_t::max(); }
+
+    // Sent by a server that is stopping. Every call it runs is answered
+    // before it closes the connection, the calls without a reply by then
+    // were not run. Older clients skip it like a reply to no call.
+    static CRpcFrameHeader GoAway()
+    {
+        CRpcFrameHeader hdr;
+        hdr.flags = RPC_FRAME_FLAG_REPLY | RPC_FRAME_FLAG_GOAWAY;
+        return hdr;
+    }
+
+    // A frame with a larger payload is invalid, whoever sends it, so a peer
+    // can't make a reader allocate more than that. Applies to every reader
+    // in the process (server, clients, shared memory).
+    static void SetMaxFrameSize(uint32_t maxSize);
+    static uint32_t MaxFrameSize();
+
+    static void EncodeHeader(const CRpcFrameHeader& hdr, unsigned char* buf);
+
+    // Returns false if the magic is wrong or the payload is larger than MaxFrameSize()
+    static bool DecodeHeader(const unsigned char* buf, CRpcFrameHeader& hdr);
+
+    // Send the header and the payload with a single system call.
+    // Returns false on error (errno is set).
+    static bool Write(int fd, const CRpcFrameHeader& hdr, const void* data, size_t len);
+
+    // Same, but the payload is up to RPC_MAX_IOV segments (hdr.length is their total size)
+    static bool Write(int fd, const CRpcFrameHeader& hdr, const struct iovec* iov, int iovcnt);
+
+    // Send the payload of pr, data_iov if set, data_val otherwise
+    static bool Write(int fd, const CRpcFrameHeader& hdr, const CRpc::param* pr)
+    {
+        return (pr->data_iov != nullptr ? Write(fd, hdr, pr->data_iov, pr->data_iovcnt) :
+                                          Write(fd, hdr, pr->data_val, pr->data_len));
+    }
+
+    // Read exactly len bytes.
+    // Returns 1 on success, 0 on deadline, -1 on error or if the peer disconnected.
+    static int ReadFull(int fd, void* buf, size_t len, deadline_t deadline);
+
+    // Read one frame. The payload is stored in buf, which only grows.
+    // Returns 1 on success, 0 on deadline, -1 on error or if the peer
+    // disconnected, -2 if the frame header is invalid.
+    static int Read(int fd, CRpcFrameHeader& hdr, std::vector<u_char>& buf, deadline_t deadline);
+};
+
+//
+// Class CRpcFrameReader
+//
+// Buffered frame reader. Every read takes as much as the socket has, so
+// pipelined frames that arrived together are returned without more system
+// calls. A frame that is cut short by the deadline stays buffered.
+//
+#define RPC_READ_BUFFER_SIZE    (64 * 1024)
+
+class CRpcFrameReader
+{
+public:
+    // The buffer starts at bufferSize and grows to the largest frame
+    explicit CRpcFrameReader(size_t bufferSize = RPC_READ_BUFFER_SIZE) : mBufferSize(bufferSize) {}
+
+    // Return the next frame, reading from fd only if it isn't buffered yet.
+    // The payload stays valid until the next call.
+    // Returns 1 on success, 0 on deadline (or if a non-blocking fd has no
+    // more data), -1 on error or if the peer disconnected, -2 if the frame
+    // header is invalid.
+    int Next(int fd, CRpcFrameHeader& hdr, u_char*& payload, CRpcFrame::deadline_t deadline);
+
+    // True if Next() can return without reading from the socket
+    bool HasFrame() const;
+
+    void Reset() { mStart = mEnd = 0; }
+    size_t Capacity() const { return mBuf.capacity(); }
+    size_t Buffered() const { return mEnd - mStart; } // Bytes received and not returned yet
+
+private:
+    std::vector<u_char> mBuf;
+    size_t mBufferSize = RPC_READ_BUFFER_SIZE;
+    size_t mStart = 0;  // The first unread byte
+    size_t mEnd = 0;    // The end of the received data
+
+    int Fill(int fd, size_t need, CRpcFrame::deadline_t deadline);
+};
+
+//
+// Class CRpcFrameWriter
+//
+// Collects small frames and sends them with a single system call. Frames
+// larger than the buffer are sent right away, after the collected ones.
+//
+#define RPC_WRITE_BUFFER_SIZE   (64 * 1024)
+
+class CRpcFrameWriter
+{
+public:
+    // Returns false on error (errno is set)
+    bool Add(int fd, const CRpcFrameHeader& hdr, const CRpc::param* pr);
+    bool Flush(int fd);
+
+    // Non-blocking sockets: Append only collects the frame, whatever its
+    // size. Send sends as much as the socket takes and keeps the rest for
+    // the next time. Returns false on error (errno is set).
+    void Append(const CRpcFrameHeader& hdr, const CRpc::param* pr);
+    bool Send(int fd);
+
+    // Take over the frames collected by another writer (never sent by it)
+    void Append(CRpcFrameWriter& other);
+
+    size_t Pending() const { return mBuf.size() - mSent; }
+
+private:
+    std::vector<u_char> mBuf;
+    size_t mSent = 0;   // Bytes of mBuf already sent
+};
+
+//
+// Abstract class CRpcTransport
+//
+// The client side of a connection. CRpcClient::Call goes through it.
+//
+class CRpcTransport
+{
+public:
+    CRpcTransport(CRpc* owner) : mOwner(owner) {}
+    virtual ~CRpcTransport() = default;
+
+    // Gives up at the deadline if the server doesn't accept the connection
+    virtual bool Connect(const struct sockaddr* addr, socklen_t addrLen, CRpcFrame::deadline_t deadline) = 0;
+    virtual void Close() = 0;
+    virtual bool IsValid() = 0;
+
+    // On RPC_SUCCESS out->data_val stays valid until FreeRes(out)
+    virtual clnt_stat Call(CRpc::param* in, CRpc::param* out, const struct timeval& timeout) = 0;
+    virtual void FreeRes(CRpc::param* out) = 0;
+
+    // Pipelining: send a request without waiting for the reply, and receive
+    // the next reply, whichever request it is for. Not supported by SunRPC.
+    virtual clnt_stat Send(CRpc::param* in, uint32_t& reqId, const struct timeval& timeout);
+    virtual clnt_stat Receive(CRpc::param* out, uint32_t& reqId, const struct timeval& timeout);
+
+    // Native frames always carry the payload as raw bytes
+    virtual void SetCodec(CRpc::CODEC /*codec*/) { /**/ }
+    virtual CRpc::CODEC GetCodec() { return CRpc::CODEC::BULK; }
+
+    // Only used by the shared memory transport
+    virtual void SetSpinCount(int /*spinCount*/) { /**/ }
+
+    // The server said it is stopping (native frames only, see RPC_FRAME_FLAG_GOAWAY)
+    virtual bool GoingAway() { return false; }
+
+protected:
+    static xdrproc_t XdrParamProc(CRpc::CODEC codec) { return CRpc::XdrParamProc(codec); }
+
+    // Open a blocking socket connected to addr. The connect itself doesn't
+    // block past the deadline. Returns -1 on failure.
+    int ConnectSocket(const struct sockaddr* addr, socklen_t addrLen, CRpcFrame::deadline_t deadline);
+
+    // Logging goes to the owning client
+    void LogInfo(const char* msg) { mOwner->LogInfo(msg); }
+    void LogError(const char* err) { mOwner->LogError(err); }
+
+private:
+    CRpc* mOwner = nullptr;
+};
+
+//
+// Class CRpcSunTransport
+//
+// SunRPC over clnttcp_create (XDR encoding and record marking).
+//
+class CRpcSunTransport : public CRpcTransport
+{
+public:
+    CRpcSunTransport(CRpc* owner) : CRpcTransport(owner) {}
+    virtual ~CRpcSunTransport() { Close(); }
+
+    virtual bool Connect(const struct sockaddr* addr, socklen_t addrLen, CRpcFrame::deadline_t deadline);
+    virtual void Close();
+    virtual bool IsValid() { return (cl != nullptr); }
+
+    virtual clnt_stat Call(CRpc::param* in, CRpc::param* out, const struct timeval& timeout);
+    virtual void FreeRes(CRpc::param* out);
+
+    virtual void SetCodec(CRpc::CODEC codec) { mCodec = codec; mCodecPinned = true; mNegotiate = false; SetVersion(); }
+    virtual CRpc::CODEC GetCodec() { return mCodec; }
+
+private:
+    CLIENT* cl = nullptr;
+    CRpc::CODEC mCodec = CRpc::CODEC::BULK;
+    bool mCodecPinned = false;
+    bool mNegotiate = true;
+
+    void SetVersion();
+};
+
+//
+// Class CRpcNativeTransport
+//
+// Native length-prefixed frames straight over the socket.
+//
+class CRpcNativeTransport : public CRpcTransport
+{
+public:
+    CRpcNativeTransport(CRpc* owner) : CRpcTransport(owner) {}
+    virtual ~CRpcNativeTransport() { Close(); }
+
+    virtual bool Connect(const struct sockaddr* addr, socklen_t addrLen, CRpcFrame::deadline_t deadline);
+    virtual void Close();
+    virtual bool IsValid() { return (mSock >= 0); }
+
+    virtual clnt_stat Call(CRpc::param* in, CRpc::param* out, const struct timeval& timeout);
+    virtual void FreeRes(CRpc::param* out);
+
+    virtual clnt_stat Send(CRpc::param* in, uint32_t& reqId, const struct timeval& timeout);
+    virtual clnt_stat Receive(CRpc::param* out, uint32_t& reqId, const struct timeval& timeout);
+
+    virtual bool GoingAway() { return mGoAway; }
+
+    int GetSocket() const { return mSock; }
+
+protected:
+    int mSock = -1;
+    uint32_t mNextReqId = 1;
+    CRpcFrameReader mReader;
+    bool mGoAway = false;   // Got RPC_FRAME_FLAG_GOAWAY, until Close
+
+    // Receive with an absolute deadline, Call uses it across skipped replies
+    clnt_stat ReceiveFrame(CRpc::param* out, uint32_t& reqId, CRpcFrame::deadline_t deadline);
+
+    // Read one frame, the way CRpcFrameReader::Next does (same return values).
+    // The payload stays valid until the next read.
+    virtual int ReadFrame(CRpcFrameHeader& hdr, u_char*& payload, CRpcFrame::deadline_t deadline);
+};
+
+#endif // __RPC_TRANSPORT_H__
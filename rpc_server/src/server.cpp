@@ -9,14 +9,19 @@
 class RpcServer : public CRpcServer
 {
 public:
-    RpcServer() = default;
+    RpcServer(bool preFork) : mPreFork(preFork) {}
     ~RpcServer() = default;
 
 private:
+    bool mPreFork = false;  // Worker processes serve many connections each
     bool mIsChildProcess = false;
 
     virtual bool OnConnection(int& sock)
     {
+        // A worker process serves the connection itself
+        if(mPreFork)
+            return true;
+
 //        // Get the connection host name and ip
 //        std::string clientName;
 //        std::string clientIp;
@@ -117,9 +122,17 @@ private:
             case protorpc::RPC_SHUTDOWN:
             {
                 printf("Shuttign down...\n");
-                printf("Note: Since this is multi-process server implementation, we can only\n"
-                       "stop the child server process that is connected to this RPC client.\n"
-                       "The parent server will continue to run.\n");
+                if(mPreFork)
+                {
+                    // The parent stops all the workers
+                    kill(getppid(), SIGTERM);
+                }
+                else
+                {
+                    printf("Note: Since this is multi-process server implementation, we can only\n"
+                           "stop the child server process that is connected to this RPC client.\n"
+                           "The parent server will continue to run.\n");
+                }
 
                 // Send the empty response to show that we are running
                 out->data_len = 0;
@@ -182,7 +195,8 @@ private:
             // Note: In multi-process server implementation, this willl only
             // stop the child server process. It will have no effect on parent
             // server process.
-            Stop();
+            if(!mPreFork)
+                Stop();
         }
 
         // Clean up the response...
@@ -214,6 +228,14 @@ private:
     virtual void LogError(const char* err) { printf("[ERROR] %d: %s\n", getpid(), err); }
 };
 
+static RpcServer* sServer = nullptr;
+
+static void OnTerminate(int /*sig*/)
+{
+    if(sServer != nullptr)
+        sServer->Stop();
+}
+
 int main(int argc, char* argv[])
 {
     // Set stdout and stoerr to "line buffered": On output, data is written when
@@ -224,6 +246,12 @@ int main(int argc, char* argv[])
 
     //unsigned short port = 8000;
     unsigned short port = 53900;
+    const char* socketPath = "/tmp/protorpc.sock"; // For same-host clients
+
+    // "prefork": a fixed number of worker processes serve all the
+    // connections instead of a child process forked for each one
+    bool preFork = (argc > 1 && !strcmp(argv[1], "prefork"));
+    int workers = (argc > 2 ? atoi(argv[2]) : 4);
 
     // Ignore the SIGCHLD to prevent children from transforming into
     // zombies so we don't need to wait and reap them.
@@ -232,17 +260,32 @@ int main(int argc, char* argv[])
     sigemptyset(&sa.sa_mask);
     sa.sa_flags = SA_RESTART; // Restart interrupted system calls
 
-    if(sigaction(SIGCHLD, &sa, nullptr) < 0)
+    if(!preFork && sigaction(SIGCHLD, &sa, nullptr) < 0)
     {
         printf("ERROR: sigaction(SIGCHLD) failed: %s\n", strerror(errno));
         return 1;
     }
 
-    printf("%d: RPC server started on port %d ...\n", getpid(), port);
+    // SIGTERM stops the server (the workers when sent to them)
+    sa.sa_handler = OnTerminate;
+    sa.sa_flags = 0;
+
+    if(sigaction(SIGTERM, &sa, nullptr) < 0)
+    {
+        printf("ERROR: sigaction(SIGTERM) failed: %s\n", strerror(errno));
+        return 1;
+    }
+
+    printf("%d: RPC server started on port %d and %s ...\n", getpid(), port, socketPath);
 
-    RpcServer server;
-    server.Run(port, 2); // 2 seconds timeout
+    RpcServer server(preFork);
+    sServer = &server;
+    server.SetShmSpinCount(100000); // Poll shared memory connections briefly before sleeping
+    if(preFork)
+        server.SetWorkerProcesses(workers);
+    server.Run(port, socketPath, 0); // No timeout, only connections, calls and Stop wake it up
 
+    sServer = nullptr;
     //printf("%d: RPC server: stopped\n", getpid());
     return 0;
 }
@@ -5,7 +5,13 @@
 #include "rpc.pb.h" // Google Protocol Buffers generated header
 #include <unistd.h>
 #include <signal.h>  // sigaction
+#include <arpa/inet.h> // ntohl
 #include <thread>
+#include <algorithm> // std::max
+#include <map>
+#include <vector>
+#include <mutex>
+#include <condition_variable>
 #include "threadPool.h"
 
 class RpcServerMt : public CRpcServer
@@ -37,23 +43,215 @@ class RpcServerMt : public CRpcServer
         RpcServerMt* mServer = nullptr;
     };
 
+    // A call copied out of the connection, for the call pool
+    struct CCall
+    {
+        int mType = 0;
+        std::vector<u_char> mData;
+        CRpcReply mReply;
+    };
+
+    // Runs the calls, interactive ones first (see SetCallClasses)
+    class CCallPool : public CThreadPool
+    {
+    public:
+        CCallPool(RpcServerMt* server) : mServer(server) {}
+        ~CCallPool(){ Destroy(); }
+
+        virtual void OnThreadProc(int threadIndx, void* request)
+        {
+            CCall* call = (CCall*)request;
+
+            CRpc::param in;
+            in.type = call->mType;
+            in.data_len = (u_int)call->mData.size();
+            in.data_val = (call->mData.empty() ? nullptr : call->mData.data());
+
+            if(mServer->OnCall(&in, call->mReply.Out()))
+                call->mReply.Send();
+            else
+                call->mReply.Fail();
+            delete call;
+        }
+
+        RpcServerMt* mServer = nullptr;
+    };
+
 public:
-    RpcServerMt(int threadCount) : mTPool(this)
+    RpcServerMt(int threadCount, int maxThreads, bool eventLoop) : mEventLoop(eventLoop), mTPool(this)
     {
+        // More threads when a connection waits for one for more than 10 ms,
+        // fewer when they have been idle for 30 seconds
+        mTPool.SetElastic(maxThreads, 10, 30000);
 #if defined (__APPLE__) || defined(__MACH__)
         mTPool.Create(threadCount, "RpcServerThreadPool");
 #else
         mTPool.Create(threadCount);
 #endif
     }
-    ~RpcServerMt() = default;
+
+    ~RpcServerMt()
+    {
+        if(mTimer.joinable())
+        {
+            {
+                std::unique_lock<std::mutex> lock(mTimerMutex);
+                mTimerStop = true;
+            }
+            mTimerCond.notify_one();
+            mTimer.join();
+        }
+    }
+
+    // After Run: the pool threads serve the connections still queued for
+    // them (they are closed if the drain timeout has passed), then exit
+    void Finish()
+    {
+        mTPool.Destroy(true /*waitToFinish*/);
+        mCallPool.Destroy(true /*waitToFinish*/);
+    }
+
+    // Run the calls on threadCount threads of a pool with two classes:
+    // interactive calls get 8 turns for every turn of the bulk ones, and
+    // at most 256 bulk calls wait, the others fail right away
+    void SetCallClasses(int threadCount)
+    {
+        const int weights[CALL_CLASSES] = { 8, 1 };
+        const int limits[CALL_CLASSES] = { 4096, 256 };
+        mCallPool.SetPriorityClasses(CALL_CLASSES, weights, limits);
+#if defined (__APPLE__) || defined(__MACH__)
+        mUseCallPool = mCallPool.Create(threadCount, "RpcServerCallPool");
+#else
+        mUseCallPool = mCallPool.Create(threadCount);
+#endif
+    }
+
+    CThreadPool::Stats GetPoolStats() { return mTPool.GetStats(); }
+    CThreadPool::Stats GetCallPoolStats() { return mCallPool.GetStats(); }
+
+    // Reply to RPC_SLEEP from a timer thread instead of sleeping on the
+    // thread that runs the call
+    void SetDeferSleep()
+    {
+        mTimer = std::thread(&RpcServerMt::RunTimer, this);
+    }
 
 private:
     bool mIsChildProcess = false;
+    bool mEventLoop = false;
     CTpool mTPool;   
+
+    // The priority classes of the calls
+    enum
+    {
+        CALL_INTERACTIVE,
+        CALL_BULK,
+        CALL_CLASSES
+    };
+    CCallPool mCallPool{this};
+    bool mUseCallPool = false;
+
+    static int CallClass(int type)
+    {
+        switch(type)
+        {
+            case protorpc::RPC_SLEEP:
+            case protorpc::RPC_FANOUT:
+                return CALL_BULK;
+
+            default:
+                return CALL_INTERACTIVE;
+        }
+    }
+
+    // Deferred RPC_SLEEP replies by the time they are due
+    typedef std::chrono::steady_clock Clock;
+    std::thread mTimer;
+    std::mutex mTimerMutex;
+    std::condition_variable mTimerCond;
+    std::multimap<Clock::time_point, CRpcReply> mTimers;
+    bool mTimerStop = false;
+
+    void RunTimer()
+    {
+        std::unique_lock<std::mutex> lock(mTimerMutex);
+        while(!mTimerStop)
+        {
+            if(mTimers.empty())
+            {
+                mTimerCond.wait(lock);
+                continue;
+            }
+
+            auto it = mTimers.begin();
+            if(it->first > Clock::now())
+            {
+                mTimerCond.wait_until(lock, it->first);
+                continue;
+            }
+
+            CRpcReply reply = std::move(it->second);
+            mTimers.erase(it);
+            lock.unlock();
+
+            reply.Out()->data_len = 0;
+            reply.Out()->data_val = (u_char*)nullptr;
+            reply.Send();
+
+            lock.lock();
+        }
+
+        mTimers.clear(); // The replies still waiting fail
+    }
+
+    virtual void OnCallAsync(const CRpc::param* in, CRpcReply reply)
+    {
+        if(mUseCallPool)
+        {
+            // in is only valid until we return, the call gets a copy
+            CCall* call = new CCall;
+            call->mType = in->type;
+            if(in->data_val != nullptr)
+                call->mData.assign(in->data_val, in->data_val + in->data_len);
+            call->mReply = std::move(reply);
+
+            if(!mCallPool.PostRequestToClass(call, CallClass(in->type)))
+                delete call; // Its class is full, the reply fails
+            return;
+        }
+
+        if(in->type != protorpc::RPC_SLEEP || !mTimer.joinable())
+        {
+            CRpcServer::OnCallAsync(in, std::move(reply));
+            return;
+        }
+
+        uint32_t ms = 0;
+        if(in->data_len != sizeof(ms))
+        {
+            reply.Fail();
+            return;
+        }
+
+        // Nothing holds a thread until the reply is due
+        memcpy(&ms, in->data_val, sizeof(ms));
+        Clock::time_point due = Clock::now() + std::chrono::milliseconds(ntohl(ms));
+
+        std::unique_lock<std::mutex> lock(mTimerMutex);
+        bool first = (mTimers.empty() || due < mTimers.begin()->first);
+        mTimers.emplace(due, std::move(reply));
+        lock.unlock();
+
+        if(first)
+            mTimerCond.notify_one();
+    }
  
     virtual bool OnConnection(int& sock)
     {
+        // The event loop serves the connection itself
+        if(mEventLoop)
+            return true;
+
         mTPool.PostRequest((void*)(int64_t)sock);
 
         // Reset sock to 0 to have CRpcServer skip handling this connection.
@@ -123,6 +321,21 @@ private:
             }
             break;
 
+            // Slow rpc, no data sent back
+            case protorpc::RPC_SLEEP:
+            {
+                uint32_t ms = 0;
+                if(in->data_len != sizeof(ms))
+                    return false;
+
+                memcpy(&ms, in->data_val, sizeof(ms));
+                std::this_thread::sleep_for(std::chrono::milliseconds(ntohl(ms)));
+
+                out->data_len = 0;
+                out->data_val = (u_char*)nullptr;
+            }
+            break;
+
             // Empty rpc, no data received/sent
             case protorpc::RPC_SHUTDOWN:
             {
@@ -227,12 +440,113 @@ int main(int argc, char* argv[])
 
     //unsigned short port = 8000;
     unsigned short port = 53900;
-    int threadCount = 30;  // Number of threads to run
+    const char* socketPath = "/tmp/protorpc.sock"; // For same-host clients
+    int threadCount = 8;   // Number of threads to start with
+    int maxThreads = 128;  // and to grow to, a connection has one to itself
+    int ioThreads = 4;     // Number of event loop threads with "servermt epoll"
+
+    // With "epoll" a few I/O threads serve all the native connections,
+    // otherwise every connection has a thread of the pool to itself.
+    // With "reuseport" there is an I/O thread per core, and each of them
+    // accepts its own connections.
+    // With "staged" the I/O threads only read the calls and send the
+    // replies, handler threads run OnCall.
+    // With "deferred" the I/O threads run the calls, but RPC_SLEEP replies
+    // come from a timer thread and no thread sleeps.
+    // With "classes" the calls run on a pool, where Ping, Data and Echo
+    // calls go ahead of Sleep calls.
+    int handlerThreads = 16;
+    bool reusePort = (argc > 1 && !strcmp(argv[1], "reuseport"));
+    bool staged = (argc > 1 && !strcmp(argv[1], "staged"));
+    bool deferred = (argc > 1 && !strcmp(argv[1], "deferred"));
+    bool classes = (argc > 1 && !strcmp(argv[1], "classes"));
+    bool eventLoop = (argc > 1 && (!strcmp(argv[1], "epoll") || reusePort || staged || deferred || classes));
+    if(reusePort)
+        ioThreads = std::max(1, (int)std::thread::hardware_concurrency());
+
+    // With "multi" a second server with an event loop runs in the same
+    // process on the next port, next to the thread pool one
+    bool multi = (argc > 1 && !strcmp(argv[1], "multi"));
+    RpcServerMt* second = nullptr;
+    std::thread secondThread;
+    if(multi)
+    {
+        printf("%d: RPC server started on port %d with %d I/O threads...\n", getpid(), port + 1, ioThreads);
+
+        second = new RpcServerMt(0, 0, true); // No pool, the event loop serves the connections
+        second->SetEventLoop(ioThreads);
+        secondThread = std::thread([second, port]{ second->Run(port + 1, 0); });
+    }
+
+    if(staged)
+        printf("%d: RPC server started on port %d and %s with %d I/O threads and %d handler threads...\n", getpid(), port, socketPath, ioThreads, handlerThreads);
+    else if(classes)
+        printf("%d: RPC server started on port %d and %s with %d I/O threads and %d call threads...\n", getpid(), port, socketPath, ioThreads, handlerThreads);
+    else if(eventLoop)
+        printf("%d: RPC server started on port %d and %s with %d I/O threads...\n", getpid(), port, socketPath, ioThreads);
+    else
+        printf("%d: RPC server started on port %d and %s with %d to %d threads...\n", getpid(), port, socketPath, threadCount, maxThreads);
+
+    RpcServerMt server(threadCount, maxThreads, eventLoop);
+    server.SetShmSpinCount(100000); // Poll shared memory connections briefly before sleeping
+    if(eventLoop)
+        server.SetEventLoop(ioThreads);
+    server.SetReusePort(reusePort);
+    if(staged)
+        server.SetHandlerThreads(handlerThreads);
+    if(deferred)
+        server.SetDeferSleep();
+    if(classes)
+        server.SetCallClasses(handlerThreads);
+
+    // RPC_SHUTDOWN drains: the clients are told to go elsewhere and the
+    // calls on their way are still served, for up to 10 seconds
+    server.SetDrainTimeout(10);
+    server.Run(port, socketPath, 0); // No timeout, only connections, calls and Stop wake it up
+    server.Finish();
+
+    // Receive buffers are reused, so the allocations only depend on the
+    // number of connections and the largest request, not on the number of calls
+    CRpcServer::Stats stats = server.GetStats();
+    printf("%d: RPC server stopped: %llu calls, %llu receive buffer allocations (%llu bytes)\n", getpid(),
+           (unsigned long long)stats.calls, (unsigned long long)stats.recvBufferAllocs,
+           (unsigned long long)stats.recvBufferBytes);
+    printf("%d: Drained in %.1f ms: %llu clients told to go elsewhere, %llu calls not run\n", getpid(),
+           stats.drainUs / 1000.0, (unsigned long long)stats.goAways, (unsigned long long)stats.droppedCalls);
+    if(staged)
+    {
+        printf("%d: %llu calls queued for the handler threads, %.1f us average wait, %d deepest queue, %llu times full\n", getpid(),
+               (unsigned long long)stats.queuedCalls,
+               (stats.queuedCalls > 0 ? (double)stats.queueWaitUs / stats.queuedCalls : 0.0),
+               stats.queueMaxDepth, (unsigned long long)stats.queueFull);
+    }
+    if(classes)
+    {
+        CThreadPool::Stats poolStats = server.GetCallPoolStats();
+        printf("%d: %llu calls waited %.1f us on average (%llu us at most), %llu rejected\n", getpid(),
+               (unsigned long long)poolStats.requests,
+               (poolStats.requests > 0 ? (double)poolStats.queueWaitUs / poolStats.requests : 0.0),
+               (unsigned long long)poolStats.maxQueueWaitUs, (unsigned long long)poolStats.rejected);
+    }
+    if(!eventLoop)
+    {
+        CThreadPool::Stats poolStats = server.GetPoolStats();
+        printf("%d: %llu connections waited %.1f us on average (%llu us at most), %d threads at most, %llu started, %llu retired\n", getpid(),
+               (unsigned long long)poolStats.requests,
+               (poolStats.requests > 0 ? (double)poolStats.queueWaitUs / poolStats.requests : 0.0),
+               (unsigned long long)poolStats.maxQueueWaitUs, poolStats.peakThreads,
+               (unsigned long long)poolStats.threadsStarted, (unsigned long long)poolStats.threadsRetired);
+    }
 
-    printf("%d: RPC server started on port %d with %d threads...\n", getpid(), port, threadCount);
+    if(second != nullptr)
+    {
+        second->Stop();
+        secondThread.join();
 
-    RpcServerMt server(threadCount);
-    server.Run(port, 2); // 2 seconds timeout
+        stats = second->GetStats();
+        printf("%d: RPC server on port %d stopped: %llu calls\n", getpid(), port + 1, (unsigned long long)stats.calls);
+        delete second;
+    }
 
     return 0;
 }
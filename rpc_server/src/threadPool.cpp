@@ -2,11 +2,31 @@
 //  threadPool.cpp
 //
 #include <memory.h>
+#include <sched.h>  // sched_yield
+#include <unistd.h> // usleep
+#include <limits.h> // INT_MAX
+#include <algorithm>
+#include <chrono>
+#include <string>
 //#include <stdio.h> // for printf
 #include "threadPool.h"
 
+// The pool and the index of the pool thread running, if any
+static thread_local CThreadPool* sWorkerPool = NULL;
+static thread_local int sWorkerIndx = -1;
 
-CThreadPool::CThreadPool() : mThreadsIdArr(NULL), mThreadCount(0), mReady(false)
+// steady_clock, in nanoseconds
+static int64_t Now()
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+CThreadPool::CThreadPool() : mThreadsIdArr(NULL), mSlotUsed(NULL), mThreadStats(NULL), mThreadCount(0), mReady(false),
+    mRejected(0),
+    mWorkStealing(false), mWorkQueues(NULL), mNextQueue(0), mAccepting(false), mPosting(0), mStopping(0), mBatchSize(1),
+    mQueueLimit(0), mFullPolicy(FULL::BLOCK), mWaitingRoom(0),
+    mMinThreads(0), mMaxThreads(0), mElasticMax(0), mTargetWaitMs(10), mIdleTimeoutMs(30000), mIdleThreads(0), mRetire(0),
+    mPeakThreads(0), mThreadsStarted(0), mThreadsRetired(0), mMonitor(), mMonitorRunning(false), mMonitorStop(false)
 {
     //...
 }
@@ -26,6 +46,8 @@ CThreadPool::~CThreadPool()
 //        // Warning: the pool is still running.
 //        ASSERT(!mReady, "CThreadPool::Destroy should be called prior to destroying the pool");
 //    }
+    
+    delete [] mThreadStats; // Destroy keeps them for GetStats
 }
 
 #ifdef __APPLE__
@@ -38,6 +60,11 @@ bool CThreadPool::Create(int threadCount)
         return false;
     
     mThreadCount = threadCount;
+    mMinThreads = threadCount;
+    mMaxThreads = std::max(threadCount, mElasticMax);
+    mPeakThreads = threadCount;
+    mThreadsStarted = 0;
+    mThreadsRetired = 0;
     
     // Create semaphore to wait untill all threads are ready
     CSemaphore semaphoreReady;
@@ -63,21 +90,55 @@ bool CThreadPool::Create(int threadCount)
     if(!mMutex.IsValid())
         goto lError; // Failed to create mutex
     
-    // Create worked threads
-    if((mThreadsIdArr = new pthread_t[mThreadCount]) == NULL)
+    // Create the deques of the threads
+    if(mWorkStealing)
+    {
+        if((mWorkQueues = new CWorkQueue[mThreadCount]) == NULL)
+            goto lError;
+        for(int i=0; i < mThreadCount; i++)
+        {
+            mWorkQueues[i].mMutex.Create();
+            if(!mWorkQueues[i].mMutex.IsValid())
+                goto lError; // Failed to create mutex
+        }
+    }
+    
+    // Create the ring and the semaphore to wait for room in it
+    if(mQueueLimit > 0)
+    {
+        if(!mRing.Create(mQueueLimit))
+            goto lError;
+#ifdef __APPLE__
+        mRoom.Create((std::string(poolName) + "_room").c_str());
+#else
+        mRoom.Create();
+#endif // __APPLE__
+        if(!mRoom.IsValid())
+            goto lError; // Failed to init semaphore
+    }
+    mStopping = 0;
+    
+    // Create worked threads, with room for the ones an elastic pool starts later
+    if((mThreadsIdArr = new pthread_t[mMaxThreads]) == NULL)
         goto lError;
-    memset(mThreadsIdArr, 0, sizeof(pthread_t) * mThreadCount);
+    memset(mThreadsIdArr, 0, sizeof(pthread_t) * mMaxThreads);
+    if((mSlotUsed = new char[mMaxThreads]) == NULL)
+        goto lError;
+    memset(mSlotUsed, 0, mMaxThreads);
+    delete [] mThreadStats;
+    if((mThreadStats = new CThreadStats[mMaxThreads]) == NULL)
+        goto lError;
+    for(int i=0; i < mMaxThreads; i++)
+    {
+        mThreadStats[i].mRequests = 0;
+        mThreadStats[i].mWaitUs = 0;
+        mThreadStats[i].mMaxWaitUs = 0;
+        mThreadStats[i].mRecentMaxWaitUs = 0;
+    }
     
-    CThreadData* threadData;
     for(int i=0; i < mThreadCount; i++)
     {
-        if((threadData = new CThreadData) == NULL)
-            goto lError;
-        threadData->mPool = this;
-        threadData->mIndex = i;
-        threadData->mSemaphoreReady = &semaphoreReady;
-        
-        if(pthread_create(&mThreadsIdArr[i], NULL, ThreadPoolProc, threadData) != 0)
+        if(!StartThread(i, &semaphoreReady))
             goto lError; // Failed to create thread
     }
     
@@ -90,11 +151,21 @@ bool CThreadPool::Create(int threadCount)
     
     //printf("All threads are initialized\n");
     
+    // Start the monitor of an elastic pool
+    if(mElasticMax > 0)
+    {
+        mMonitorStop = false;
+        if(pthread_create(&mMonitor, NULL, MonitorProc, this) != 0)
+            goto lError; // Failed to create thread
+        mMonitorRunning = true;
+    }
+    
     // We are ready!
     {
         CMutexLock s(mMutex);
         mReady = true;
     }
+    mAccepting = true;
     
     return true; // Success
     
@@ -113,6 +184,15 @@ lError:
         delete [] mThreadsIdArr;
         mThreadsIdArr = NULL;
     }
+    delete [] mSlotUsed;
+    mSlotUsed = NULL;
+    delete [] mThreadStats;
+    mThreadStats = NULL;
+    
+    delete [] mWorkQueues;
+    mWorkQueues = NULL;
+    mRing.Destroy();
+    mRoom.Destroy();
     
     mSemaphore.Destroy();
     mMutex.Destroy();
@@ -122,6 +202,14 @@ lError:
 
 void CThreadPool::Destroy(bool waitToFinish)
 {
+    // No thread starts or retires from now on
+    if(mMonitorRunning)
+    {
+        mMonitorStop = true;
+        pthread_join(mMonitor, NULL);
+        mMonitorRunning = false;
+    }
+    
     {
         CMutexLock s(mMutex);
         if(!mReady)
@@ -129,33 +217,49 @@ void CThreadPool::Destroy(bool waitToFinish)
         
         mReady = false; // Prevent from queuing new requests
         
-        // Note: Set hight priority flag to 'false' to wait
-        // untill all current requests are processsed
-        bool highPriority = !waitToFinish;
+        // Wait for the requests being posted to be in the queue
+        mAccepting = false;
+        while(mPosting > 0)
+            sched_yield();
         
-        // Post 'exit' request to all threads
+        // With the queue left as it is, the threads exit as soon as they
+        // are done with what they have taken, otherwise once they find
+        // nothing else to run. Wake up all the idle ones to tell them.
+        mStopping = (waitToFinish ? 1 : 2);
         for(int i = 0; i < mThreadCount; i++)
-        {
-            if(highPriority)
-                mRequestList.push_front(CRequest((void*)(-1)));
-            else
-                mRequestList.push_back(CRequest((void*)(-1)));
-            
-            // Indicate that another request is available
             mSemaphore.Post();
-        }
     }
     
     //printf("Wait for %d threads to finish\n", mThreadCount);
     
-    // Wait for all the threads to finish
-    for(int i=0; i < mThreadCount; i++)
-        pthread_join(mThreadsIdArr[i], NULL);
+    // Wait for all the threads to finish, the retired ones too
+    for(int i=0; i < mMaxThreads; i++)
+    {
+        if(mSlotUsed[i])
+            pthread_join(mThreadsIdArr[i], NULL);
+    }
     
     //printf("All threads are finished\n");
     
     delete [] mThreadsIdArr;
     mThreadsIdArr = NULL;
+    delete [] mSlotUsed;
+    mSlotUsed = NULL;
+    mRetired.clear();
+    mRetire = 0;
+    mThreadCount = 0;
+    
+    // Requests left behind are dropped
+    mRequestList.clear();
+    for(size_t i=0; i < mClasses.size(); i++)
+    {
+        mClasses[i].mRequests.clear();
+        mClasses[i].mCurrent = 0;
+    }
+    delete [] mWorkQueues;
+    mWorkQueues = NULL;
+    mRing.Destroy();
+    mRoom.Destroy();
     
     // Destroy semaphore and mutex...
     mSemaphore.Destroy();
@@ -164,22 +268,48 @@ void CThreadPool::Destroy(bool waitToFinish)
 
 bool CThreadPool::PostRequest(void* request, bool highPriority)
 {
-    if(request == NULL || request == (void*)(-1)) // (-1) will force thread to exit
-        return false;
+    return (PostRequests(&request, 1, highPriority) == 1);
+}
+
+int CThreadPool::PostRequests(void* const* requests, int count, bool highPriority)
+{
+    if(!ValidRequests(requests, count))
+        return 0;
+    
+    if(!mClasses.empty())
+        return PostRequestsToClass(requests, count, (highPriority ? 0 : (int)mClasses.size() - 1));
     
-    // Add request to list
+    if(mWorkStealing || mQueueLimit > 0)
+    {
+        int posted = 0;
+        mPosting++;
+        if(mAccepting)
+            posted = (mWorkStealing ? PushToDeque(requests, count, highPriority) : PostToRing(requests, count));
+        mPosting--;
+        return posted;
+    }
+    
+    // Add requests to list, in one go
     {
         CMutexLock s(mMutex);
         if(!mReady)
-            return false;
+            return 0;
+        
+        int64_t posted = Now();
         if(highPriority)
-            mRequestList.push_front(CRequest(request));
+        {
+            for(int i = count - 1; i >= 0; i--)
+                mRequestList.push_front(CRequest(requests[i], posted));
+        }
         else
-            mRequestList.push_back(CRequest(request));
+        {
+            for(int i = 0; i < count; i++)
+                mRequestList.push_back(CRequest(requests[i], posted));
+        }
     }
     
-    // Update semaphore counter
-    return (mSemaphore.Post() == 0);
+    Wake(count);
+    return count;
 }
 
 void* CThreadPool::ThreadPoolProc(void* param)
@@ -197,44 +327,594 @@ void* CThreadPool::ThreadPoolProc(void* param)
     int threadIndx = threadData->mIndex;
     delete threadData;
     
+    sWorkerPool = pool;
+    sWorkerIndx = threadIndx;
+    
+    // The requests taken at once
+    std::vector<CRequest> batch(pool->mBatchSize);
+    
     pool->OnInitThread(threadIndx);
     
     // Singal that the thread are ready
     if(semaphoreReady != NULL)
         semaphoreReady->Post();
     
+    bool retired = false;
     while(true)
     {
-        pool->mSemaphore.Wait();
+        // The monitor has one thread too many
+        if(pool->TakeRetire())
+        {
+            retired = true;
+            break;
+        }
         
-        // Get request
-        void* request = pool->GetNextRequest();
-        if(request == (void*)(-1))
+        // Destroy: exit right away, or once nothing is left. Nothing is
+        // posted anymore once it is set, so one look at the queue tells.
+        int stopping = pool->mStopping;
+        if(stopping == 2)
             break; // Exit the thread
         
-        // Process request
-        pool->OnThreadProc(threadIndx, request);
+        // Get requests
+        int count = pool->TakeRequests(threadIndx, batch.data(), (int)batch.size());
+        if(count == 0)
+        {
+            if(stopping == 1)
+                break; // Exit the thread
+            
+            // Wait to be woken up. PostRequest only wakes idle threads, so
+            // look again for a request posted before we were counted.
+            pool->mIdleThreads++;
+            count = pool->TakeRequests(threadIndx, batch.data(), (int)batch.size());
+            if(count == 0)
+                pool->mSemaphore.Wait();
+            pool->mIdleThreads--;
+        }
+        
+        for(int i = 0; i < count; i++)
+        {
+            pool->CountRequest(threadIndx, batch[i]);
+            
+            // Process request
+            pool->OnThreadProc(threadIndx, batch[i].mRequest);
+        }
     }
     
     pool->OnExitThread(threadIndx);
     
+    if(retired)
+        pool->OnRetired(threadIndx);
+    
     return (void*)0;
 }
 
+bool CThreadPool::SetWorkStealing(bool enable)
+{
+    CMutexLock s(mMutex);
+    if(mReady)
+        return false; // Created already
+    if(enable && (mQueueLimit > 0 || mElasticMax > 0 || !mClasses.empty()))
+        return false; // Not with a ring, an elastic pool or priority classes
+    mWorkStealing = enable;
+    return true;
+}
+
+bool CThreadPool::SetQueueLimit(int capacity, FULL policy)
+{
+    CMutexLock s(mMutex);
+    if(mReady)
+        return false; // Created already
+    if(capacity > 0 && (mWorkStealing || !mClasses.empty()))
+        return false; // Not with work stealing or priority classes
+    mQueueLimit = (capacity > 0 ? capacity : 0);
+    mFullPolicy = policy;
+    return true;
+}
+
+bool CThreadPool::SetElastic(int maxThreads, int targetWaitMs, int idleTimeoutMs)
+{
+    CMutexLock s(mMutex);
+    if(mReady)
+        return false; // Created already
+    if(maxThreads > 0 && mWorkStealing)
+        return false; // The deques are per thread
+    mElasticMax = (maxThreads > 0 ? maxThreads : 0);
+    mTargetWaitMs = std::max(targetWaitMs, 1);
+    mIdleTimeoutMs = std::max(idleTimeoutMs, 1);
+    return true;
+}
+
+bool CThreadPool::SetPriorityClasses(int count, const int* weights, const int* limits)
+{
+    CMutexLock s(mMutex);
+    if(mReady)
+        return false; // Created already
+    if(count > 0 && (mWorkStealing || mQueueLimit > 0))
+        return false; // The classes are lists
+    if(count > 0 && weights == NULL)
+        return false;
+    
+    mClasses.clear();
+    for(int i=0; i < count; i++)
+    {
+        CClass cls;
+        cls.mWeight = std::max(weights[i], 1);
+        cls.mLimit = (limits != NULL ? std::max(limits[i], 0) : 0);
+        cls.mCurrent = 0;
+        mClasses.push_back(cls);
+    }
+    return true;
+}
+
+bool CThreadPool::SetBatchSize(int count)
+{
+    CMutexLock s(mMutex);
+    if(mReady)
+        return false; // Created already
+    mBatchSize = std::max(count, 1);
+    return true;
+}
+
 int CThreadPool::GetReqCount()
+{
+    if(mWorkStealing)
+    {
+        if(!mAccepting)
+            return 0;
+        
+        int count = 0;
+        for(int i=0; i < mThreadCount; i++)
+        {
+            CMutexLock s(mWorkQueues[i].mMutex);
+            count += (int)mWorkQueues[i].mRequests.size();
+        }
+        return count;
+    }
+    
+    if(mQueueLimit > 0)
+        return (mAccepting ? (int)mRing.Size() : 0);
+    
+    CMutexLock s(mMutex);
+    size_t count = mRequestList.size();
+    for(size_t i=0; i < mClasses.size(); i++)
+        count += mClasses[i].mRequests.size();
+    return (int)count;
+}
+
+int CThreadPool::GetReqCount(int priorityClass)
+{
+    CMutexLock s(mMutex);
+    if(priorityClass < 0 || priorityClass >= (int)mClasses.size())
+        return 0;
+    return (int)mClasses[priorityClass].mRequests.size();
+}
+
+CThreadPool::Stats CThreadPool::GetStats()
+{
+    Stats stats;
+    stats.idleThreads = mIdleThreads;
+    
+    CMutexLock s(mMutex);
+    stats.threads = mThreadCount;
+    stats.peakThreads = mPeakThreads;
+    stats.threadsStarted = mThreadsStarted;
+    stats.threadsRetired = mThreadsRetired;
+    stats.rejected = mRejected;
+    for(int i=0; mThreadStats != NULL && i < mMaxThreads; i++)
+    {
+        stats.requests += mThreadStats[i].mRequests.load(std::memory_order_relaxed);
+        stats.queueWaitUs += mThreadStats[i].mWaitUs.load(std::memory_order_relaxed);
+        stats.maxQueueWaitUs = std::max(stats.maxQueueWaitUs, (uint64_t)mThreadStats[i].mMaxWaitUs.load(std::memory_order_relaxed));
+    }
+    return stats;
+}
+
+bool CThreadPool::ValidRequests(void* const* requests, int count)
+{
+    if(requests == NULL || count <= 0)
+        return false;
+    
+    for(int i = 0; i < count; i++)
+    {
+        if(requests[i] == NULL || requests[i] == (void*)(-1)) // (-1) is reserved
+            return false;
+    }
+    return true;
+}
+
+void CThreadPool::Wake(int count)
+{
+    // A thread counts itself idle before it looks at the queue one last
+    // time and waits: either it sees the requests or we see it idle
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    
+    // Each thread takes up to mBatchSize requests
+    int threads = std::min((count + mBatchSize - 1) / mBatchSize, (int)mIdleThreads);
+    for(int i = 0; i < threads; i++)
+        mSemaphore.Post();
+}
+
+int CThreadPool::TakeRequests(int threadIndx, CRequest* requests, int count)
+{
+    if(mWorkStealing)
+        return StealRequests(threadIndx, requests, count);
+    if(mQueueLimit > 0)
+        return TakeFromRing(requests, count);
+    
+    CMutexLock s(mMutex);
+    int taken = 0;
+    if(!mClasses.empty())
+    {
+        while(taken < count && TakeFromClass(requests[taken]))
+            taken++;
+        return taken;
+    }
+    
+    while(taken < count && !mRequestList.empty())
+    {
+        requests[taken++] = mRequestList.front();
+        mRequestList.pop_front();
+    }
+    return taken;
+}
+
+bool CThreadPool::PostRequestToClass(void* request, int priorityClass)
+{
+    return (PostRequestsToClass(&request, 1, priorityClass) == 1);
+}
+
+int CThreadPool::PostRequestsToClass(void* const* requests, int count, int priorityClass)
+{
+    if(mClasses.empty())
+        return PostRequests(requests, count);
+    
+    if(!ValidRequests(requests, count))
+        return 0;
+    if(priorityClass < 0 || priorityClass >= (int)mClasses.size())
+        return 0;
+    
+    // Add requests to their class, as many as it takes
+    int posted = 0;
+    {
+        CMutexLock s(mMutex);
+        if(!mReady)
+            return 0;
+        
+        CClass& cls = mClasses[priorityClass];
+        int64_t now = Now();
+        for(; posted < count; posted++)
+        {
+            if(cls.mLimit > 0 && (int)cls.mRequests.size() >= cls.mLimit)
+                break;
+            cls.mRequests.push_back(CRequest(requests[posted], now));
+        }
+    }
+    
+    mRejected += (count - posted);
+    Wake(posted);
+    return posted;
+}
+
+bool CThreadPool::TakeFromClass(CRequest& request)
+{
+    // Smooth weighted round-robin over the classes with requests: each one
+    // earns its weight, the one ahead is served and pays for all of them.
+    // Over total weight turns a class gets as many as its weight, spread out.
+    CClass* next = NULL;
+    int total = 0;
+    for(size_t i=0; i < mClasses.size(); i++)
+    {
+        CClass& cls = mClasses[i];
+        if(cls.mRequests.empty())
+            continue;
+        
+        cls.mCurrent += cls.mWeight;
+        total += cls.mWeight;
+        if(next == NULL || cls.mCurrent > next->mCurrent)
+            next = &cls;
+    }
+    
+    if(next == NULL)
+        return false;
+    
+    next->mCurrent -= total;
+    request = next->mRequests.front();
+    next->mRequests.pop_front();
+    
+    // No credit or debt carried over an idle spell
+    if(next->mRequests.empty())
+        next->mCurrent = 0;
+    return true;
+}
+
+int CThreadPool::PushToDeque(void* const* requests, int count, bool highPriority)
+{
+    // A pool thread keeps what it posts, the bottom of its deque is what it
+    // runs next. The requests from other threads go on top, so every deque
+    // runs them in order. A batch goes to one deque, the others steal from it.
+    bool own = (sWorkerPool == this);
+    int indx = (own ? sWorkerIndx : (int)(mNextQueue++ % (unsigned)mThreadCount));
+    
+    {
+        CWorkQueue& queue = mWorkQueues[indx];
+        CMutexLock s(queue.mMutex);
+        int64_t posted = Now();
+        if(own || highPriority)
+        {
+            for(int i = 0; i < count; i++)
+                queue.mRequests.push_back(CRequest(requests[i], posted));
+        }
+        else
+        {
+            for(int i = 0; i < count; i++)
+                queue.mRequests.push_front(CRequest(requests[i], posted));
+        }
+    }
+    
+    // Any thread can take them
+    Wake(count);
+    return count;
+}
+
+int CThreadPool::StealRequests(int threadIndx, CRequest* requests, int count)
+{
+    // The bottom of our own deque first
+    int taken = 0;
+    {
+        CWorkQueue& queue = mWorkQueues[threadIndx];
+        CMutexLock s(queue.mMutex);
+        while(taken < count && !queue.mRequests.empty())
+        {
+            requests[taken++] = queue.mRequests.back();
+            queue.mRequests.pop_back();
+        }
+    }
+    if(taken > 0)
+        return taken;
+    
+    // Then the top of the others, up to half of what one has
+    for(int i=1; i < mThreadCount; i++)
+    {
+        CWorkQueue& queue = mWorkQueues[(threadIndx + i) % mThreadCount];
+        CMutexLock s(queue.mMutex);
+        int steal = std::min(count, (int)(queue.mRequests.size() + 1) / 2);
+        while(taken < steal)
+        {
+            requests[taken++] = queue.mRequests.front();
+            queue.mRequests.pop_front();
+        }
+        if(taken > 0)
+            return taken;
+    }
+    
+    return 0;
+}
+
+int CThreadPool::PostToRing(void* const* requests, int count)
+{
+    int64_t posted = Now();
+    int queued = 0;     // In the ring
+    int woken = 0;      // Of those, the ones Wake was called for
+    int ran = 0;        // Run inline
+    
+    for(int i = 0; i < count; i++)
+    {
+        bool pushed = mRing.Push(requests[i], posted);
+        while(!pushed)
+        {
+            if(mFullPolicy == FULL::REJECT)
+            {
+                mRejected += (count - i);
+                Wake(queued - woken);
+                return queued + ran;
+            }
+            
+            // Whatever came first is in the ring already, get it going
+            Wake(queued - woken);
+            woken = queued;
+            
+            if(mFullPolicy == FULL::RUN_INLINE)
+            {
+                OnThreadProc((sWorkerPool == this ? sWorkerIndx : -1), requests[i]);
+                ran++;
+                break;
+            }
+            
+            // Wait for a thread to take a request. Either it sees mWaitingRoom
+            // and posts mRoom, or we see the room it made.
+            mWaitingRoom++;
+            pushed = mRing.Push(requests[i], posted);
+            if(!pushed)
+                mRoom.Wait();
+            mWaitingRoom--;
+        }
+        
+        if(pushed)
+            queued++;
+    }
+    
+    Wake(queued - woken);
+    return queued + ran;
+}
+
+int CThreadPool::TakeFromRing(CRequest* requests, int count)
+{
+    int taken = 0;
+    while(taken < count && mRing.Pop(requests[taken].mRequest, requests[taken].mPosted))
+        taken++;
+    
+    // Room for whoever waits for it
+    if(taken > 0)
+    {
+        std::atomic_thread_fence(std::memory_order_seq_cst); // The pops before reading mWaitingRoom
+        int waiting = std::min(taken, (int)mWaitingRoom);
+        for(int i = 0; i < waiting; i++)
+            mRoom.Post();
+    }
+    return taken;
+}
+
+void CThreadPool::CountRequest(int threadIndx, const CRequest& request)
+{
+    uint64_t waitUs = (uint64_t)std::max((int64_t)0, (Now() - request.mPosted) / 1000);
+    
+    // Only this thread writes them
+    CThreadStats& stats = mThreadStats[threadIndx];
+    stats.mRequests.store(stats.mRequests.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+    stats.mWaitUs.store(stats.mWaitUs.load(std::memory_order_relaxed) + waitUs, std::memory_order_relaxed);
+    if(waitUs > stats.mMaxWaitUs.load(std::memory_order_relaxed))
+        stats.mMaxWaitUs.store(waitUs, std::memory_order_relaxed);
+    
+    // But the monitor resets this one
+    uint64_t recent = stats.mRecentMaxWaitUs.load(std::memory_order_relaxed);
+    while(waitUs > recent && !stats.mRecentMaxWaitUs.compare_exchange_weak(recent, waitUs, std::memory_order_relaxed))
+        ;
+}
+
+bool CThreadPool::StartThread(int threadIndx, CSemaphore* semaphoreReady)
+{
+    CThreadData* threadData;
+    if((threadData = new CThreadData) == NULL)
+        return false;
+    threadData->mPool = this;
+    threadData->mIndex = threadIndx;
+    threadData->mSemaphoreReady = semaphoreReady;
+    
+    if(pthread_create(&mThreadsIdArr[threadIndx], NULL, ThreadPoolProc, threadData) != 0)
+    {
+        delete threadData;
+        return false; // Failed to create thread
+    }
+    
+    mSlotUsed[threadIndx] = 1;
+    return true;
+}
+
+bool CThreadPool::TakeRetire()
+{
+    int retire = mRetire;
+    while(retire > 0 && !mRetire.compare_exchange_weak(retire, retire - 1))
+        ;
+    return (retire > 0);
+}
+
+void CThreadPool::OnRetired(int threadIndx)
+{
+    // The monitor joins it
+    CMutexLock s(mMutex);
+    mThreadCount--;
+    mThreadsRetired++;
+    mRetired.push_back(threadIndx);
+}
+
+void* CThreadPool::MonitorProc(void* param)
+{
+    ((CThreadPool*)param)->Monitor();
+    return (void*)0;
+}
+
+void CThreadPool::Monitor()
+{
+    // Look a few times per target wait
+    int tickMs = std::min(std::max(mTargetWaitMs / 2, 1), 100);
+    int64_t targetWait = (int64_t)mTargetWaitMs * 1000000;
+    int64_t idleTimeout = (int64_t)mIdleTimeoutMs * 1000000;
+    
+    int64_t backedUpSince = 0;  // There have been more requests than idle threads since
+    int64_t idleSince = Now();  // The fewest idle threads since
+    int minIdle = INT_MAX;
+    
+    while(!mMonitorStop)
+    {
+        usleep(tickMs * 1000);
+        JoinRetired();
+        
+        int64_t now = Now();
+        int queued = GetReqCount();
+        int idle = mIdleThreads - mRetire; // Those asked to exit are as good as gone
+        
+        uint64_t recentMaxWaitUs = 0;
+        for(int i=0; i < mMaxThreads; i++)
+            recentMaxWaitUs = std::max(recentMaxWaitUs, (uint64_t)mThreadStats[i].mRecentMaxWaitUs.exchange(0));
+        
+        // Not enough threads: the requests have waited too long already,
+        // or they will as nobody is there to take them
+        if(queued > idle)
+        {
+            if(backedUpSince == 0)
+                backedUpSince = now;
+            
+            if((int64_t)recentMaxWaitUs * 1000 > targetWait || now - backedUpSince >= targetWait)
+            {
+                Grow(queued - std::max(idle, 0));
+                backedUpSince = 0;
+                idleSince = now;
+                minIdle = INT_MAX;
+                continue;
+            }
+        }
+        else
+            backedUpSince = 0;
+        
+        // Too many: some threads have been idle all along
+        minIdle = std::min(minIdle, idle);
+        if(now - idleSince >= idleTimeout)
+        {
+            Retire(minIdle);
+            idleSince = now;
+            minIdle = INT_MAX;
+        }
+    }
+    
+    JoinRetired();
+}
+
+void CThreadPool::Grow(int count)
 {
     CMutexLock s(mMutex);
-    return (int)mRequestList.size();
+    
+    // At most double at a time
+    count = std::min(count, std::min(mElasticMax - mThreadCount, std::max(mThreadCount, 1)));
+    for(int i=0; i < mMaxThreads && count > 0; i++)
+    {
+        if(mSlotUsed[i])
+            continue;
+        
+        if(!StartThread(i, NULL))
+            break;
+        
+        mThreadCount++;
+        mThreadsStarted++;
+        count--;
+    }
+    mPeakThreads = std::max(mPeakThreads, mThreadCount);
 }
 
-void* CThreadPool::GetNextRequest()
+void CThreadPool::Retire(int count)
 {
     CMutexLock s(mMutex);
-    std::list<CRequest>::iterator itr = mRequestList.begin();
-    if(itr == mRequestList.end())
-        return NULL;
-    void* request = itr->mRequest;
-    mRequestList.erase(itr);
-    return request;
+    
+    // Not below the threads Create started
+    count = std::min(count, mThreadCount - mRetire - mMinThreads);
+    for(int i=0; i < count; i++)
+    {
+        mRetire++;
+        mSemaphore.Post(); // Whichever thread wakes up exits
+    }
 }
 
+void CThreadPool::JoinRetired()
+{
+    std::list<int> retired;
+    {
+        CMutexLock s(mMutex);
+        retired.swap(mRetired);
+    }
+    
+    for(std::list<int>::iterator itr = retired.begin(); itr != retired.end(); ++itr)
+        pthread_join(mThreadsIdArr[*itr], NULL);
+    
+    CMutexLock s(mMutex);
+    for(std::list<int>::iterator itr = retired.begin(); itr != retired.end(); ++itr)
+        mSlotUsed[*itr] = 0;
+}
@@ -6,7 +6,11 @@
 
 #include <pthread.h>
 #include <semaphore.h>
+#include <stdint.h>
+#include <atomic>
+#include <deque>
 #include <list>
+#include <vector>
 
 //
 // Class CSemaphore
@@ -163,16 +167,175 @@ private:
     CMutex& mMutex;
 };
 
+//
+// Class CRequestRing
+//
+// A bounded queue of pointers, with the time each one was pushed, that any
+// number of threads push to and pop from without a lock (D. Vyukov's bounded
+// MPMC queue). The cells are allocated once, by Create, pushing and popping
+// allocate nothing.
+//
+class CRequestRing
+{
+public:
+    CRequestRing() : mCells(NULL), mMask(0), mEnqueuePos(0), mDequeuePos(0) {}
+    ~CRequestRing() { Destroy(); }
+    
+    // The capacity is rounded up to a power of 2
+    bool Create(size_t capacity)
+    {
+        if(mCells != NULL)
+            return false; // Do not recreate
+        
+        size_t size = 2;
+        while(size < capacity)
+            size <<= 1;
+        
+        if((mCells = new CCell[size]) == NULL)
+            return false;
+        for(size_t i = 0; i < size; i++)
+            mCells[i].mSeq.store(i, std::memory_order_relaxed);
+        
+        mMask = size - 1;
+        mEnqueuePos.store(0, std::memory_order_relaxed);
+        mDequeuePos.store(0, std::memory_order_relaxed);
+        return true;
+    }
+    
+    void Destroy()
+    {
+        delete [] mCells;
+        mCells = NULL;
+        mMask = 0;
+    }
+    
+    // false if the ring is full
+    bool Push(void* request, int64_t posted)
+    {
+        size_t pos = mEnqueuePos.load(std::memory_order_relaxed);
+        while(true)
+        {
+            CCell& cell = mCells[pos & mMask];
+            size_t seq = cell.mSeq.load(std::memory_order_acquire);
+            intptr_t dif = (intptr_t)seq - (intptr_t)pos;
+            if(dif == 0)
+            {
+                // The cell is free, take it unless another thread got there first
+                if(mEnqueuePos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+                {
+                    cell.mRequest = request;
+                    cell.mPosted = posted;
+                    cell.mSeq.store(pos + 1, std::memory_order_release);
+                    return true;
+                }
+            }
+            else if(dif < 0)
+                return false; // Full, the cell is still a lap behind
+            else
+                pos = mEnqueuePos.load(std::memory_order_relaxed);
+        }
+    }
+    
+    // false if the ring is empty, or the next request is not there yet
+    bool Pop(void*& request, int64_t& posted)
+    {
+        size_t pos = mDequeuePos.load(std::memory_order_relaxed);
+        while(true)
+        {
+            CCell& cell = mCells[pos & mMask];
+            size_t seq = cell.mSeq.load(std::memory_order_acquire);
+            intptr_t dif = (intptr_t)seq - (intptr_t)(pos + 1);
+            if(dif == 0)
+            {
+                if(mDequeuePos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+                {
+                    request = cell.mRequest;
+                    posted = cell.mPosted;
+                    cell.mSeq.store(pos + mMask + 1, std::memory_order_release); // Free for the next lap
+                    return true;
+                }
+            }
+            else if(dif < 0)
+                return false; // Empty
+            else
+                pos = mDequeuePos.load(std::memory_order_relaxed);
+        }
+    }
+    
+    size_t Size()
+    {
+        size_t dequeuePos = mDequeuePos.load(std::memory_order_relaxed);
+        size_t enqueuePos = mEnqueuePos.load(std::memory_order_relaxed);
+        return (enqueuePos > dequeuePos ? enqueuePos - dequeuePos : 0);
+    }
+    
+private:
+    struct CCell
+    {
+        std::atomic<size_t> mSeq;
+        void* mRequest;
+        int64_t mPosted;
+    };
+    
+    CCell* mCells;
+    size_t mMask;
+    
+    // Producers and consumers don't share a cache line
+    char mPad0[64];
+    std::atomic<size_t> mEnqueuePos;
+    char mPad1[64];
+    std::atomic<size_t> mDequeuePos;
+    char mPad2[64];
+};
+
 //
 // Abstract class CThreadPool
 //
+// By default all the threads take the requests from one list. With
+// SetWorkStealing(true) every thread has a deque of its own instead: a
+// request posted by a pool thread (from OnThreadProc) goes to the bottom
+// of the thread's own deque, other requests are spread over the deques
+// round-robin. A thread takes from the bottom of its own deque and, when
+// it is empty, steals from the top of the others. The threads don't all
+// contend for one lock, but the requests are not run in the order they
+// were posted.
+//
+// With SetQueueLimit the list is replaced by a CRequestRing of that many
+// requests, with no lock and no allocation per request. The requests run
+// in order, highPriority makes no difference. What PostRequest does when
+// the ring is full is up to the FULL policy. A pool thread that blocks on
+// its own full pool can wait forever: requests posted from OnThreadProc
+// want REJECT or RUN_INLINE.
+//
+// With SetElastic the threads Create starts are the minimum. A monitor
+// thread starts more, up to the maximum, when there are more requests
+// than idle threads to take them for longer than the target wait, or a
+// request waited longer than that. Threads idle for the whole idle timeout
+// exit, down to the minimum. Not with work stealing: every thread has a
+// deque of its own there.
+//
+// With SetPriorityClasses the list is split into classes, posted to with
+// PostRequestToClass. While several classes have requests waiting, each
+// one gets turns in proportion to its weight (smooth weighted round-robin),
+// so a busy class slows the others down but never holds them up for good,
+// as highPriority does. A class can have a limit of its own. PostRequest
+// posts to the first class with highPriority, to the last one otherwise.
+// Not with work stealing or a ring.
+//
+// PostRequests posts a batch under one lock and wakes only the idle threads
+// it needs, one per SetBatchSize requests. With a batch size above 1 a
+// thread takes that many requests at once and runs them one after another,
+// which suits many tiny requests but holds the rest of a batch behind a
+// slow one.
+//
 class CThreadPool
 {
     // Helper structure CRequest
     struct CRequest
     {
-        CRequest(void* request) : mRequest(request) {}
+        CRequest(void* request = NULL, int64_t posted = 0) : mRequest(request), mPosted(posted) {}
         void* mRequest;
+        int64_t mPosted; // steady_clock, in nanoseconds
     };
     
     // Helper structure CThreadData
@@ -183,6 +346,57 @@ class CThreadPool
         int mIndex;
     };
     
+    // Helper structure CWorkQueue: the deque of a thread in work-stealing mode
+    struct CWorkQueue
+    {
+        CMutex mMutex;
+        std::deque<CRequest> mRequests;
+    };
+    
+    // Helper structure CClass: the requests of a priority class
+    struct CClass
+    {
+        std::list<CRequest> mRequests;
+        int mWeight;
+        int mLimit;     // 0 for none
+        int mCurrent;   // Smooth weighted round-robin
+    };
+    
+    // Helper structure CThreadStats: what the thread in a slot has taken,
+    // written by that thread only, a cache line each
+    struct CThreadStats
+    {
+        std::atomic<uint64_t> mRequests;
+        std::atomic<uint64_t> mWaitUs;
+        std::atomic<uint64_t> mMaxWaitUs;
+        std::atomic<uint64_t> mRecentMaxWaitUs; // Since the monitor last looked, it resets it
+        char mPad[32];
+    };
+    
+    // What PostRequest does when the queue is full
+public:
+    enum class FULL : char
+    {
+        BLOCK,      // Wait for a thread to take a request
+        REJECT,     // Return false
+        RUN_INLINE  // Call OnThreadProc on the posting thread (threadIndx -1 unless it is a pool thread)
+    };
+    
+    // Threads and the time requests waited for one
+public:
+    struct Stats
+    {
+        int threads = 0;                // Running now
+        int idleThreads = 0;            // Waiting for a request now
+        int peakThreads = 0;            // Most threads at once
+        uint64_t threadsStarted = 0;    // Started after Create (see SetElastic)
+        uint64_t threadsRetired = 0;    // Exited before Destroy, they were idle
+        uint64_t requests = 0;          // Requests taken by the threads
+        uint64_t rejected = 0;          // Requests PostRequest failed, the queue or their class was full
+        uint64_t queueWaitUs = 0;       // Time they waited in the queue, all together
+        uint64_t maxQueueWaitUs = 0;    // Longest wait
+    };
+    
     // Contraction/destruction
 public:
     CThreadPool();
@@ -192,17 +406,71 @@ public:
 private:
     CMutex     mMutex;
     CSemaphore mSemaphore;
-    pthread_t* mThreadsIdArr;
-    int        mThreadCount;
+    pthread_t* mThreadsIdArr;           // mMaxThreads slots
+    char*      mSlotUsed;               // A thread was started in the slot and not joined yet
+    CThreadStats* mThreadStats;         // One per slot
+    int        mThreadCount;            // Running
     bool       mReady;
-    std::list<CRequest> mRequestList;
+    std::list<CRequest> mRequestList;   // Not with priority classes
+    std::vector<CClass> mClasses;
+    std::atomic<uint64_t> mRejected;
+    
+    // Work-stealing mode
+    bool        mWorkStealing;
+    CWorkQueue* mWorkQueues;            // One per thread
+    std::atomic<unsigned> mNextQueue;   // Round-robin for requests from other threads
+    std::atomic<bool> mAccepting;       // PostRequest takes new requests
+    std::atomic<int>  mPosting;         // PostRequest calls in progress
+    std::atomic<int>  mStopping;        // 1 finish the requests and exit, 2 exit right away
+    int               mBatchSize;       // Requests a thread takes at once
+    
+    // Bounded queue, instead of the list
+    int          mQueueLimit;
+    FULL         mFullPolicy;
+    CRequestRing mRing;
+    CSemaphore   mRoom;                 // Posted when a request is taken while mWaitingRoom
+    std::atomic<int> mWaitingRoom;      // PostRequest calls waiting for room in the ring
+    
+    // Elastic thread count
+    int  mMinThreads;                   // The threads Create starts
+    int  mMaxThreads;                   // Slots, the most threads there can be
+    int  mElasticMax;                   // 0 for a fixed number of threads
+    int  mTargetWaitMs;
+    int  mIdleTimeoutMs;
+    std::atomic<int>  mIdleThreads;
+    std::atomic<int>  mRetire;          // Threads asked to exit, not gone yet
+    std::list<int>    mRetired;         // Slots of the threads gone, to join
+    int      mPeakThreads;
+    uint64_t mThreadsStarted;
+    uint64_t mThreadsRetired;
+    pthread_t mMonitor;
+    bool      mMonitorRunning;
+    std::atomic<bool> mMonitorStop;
     
     // Implementation
 private:
-    void* GetNextRequest();
+    bool     ValidRequests(void* const* requests, int count);
+    void     Wake(int count);               // The idle threads count requests need
+    int      TakeRequests(int threadIndx, CRequest* requests, int count); // Doesn't wait, 0 for none
+    bool     TakeFromClass(CRequest& request);
+    int      PushToDeque(void* const* requests, int count, bool highPriority);
+    int      StealRequests(int threadIndx, CRequest* requests, int count);
+    int      PostToRing(void* const* requests, int count);
+    int      TakeFromRing(CRequest* requests, int count);
+    void     CountRequest(int threadIndx, const CRequest& request);
+    bool     StartThread(int threadIndx, CSemaphore* semaphoreReady);
+    bool     TakeRetire();
+    void     OnRetired(int threadIndx);
+    
+    // The monitor of an elastic pool
+    void Monitor();
+    void Grow(int count);
+    void Retire(int count);
+    void JoinRetired();
     
     // Thread's procedure
     static void* ThreadPoolProc(void*);
+    static void* MonitorProc(void*);
     
 public:
 #ifdef __APPLE__
@@ -211,9 +479,24 @@ public:
     bool Create(int threadCount);
 #endif // __APPLE__
     
+    // Before Create
+    bool SetWorkStealing(bool enable);
+    bool SetQueueLimit(int capacity, FULL policy = FULL::BLOCK); // 0 for the list, not with work stealing
+    bool SetElastic(int maxThreads, int targetWaitMs = 10, int idleTimeoutMs = 30000); // 0 for a fixed number
+    bool SetPriorityClasses(int count, const int* weights, const int* limits = NULL);   // 0 for one list
+    bool SetBatchSize(int count);   // 1 by default
+    
     void Destroy(bool waitToFinish = false);
     bool PostRequest(void* request, bool highPriority = false);
+    bool PostRequestToClass(void* request, int priorityClass);
+    
+    // Post count requests at once, returns how many were posted (run inline
+    // counts). None of them is posted if one is NULL.
+    int  PostRequests(void* const* requests, int count, bool highPriority = false);
+    int  PostRequestsToClass(void* const* requests, int count, int priorityClass);
     int  GetReqCount();
+    int  GetReqCount(int priorityClass);
+    Stats GetStats();
     
     // Overrides
 protected:
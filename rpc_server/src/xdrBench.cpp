@@ -0,0 +1,111 @@
+//
+// XDR codec benchmark: CRpc::CODEC::LEGACY vs CRpc::CODEC::BULK
+//
+
+#include <stdio.h>      // printf()
+#include <chrono>
+#include <vector>
+#include "rpc.h"
+
+class CXdrBench : public CRpc
+{
+public:
+    CXdrBench() = default;
+    virtual ~CXdrBench() = default;
+
+    void Run(u_int dataLen)
+    {
+        // Run enough iterations to push ~256MB of payload through each codec
+        int iterations = (int)(((u_int)256 << 20) / dataLen);
+        if(iterations < 4)
+            iterations = 4;
+        else if(iterations > 200000)
+            iterations = 200000;
+
+        std::vector<u_char> data(dataLen, 0x5a);
+
+        Run(CODEC::LEGACY, data, iterations);
+        Run(CODEC::BULK, data, iterations);
+    }
+
+private:
+    void Run(CODEC codec, std::vector<u_char>& data, int iterations)
+    {
+        xdrproc_t xdrParam = CRpc::XdrParamProc(codec);
+
+        param in;
+        in.type = 1;
+        in.data_len = (u_int)data.size();
+        in.data_val = data.data();
+
+        // Worst case is the legacy codec: 4 bytes per payload byte + type + length
+        u_int bufSize = in.data_len * 4 + 16;
+        std::vector<char> buf(bufSize);
+
+        XDR xdrs;
+        u_int wireSize = 0;
+
+        auto start = std::chrono::steady_clock::now();
+        for(int i = 0; i < iterations; ++i)
+        {
+            xdrmem_create(&xdrs, buf.data(), bufSize, XDR_ENCODE);
+            if(!xdrParam(&xdrs, &in, 0))
+            {
+                printf("%s: encode failed\n", __func__);
+                return;
+            }
+            wireSize = xdr_getpos(&xdrs);
+            xdr_destroy(&xdrs);
+        }
+        double encodeSec = Elapsed(start);
+
+        start = std::chrono::steady_clock::now();
+        for(int i = 0; i < iterations; ++i)
+        {
+            param out;
+            xdrmem_create(&xdrs, buf.data(), wireSize, XDR_DECODE);
+            if(!xdrParam(&xdrs, &out, 0) || out.data_len != in.data_len)
+            {
+                printf("%s: decode failed\n", __func__);
+                return;
+            }
+            xdr_destroy(&xdrs);
+
+            // Free the memory that was allocated when param was decoded
+            xdr_free(xdrParam, (char*)&out);
+        }
+        double decodeSec = Elapsed(start);
+
+        double mb = (double)in.data_len * iterations / (1024.0 * 1024.0);
+        printf("%-6s %10u %12u %8d %12.1f %12.1f\n",
+               (codec == CODEC::BULK ? "bulk" : "legacy"),
+               in.data_len, wireSize, iterations, mb / encodeSec, mb / decodeSec);
+    }
+
+    static double Elapsed(const std::chrono::steady_clock::time_point& start)
+    {
+        std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+        return (elapsed.count() > 0 ? elapsed.count() : 1e-9);
+    }
+
+    virtual void LogInfo(const char* msg)  { printf("[INFO]: %s\n", msg); }
+    virtual void LogError(const char* err) { printf("[ERROR]: %s\n", err); }
+};
+
+int main(int argc, char* argv[])
+{
+    // Set stdout and stoerr to "line buffered": On output, data is written when
+    // a newline character is inserted into the stream or when the buffer is full
+    // (or flushed), whatever happens first.
+    setvbuf(stdout, NULL, _IOLBF, BUFSIZ);
+    setvbuf(stderr, NULL, _IOLBF, BUFSIZ);
+
+    printf("%-6s %10s %12s %8s %12s %12s\n", "codec", "payload", "wire bytes", "iters", "encode MB/s", "decode MB/s");
+
+    // Payloads from 16 bytes to 16MB
+    CXdrBench bench;
+    for(u_int dataLen = 16; dataLen <= (16u << 20); dataLen *= 4)
+        bench.Run(dataLen);
+
+    return 0;
+}